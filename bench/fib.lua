@@ -0,0 +1,18 @@
+-- branchy interpreter workload, run by playground/lua with the script on stdin
+
+local function fib(n)
+  if n < 2 then return n end
+  return fib(n - 1) + fib(n - 2)
+end
+
+local t = {}
+for i = 1, 200000 do
+  t[i] = tostring(i % 977)
+end
+
+local count = 0
+for _, v in ipairs(t) do
+  if #v == 3 then count = count + 1 end
+end
+
+print(fib(27), count)
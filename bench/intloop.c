@@ -0,0 +1,34 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * integer alu and branches: collatz chain lengths plus an xorshift
+ * checksum, everything stays in registers.
+ */
+
+#define N (3 * 1000 * 1000)
+
+int main(int argc, char *argv[]) {
+  uint64_t longest = 0, start = 0, hash = 88172645463325252ULL;
+
+  for (uint64_t i = 1; i < N; i++) {
+    uint64_t x = i, len = 0;
+    while (x != 1) {
+      x = (x & 1) ? 3 * x + 1 : x >> 1;
+      len++;
+    }
+    if (len > longest) {
+      longest = len;
+      start = i;
+    }
+    hash ^= hash << 13;
+    hash ^= hash >> 7;
+    hash ^= hash << 17;
+    hash += len;
+  }
+
+  printf("%lu %lu %lx\n", start, longest, hash);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,45 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * memory bound: a dependent pointer chase through a random cycle larger
+ * than the host caches, then streaming copies of the same buffer.
+ */
+
+#define N (4 * 1024 * 1024)
+#define CHASE (8 * 1000 * 1000)
+#define ROUNDS 8
+
+uint32_t next[N], copy[N];
+
+int main(int argc, char *argv[]) {
+  for (uint32_t i = 0; i < N; i++)
+    next[i] = i;
+
+  // sattolo's shuffle gives a single cycle over all slots
+  uint64_t seed = 1;
+  for (uint32_t i = N - 1; i > 0; i--) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    uint32_t j = (seed >> 33) % i;
+    uint32_t t = next[i];
+    next[i] = next[j];
+    next[j] = t;
+  }
+
+  uint32_t p = 0;
+  for (uint32_t i = 0; i < CHASE; i++)
+    p = next[p];
+
+  uint64_t sum = 0;
+  for (int r = 0; r < ROUNDS; r++) {
+    memcpy(copy, next, sizeof(next));
+    for (uint32_t i = 0; i < N; i += 16)
+      sum += copy[i];
+  }
+
+  printf("%u %lu\n", p, sum);
+
+  return EXIT_SUCCESS;
+}
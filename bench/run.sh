@@ -0,0 +1,124 @@
+#!/bin/sh
+# run the benchmark workloads under rvemu and print one record per run.
+#
+# a workload is a guest ELF, or a .lua script which playground/lua reads
+# from stdin. guest stdout goes to /dev/null. the emulator runs with
+# --stats and the counters of its report become extra columns, they are
+# empty (null in json) when a run dies before printing them.
+
+usage() {
+  cat >&2 <<EOF
+Usage: $0 [options] [workload...]
+  -n RUNS     measured runs per workload (default 5)
+  -w WARMUP   unmeasured runs before them (default 1)
+  -f FORMAT   csv or json (default csv)
+  -o FILE     write the records to FILE instead of stdout
+  -e RVEMU    emulator to run (default ./rvemu)
+  -a ARGS     extra emulator options, e.g. "--shared-cache"
+EOF
+  exit 1
+}
+
+runs=5
+warmup=1
+format=csv
+out=
+rvemu=./rvemu
+rvemu_args=
+
+while getopts "n:w:f:o:e:a:h" opt; do
+  case $opt in
+  n) runs=$OPTARG ;;
+  w) warmup=$OPTARG ;;
+  f) format=$OPTARG ;;
+  o) out=$OPTARG ;;
+  e) rvemu=$OPTARG ;;
+  a) rvemu_args=$OPTARG ;;
+  *) usage ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+case $format in
+csv | json) ;;
+*) usage ;;
+esac
+
+bench_dir=$(dirname "$0")
+if [ $# -eq 0 ]; then
+  for f in "$bench_dir"/*.c "$bench_dir"/*.lua; do
+    case $f in
+    *.c) [ -x "${f%.c}" ] && set -- "$@" "${f%.c}" ;;
+    *) set -- "$@" "$f" ;;
+    esac
+  done
+fi
+
+stats_file=$(mktemp)
+trap 'rm -f "$stats_file"' EXIT
+
+fields="insts mips interp_s jit_s syscall_s compile_s"
+
+# stat NAME, one value of the last --stats report
+stat() {
+  sed -n "s/^stats:.* $1=\([^ ]*\).*/\1/p" "$stats_file"
+}
+
+# run_once WORKLOAD, sets wall and status
+run_once() {
+  start=$(date +%s%N)
+  case $1 in
+  *.lua)
+    $rvemu --stats $rvemu_args "$bench_dir/../playground/lua" - <"$1" \
+      >/dev/null 2>"$stats_file"
+    ;;
+  *) $rvemu --stats $rvemu_args "$1" >/dev/null 2>"$stats_file" ;;
+  esac
+  status=$?
+  end=$(date +%s%N)
+  wall=$(((end - start) / 1000000000)).$(printf '%09d' $(((end - start) % 1000000000)))
+}
+
+[ -z "$out" ] || exec >"$out"
+
+if [ "$format" = csv ]; then
+  echo "workload,run,wall_s,status,$(echo $fields | tr ' ' ',')"
+else
+  echo "["
+fi
+
+first=1
+for w in "$@"; do
+  name=$(basename "$w")
+  i=0
+  while [ $i -lt "$warmup" ]; do
+    run_once "$w"
+    i=$((i + 1))
+  done
+
+  i=1
+  while [ $i -le "$runs" ]; do
+    run_once "$w"
+    if [ "$format" = csv ]; then
+      printf '%s,%d,%s,%d' "$name" "$i" "$wall" "$status"
+      for f in $fields; do
+        printf ',%s' "$(stat $f)"
+      done
+      echo
+    else
+      [ $first -eq 1 ] || echo ","
+      printf '  {"workload": "%s", "run": %d, "wall_s": %s, "status": %d' \
+        "$name" "$i" "$wall" "$status"
+      for f in $fields; do
+        v=$(stat $f)
+        printf ', "%s": %s' "$f" "${v:-null}"
+      done
+      printf '}'
+    fi
+    echo "$name: run $i ${wall}s" >&2
+    first=0
+    i=$((i + 1))
+  done
+done
+
+[ "$format" = csv ] || printf '\n]\n'
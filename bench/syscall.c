@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/*
+ * syscall heavy: many small unbuffered writes and time queries, the
+ * harness sends stdout to /dev/null.
+ */
+
+#define N (200 * 1000)
+
+int main(int argc, char *argv[]) {
+  char line[32];
+  struct timeval tv;
+  long usec = 0;
+
+  for (int i = 0; i < N; i++) {
+    int len = snprintf(line, sizeof(line), "line %d\n", i);
+    write(STDOUT_FILENO, line, len);
+    if (i % 16 == 0) {
+      gettimeofday(&tv, NULL);
+      usec += tv.tv_usec & 1;
+    }
+  }
+
+  fprintf(stderr, "%ld\n", usec >= 0);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+#include <riscv_vector.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * RVV kernels over int32 arrays: add, axpy, clamp and a reduction. only
+ * the intrinsics are vector code, the setup and the checksums are scalar
+ * integer code, so the output is bit-exact on every tier.
+ */
+
+#define N (1 * 1000 * 1000)
+#define ROUNDS 100
+
+int32_t a[N], b[N], c[N], y[N];
+
+void vadd(int32_t *dst, const int32_t *src1, const int32_t *src2, size_t n) {
+  for (size_t vl; n > 0; n -= vl, dst += vl, src1 += vl, src2 += vl) {
+    vl = __riscv_vsetvl_e32m4(n);
+    vint32m4_t va = __riscv_vle32_v_i32m4(src1, vl);
+    vint32m4_t vb = __riscv_vle32_v_i32m4(src2, vl);
+    __riscv_vse32_v_i32m4(dst, __riscv_vadd_vv_i32m4(va, vb, vl), vl);
+  }
+}
+
+void axpy(int32_t *dst, const int32_t *src, int32_t k, size_t n) {
+  for (size_t vl; n > 0; n -= vl, dst += vl, src += vl) {
+    vl = __riscv_vsetvl_e32m4(n);
+    vint32m4_t vx = __riscv_vmul_vx_i32m4(__riscv_vle32_v_i32m4(src, vl), k,
+                                          vl);
+    vint32m4_t vy = __riscv_vle32_v_i32m4(dst, vl);
+    __riscv_vse32_v_i32m4(dst, __riscv_vadd_vv_i32m4(vy, vx, vl), vl);
+  }
+}
+
+void clamp(int32_t *dst, int32_t lo, int32_t hi, size_t n) {
+  for (size_t vl; n > 0; n -= vl, dst += vl) {
+    vl = __riscv_vsetvl_e32m4(n);
+    vint32m4_t v = __riscv_vle32_v_i32m4(dst, vl);
+    v = __riscv_vmin_vx_i32m4(__riscv_vmax_vx_i32m4(v, lo, vl), hi, vl);
+    __riscv_vse32_v_i32m4(dst, v, vl);
+  }
+}
+
+int32_t sum(const int32_t *src, size_t n) {
+  vint32m1_t acc = __riscv_vmv_s_x_i32m1(0, 1);
+  for (size_t vl; n > 0; n -= vl, src += vl) {
+    vl = __riscv_vsetvl_e32m4(n);
+    vint32m4_t v = __riscv_vle32_v_i32m4(src, vl);
+    acc = __riscv_vredsum_vs_i32m4_i32m1(v, acc, vl);
+  }
+  return __riscv_vmv_x_s_i32m1_i32(acc);
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 0; i < N; i++) {
+    a[i] = i % 7;
+    b[i] = i % 5 - 2;
+    y[i] = i % 3;
+  }
+
+  uint32_t s = 0, t = 0;
+  for (int r = 0; r < ROUNDS; r++) {
+    vadd(c, a, b, N);
+    axpy(y, c, 3, N);
+    clamp(y, -1000, 1000, N);
+    s += (uint32_t)sum(c, N);
+    t += (uint32_t)sum(y, N);
+  }
+
+  printf("%u %u\n", s, t);
+
+  return EXIT_SUCCESS;
+}
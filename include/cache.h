@@ -3,26 +3,57 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
+#include "perf.h"
+
 #define CACHE_ENTRY_SIZE (64 * 1024)
 #define CACHE_SIZE (64 * 1024 * 1024)
+#define CACHE_BATCH 16 // warm blocks compiled along with a hot one
 
 typedef struct {
   uint64_t pc;
   uint64_t hot;
   uint64_t offset;
+  uint64_t hash;  // hash of the guest code bytes, 0 until the block is published
+  uint64_t owner; // pid of the instance which compiled the block
 } cache_item_t;
 
+/*
+ * the index and the jitcode may live in a shared memory object, so it only
+ * holds offsets which are valid in every process mapping it.
+ */
 typedef struct {
-  uint8_t *jitcode;
   uint64_t offset;
   cache_item_t table[CACHE_ENTRY_SIZE];
+} cache_index_t;
+
+typedef struct {
+  uint8_t *jitcode;
+  cache_index_t *index;
+  bool shared;
+  uint64_t owner;
+  uint64_t hits;
+  uint64_t shared_hits;
+  uint64_t compiled;
+  perf_t *perf; // NULL unless the blocks are reported to perf
+  uint64_t pending[CACHE_BATCH]; // warm pcs not compiled yet, 0 if free
 } cache_t;
 
+#define FNV_BASIS 0xcbf29ce484222325ULL
+
+extern uint64_t fnv(uint64_t h, const void *data, size_t len);
 extern cache_t *new_cache();
+extern cache_t *new_shared_cache(uint64_t ident);
+extern cache_t *new_fork_cache();
+extern void cache_free(cache_t *);
 extern uint8_t *cache_lookup(cache_t *cache, uint64_t pc);
+extern uint8_t *cache_copy(cache_t *, uint8_t *, size_t, uint64_t);
 extern uint8_t *cache_add(cache_t *, uint64_t, uint8_t *, size_t, uint64_t);
+extern void cache_install(cache_t *, uint64_t, uint8_t *, size_t);
 extern bool cache_hot(cache_t *, uint64_t);
+extern int cache_take_pending(cache_t *, uint64_t *, int);
+extern void cache_report(cache_t *, FILE *);
 
 #endif
@@ -0,0 +1,39 @@
+#ifndef __COALESCE_H__
+#define __COALESCE_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * write coalescing of --coalesce-writes. small writes to pipes, ttys and
+ * sockets are gathered in one buffer and written out when it fills, when
+ * the guest writes to another fd, before any syscall but write and writev,
+ * and COALESCE_DELAY_MS after the first buffered byte at the latest.
+ *
+ * the buffer holds the bytes of one fd at a time, so output to stdout and
+ * stderr keeps its order even when both go to the same terminal. a failed
+ * host write is only noticed at the flush, the guest was told it worked.
+ */
+#define COALESCE_SIZE (64 * 1024)
+#define COALESCE_DELAY_MS 50
+#define COALESCE_MAX_FD 1024
+
+typedef struct {
+  int fd; // owner of the buffered bytes, -1 when empty
+  size_t len;
+  uint64_t since_ns; // when the first buffered byte came in
+  int8_t seekable[COALESCE_MAX_FD]; // 0 unknown, 1 yes, -1 no
+  pthread_mutex_t lock;
+  uint8_t buf[COALESCE_SIZE];
+} coalesce_t;
+
+extern coalesce_t *new_coalesce(void);
+extern int64_t coalesce_writev(coalesce_t *, int fd, const struct iovec *iov,
+                               int cnt);
+extern void coalesce_flush(coalesce_t *);
+extern void coalesce_forget(coalesce_t *, int fd);
+
+#endif
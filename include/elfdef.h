@@ -16,11 +16,28 @@
 
 #define PT_LOAD 1
 
+#define SHT_PROGBITS 1
+#define SHT_SYMTAB 2
+#define SHT_RELA 4
+#define SHT_NOBITS 8
+#define SHF_ALLOC 0x2
+#define SHN_UNDEF 0
+#define SHN_ABS 0xfff1
+
+#define STT_FUNC 2
+#define STT_GNU_IFUNC 10
+#define ELF64_ST_TYPE(info) ((info)&0xf)
+
 #define PF_X 0x1
 #define PF_W 0x2
 #define PF_R 0x4
 
+#define R_X86_64_64 1
 #define R_X86_64_PC32 2
+#define R_X86_64_PLT32 4
+#define R_X86_64_32 10
+#define R_X86_64_32S 11
+#define R_X86_64_PC64 24
 
 typedef struct {
   unsigned char e_ident[EI_NIDENT];
@@ -32,6 +32,29 @@ inline int64_t mulhsu_helper(int64_t a, uint64_t b) {
   return negate ? ~res + (a * b == 0) : res;
 }
 
+inline uint64_t rol64(uint64_t x, uint64_t n) {
+  return (x << (n & 0x3f)) | (x >> (-n & 0x3f));
+}
+
+inline uint64_t ror64(uint64_t x, uint64_t n) {
+  return (x >> (n & 0x3f)) | (x << (-n & 0x3f));
+}
+
+inline uint32_t rol32(uint32_t x, uint64_t n) {
+  return (x << (n & 0x1f)) | (x >> (-n & 0x1f));
+}
+
+inline uint32_t ror32(uint32_t x, uint64_t n) {
+  return (x >> (n & 0x1f)) | (x << (-n & 0x1f));
+}
+
+// every non zero byte becomes 0xff, the zero bytes stay 0
+#define ORC_B_LOW7 0x7f7f7f7f7f7f7f7fULL
+#define ORC_B_HIGH 0x8080808080808080ULL
+inline uint64_t orc_b_helper(uint64_t x) {
+  return (((((x & ORC_B_LOW7) + ORC_B_LOW7) | x) & ORC_B_HIGH) >> 7) * 0xff;
+}
+
 #define F32_SIGN ((uint32_t)1 << 31)
 #define F64_SIGN ((uint64_t)1 << 63)
 
@@ -0,0 +1,69 @@
+#ifndef __IR_H__
+#define __IR_H__
+
+#include "rvemu.h"
+
+/*
+ * IR of one segment of a JIT block: the guest code from a label on, with
+ * side exits at conditional branches, up to a jump. every node defines at
+ * most one value and only uses values of earlier nodes, so a segment is in
+ * SSA form. between segments the guest registers live in the x locals of
+ * the block, GETREG and SETREG read and write them.
+ *
+ * instructions the IR does not model become LEGACY nodes, codegen emits
+ * them with the str_t emitters and they are a barrier for every pass.
+ */
+typedef enum {
+  IR_NOP,
+  IR_CONST,  // imm
+  IR_COPY,   // a
+  IR_GETREG, // imm is the register
+  IR_SETREG, // imm = a
+  IR_ADD,
+  IR_SUB,
+  IR_AND,
+  IR_OR,
+  IR_XOR,
+  IR_SHL, // b is below 64
+  IR_SHR,
+  IR_SAR,
+  IR_MUL,
+  IR_SLT,
+  IR_SLTU,
+  IR_SEXT,   // a sign extended from size bytes
+  IR_ZEXT,   // a zero extended from size bytes
+  IR_LOAD,   // size bytes at a, extended by sign
+  IR_STORE,  // size bytes of b at a
+  IR_BRANCH, // to imm if a cond b
+  IR_GOTO,   // imm
+  IR_EXIT,   // leave the block, reenter at a
+  IR_LEGACY, // inst at imm
+} ir_op_t;
+
+typedef enum { IR_EQ, IR_NE, IR_LT, IR_GE, IR_LTU, IR_GEU } ir_cond_t;
+
+typedef struct {
+  ir_op_t op;
+  int32_t a, b; // operand nodes, -1 if unused
+  uint64_t imm;
+  uint8_t size;
+  bool sign;
+  ir_cond_t cond;
+  uint32_t insts; // guest instructions of the segment retired by now
+  inst_t inst;    // IR_LEGACY
+} ir_node_t;
+
+typedef struct {
+  ir_node_t *nodes;
+  uint32_t len;
+  uint32_t cap;
+  uint32_t insts;
+} ir_t;
+
+void ir_reset(ir_t *ir);
+bool ir_add_inst(ir_t *ir, inst_t *inst, uint64_t pc);
+void ir_add_legacy(ir_t *ir, inst_t *inst, uint64_t pc);
+void ir_add_goto(ir_t *ir, uint64_t pc);
+void ir_optimize(ir_t *ir);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __LIBRVEMU_H__
+#define __LIBRVEMU_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * librvemu, the emulator without the rvemu command line.
+ *
+ * guest memory lives at a fixed place of the host address space, so a
+ * process holds one rvemu_t at a time. a guest that faults or makes an
+ * unknown syscall still takes the process down, as it does in rvemu.
+ *
+ * the guest runs on one hart, on the thread calling rvemu_run. clone of a
+ * thread fails with EAGAIN, so pthread_create in the guest reports an error
+ * rather than leaving harts behind that rvemu_destroy would pull the memory
+ * from.
+ */
+typedef struct rvemu rvemu_t;
+
+enum rvemu_status {
+  RVEMU_LIMIT,  // the instruction budget of rvemu_run ran out
+  RVEMU_EXITED, // the guest called exit or exit_group
+};
+
+/*
+ * called for every guest ecall before the built-in syscalls. read the
+ * arguments with rvemu_get_reg, return true with *ret set to handle the
+ * syscall, false to leave it to rvemu.
+ */
+typedef bool (*rvemu_syscall_t)(rvemu_t *emu, uint64_t nr, uint64_t *ret,
+                                void *data);
+
+// NULL if the process already holds an rvemu_t
+rvemu_t *rvemu_create(void);
+void rvemu_destroy(rvemu_t *emu);
+
+// load a riscv64 ELF and set up its stack, argv[0] included, 0 or -errno.
+// -ENOEXEC for a file that is not a well formed riscv64 ELF
+int rvemu_load(rvemu_t *emu, const char *path, int argc, char *argv[]);
+
+// run until the guest exits or retires about insts instructions, 0 is no
+// limit. the budget is checked between blocks, so it may be overshot.
+enum rvemu_status rvemu_run(rvemu_t *emu, uint64_t insts);
+int rvemu_exit_code(rvemu_t *emu);
+uint64_t rvemu_insts(rvemu_t *emu);
+
+// x0 - x31
+uint64_t rvemu_get_reg(rvemu_t *emu, int reg);
+void rvemu_set_reg(rvemu_t *emu, int reg, uint64_t val);
+uint64_t rvemu_get_pc(rvemu_t *emu);
+void rvemu_set_pc(rvemu_t *emu, uint64_t pc);
+
+// guest memory, 0 or -EFAULT if the range is not mapped for the access
+int rvemu_read_mem(rvemu_t *emu, uint64_t addr, void *buf, size_t len);
+int rvemu_write_mem(rvemu_t *emu, uint64_t addr, const void *buf, size_t len);
+
+void rvemu_set_syscall(rvemu_t *emu, rvemu_syscall_t f, void *data);
+
+#endif
@@ -3,8 +3,23 @@
 
 #include "rvemu.h"
 
+// guest mmap area grows down from here, far above the brk heap
+#define MMU_MMAP_TOP 0x100000000000ULL
+// brk heap address space reserved at load, committed MMU_HEAP_COMMIT at a
+// time and handed back once more than MMU_HEAP_SLACK of it is free
+#define MMU_HEAP_RESERVE (16ULL << 30)
+#define MMU_HEAP_COMMIT (1ULL << 20)
+#define MMU_HEAP_SLACK (8ULL << 20)
+
 void mmu_load_elf(mmu_t *mmu, int fd);
 uint64_t mmu_alloc(mmu_t *mmu, int64_t size);
+uint64_t mmu_brk(mmu_t *mmu, uint64_t addr);
+void mmu_heap_report(mmu_t *mmu, FILE *f);
+int64_t mmu_map(mmu_t *mmu, uint64_t addr, uint64_t len, int prot, int flags,
+                int fd, uint64_t offset);
+int64_t mmu_unmap(mmu_t *mmu, uint64_t addr, uint64_t len);
+int64_t mmu_protect(mmu_t *mmu, uint64_t addr, uint64_t len, int prot);
+void mmu_region_map(mmu_t *mmu, uint64_t addr, uint64_t len, int prot);
 
 inline void mmu_write(uint64_t addr, uint8_t *data, size_t len) {
     memcpy((void *)GUEST_TO_HOST(addr), (void *)data, len);
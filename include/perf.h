@@ -0,0 +1,26 @@
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "symtab.h"
+
+/*
+ * tell linux perf about the JIT blocks, by a /tmp/perf-PID.map file and
+ * optionally a jitdump file for `perf inject --jit`.
+ */
+typedef struct {
+  FILE *map;
+  int dump_fd;
+  void *dump_marker; // perf sees the jitdump through this mapping
+  uint64_t code_index;
+  symtab_t *symtab; // names the blocks by guest function
+} perf_t;
+
+extern perf_t *new_perf(bool map, bool jitdump, symtab_t *symtab);
+extern void perf_code_load(perf_t *, uint64_t pc, uint8_t *code, size_t sz);
+
+#endif
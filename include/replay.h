@@ -0,0 +1,30 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * syscall log of --record and --replay. the log is REPLAY_MAGIC, the tid
+ * of the first hart, then a stream of entries: REPLAY_MEM (addr, len,
+ * bytes) for every guest write a syscall made, closed by REPLAY_SYSCALL
+ * (nr, ret). replay copies the bytes back and returns ret instead of
+ * calling the host.
+ */
+#define REPLAY_MAGIC "RVREPLAY"
+#define REPLAY_MEM 'M'
+#define REPLAY_SYSCALL 'S'
+
+typedef struct {
+  FILE *f;
+  bool record;
+  uint64_t seq; // syscalls logged or replayed so far
+} replay_t;
+
+extern replay_t *new_replay(const char *path, bool record, uint64_t *tid);
+extern void replay_effect(replay_t *, uint64_t addr, uint64_t len);
+extern void replay_record(replay_t *, uint64_t nr, uint64_t ret);
+extern uint64_t replay_next(replay_t *, uint64_t nr);
+
+#endif
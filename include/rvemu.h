@@ -2,6 +2,7 @@
 #define __RVEMU_H__
 
 #include "common.h"
+#include "symtab.h"
 
 // #define CONFIG_DEBUG 1
 
@@ -169,6 +170,135 @@ enum inst_type_t {
   inst_fcvt_d_lu,
   inst_fmv_d_x,
 
+  inst_lr_w,
+  inst_sc_w,
+  inst_amoswap_w,
+  inst_amoadd_w,
+  inst_amoxor_w,
+  inst_amoand_w,
+  inst_amoor_w,
+  inst_amomin_w,
+  inst_amomax_w,
+  inst_amominu_w,
+  inst_amomaxu_w,
+
+  inst_lr_d,
+  inst_sc_d,
+  inst_amoswap_d,
+  inst_amoadd_d,
+  inst_amoxor_d,
+  inst_amoand_d,
+  inst_amoor_d,
+  inst_amomin_d,
+  inst_amomax_d,
+  inst_amominu_d,
+  inst_amomaxu_d,
+
+  inst_vsetvli,
+  inst_vsetivli,
+  inst_vsetvl,
+
+  inst_vle8_v,
+  inst_vle16_v,
+  inst_vle32_v,
+  inst_vle64_v,
+  inst_vse8_v,
+  inst_vse16_v,
+  inst_vse32_v,
+  inst_vse64_v,
+
+  inst_vadd_vv,
+  inst_vadd_vx,
+  inst_vadd_vi,
+  inst_vsub_vv,
+  inst_vsub_vx,
+  inst_vrsub_vx,
+  inst_vrsub_vi,
+  inst_vand_vv,
+  inst_vand_vx,
+  inst_vand_vi,
+  inst_vor_vv,
+  inst_vor_vx,
+  inst_vor_vi,
+  inst_vxor_vv,
+  inst_vxor_vx,
+  inst_vxor_vi,
+  inst_vminu_vv,
+  inst_vminu_vx,
+  inst_vmin_vv,
+  inst_vmin_vx,
+  inst_vmaxu_vv,
+  inst_vmaxu_vx,
+  inst_vmax_vv,
+  inst_vmax_vx,
+  inst_vmul_vv,
+  inst_vmul_vx,
+  inst_vmv_v_v,
+  inst_vmv_v_x,
+  inst_vmv_v_i,
+  inst_vredsum_vs,
+  inst_vmv_x_s,
+  inst_vmv_s_x,
+
+  inst_vfadd_vv,
+  inst_vfadd_vf,
+  inst_vfsub_vv,
+  inst_vfsub_vf,
+  inst_vfmul_vv,
+  inst_vfmul_vf,
+  inst_vfdiv_vv,
+  inst_vfdiv_vf,
+  inst_vfmacc_vv,
+  inst_vfmacc_vf,
+  inst_vfmv_v_f,
+  inst_vfredusum_vs,
+  inst_vfredosum_vs,
+  inst_vfmv_f_s,
+  inst_vfmv_s_f,
+
+  inst_add_uw,
+  inst_sh1add,
+  inst_sh2add,
+  inst_sh3add,
+  inst_sh1add_uw,
+  inst_sh2add_uw,
+  inst_sh3add_uw,
+  inst_slli_uw,
+
+  inst_andn,
+  inst_orn,
+  inst_xnor,
+  inst_clz,
+  inst_clzw,
+  inst_ctz,
+  inst_ctzw,
+  inst_cpop,
+  inst_cpopw,
+  inst_max,
+  inst_maxu,
+  inst_min,
+  inst_minu,
+  inst_sext_b,
+  inst_sext_h,
+  inst_zext_h,
+  inst_rol,
+  inst_rolw,
+  inst_ror,
+  inst_rori,
+  inst_roriw,
+  inst_rorw,
+  inst_orc_b,
+  inst_rev8,
+
+  inst_bclr,
+  inst_bclri,
+  inst_bext,
+  inst_bexti,
+  inst_binv,
+  inst_binvi,
+  inst_bset,
+  inst_bseti,
+
   num_insts,
 };
 
@@ -187,11 +317,29 @@ typedef struct {
 /*
  * mmu.c
  */
+typedef struct {
+  uint64_t addr; // guest address, page aligned
+  uint64_t len;
+  int prot;
+} mmu_region_t;
+
 typedef struct {
   uint64_t entry;
+  uint64_t ident; // identity of the loaded ELF file
   uint64_t host_alloc;
   uint64_t alloc;
   uint64_t base;
+  uint64_t mmap_alloc; // lowest guest address handed out by mmap, grows down
+  uint64_t heap_end;   // host end of the reserved brk address space
+  uint64_t heap_dirty; // brk heap below this may hold guest data
+  uint64_t heap_host_calls; // mmap and munmap calls made for brk
+  uint64_t heap_calls_saved; // brk calls a page granular heap would map for
+  uint64_t nharts;   // harts running in this memory
+  uint64_t next_tid; // tid of the last hart, minus the pid
+  symtab_t *symtab;
+  mmu_region_t *regions; // every mapped guest range, in no order
+  size_t nregions;
+  size_t region_cap;
 } mmu_t;
 
 /*
@@ -206,9 +354,33 @@ enum exit_reason_t {
 };
 
 #include "cache.h"
+#include "coalesce.h"
 #include "elfdef.h"
 #include "reg.h"
+#include "replay.h"
+#include "stats.h"
 #include "str.h"
+#include "trace.h"
+#include "uring.h"
+
+/*
+ * V extension, VLEN = 128 so a vector register is one host SSE register
+ */
+#define VLENB 16
+#define VTYPE_VILL (1ULL << 63)
+
+#define VTYPE_SEW(vtype) (8 << (((vtype) >> 3) & 0x7))
+
+inline uint64_t vtype_vlmax(uint64_t vtype) {
+  uint64_t vsew = (vtype >> 3) & 0x7;
+  uint64_t vlmul = vtype & 0x7;
+  if (vsew > 3 || vlmul == 4 || (vtype >> 8) != 0)
+    return 0;
+
+  uint64_t elems = VLENB * 8 / (8 << vsew);
+  // vlmul 5, 6, 7 are the fractional mf8, mf4, mf2
+  return vlmul < 4 ? elems << vlmul : elems >> (8 - vlmul);
+}
 
 typedef struct {
   enum exit_reason_t exit_reason;
@@ -216,22 +388,59 @@ typedef struct {
   uint64_t gp_regs[num_gp_regs];
   fp_reg_t fp_regs[num_fp_regs];
   uint64_t pc;
+  uint64_t reserve_addr; // lr/sc reservation, 0 if none
+  uint64_t reserve_val;
+  uint64_t icount; // retired instructions, JIT code adds at its exits
+  uint64_t vl;
+  uint64_t vtype;
+  uint8_t vregs[32 * VLENB] __attribute__((aligned(16)));
+  // called by JIT code at an ecall, NULL to always leave the block
+  bool (*fast_ecall)(void *state, uint64_t nr, uint64_t a0, uint64_t a1,
+                     uint64_t *ret);
+  // reads a counter csr for JIT code, instret includes the running block
+  uint64_t (*csr_read)(void *state, uint64_t csr, uint64_t instret);
 } state_t;
 
 /*
  * machine.c
  */
-typedef struct {
+typedef struct machine_t machine_t;
+
+// handles the syscall nr and returns true, or leaves it to do_syscall
+typedef bool (*syscall_hook_t)(machine_t *m, uint64_t nr, uint64_t *ret,
+                               void *data);
+
+struct machine_t {
   state_t state;
-  mmu_t mmu;
-  cache_t *cache;
-} machine_t;
+  mmu_t *mmu;     // shared by all harts
+  cache_t *cache; // shared by all harts
+  uint64_t tid;
+  uint64_t clear_child_tid;
+  uint64_t robust_list;
+  stats_t *stats; // shared by all harts, NULL unless --stats
+  uring_t *uring; // shared by all harts, NULL unless --io-uring
+  coalesce_t *coalesce; // shared by all harts, NULL unless --coalesce-writes
+  trace_t *trace; // per hart, NULL unless --trace
+  replay_t *replay; // NULL unless --record or --replay
+  const char *snapshot; // written at the snapshot ecall, NULL unless --snapshot
+  bool fork_server;      // serve forks from the snapshot ecall on
+  bool virtual_clock;    // guest time follows retired instructions
+  uint64_t insts_limit;  // machine_step stops at this icount, 0 if none
+  bool single_hart;      // thread clone fails, set by librvemu
+  bool exited;           // the guest called exit or exit_group
+  uint64_t exit_code;
+  syscall_hook_t syscall_hook;
+  void *syscall_hook_data;
+};
 
 typedef void (*exec_block_func_t)(state_t *);
 
 enum exit_reason_t machine_step(machine_t *m);
+bool machine_run_for(machine_t *m, uint64_t insts);
+void machine_run(machine_t *m);
 void machine_load_program(machine_t *m, const char *prog);
 void machine_setup(machine_t *m, int argc, char *argv[]);
+pid_t machine_fork(machine_t *m);
 
 inline uint64_t machine_get_gp_reg(machine_t *m, int32_t reg) {
   Assert(reg >= 0 && reg <= num_gp_regs, "reg index should >= 0 & <= 31");
@@ -244,8 +453,76 @@ inline void machine_set_gp_reg(machine_t *m, int32_t reg, uint64_t data) {
 }
 
 uint64_t do_syscall(machine_t *m, uint64_t n);
+bool syscall_fast_nr(uint64_t nr);
+bool syscall_fast(void *state, uint64_t nr, uint64_t a0, uint64_t a1,
+                  uint64_t *ret);
 
-str_t machine_genblock(machine_t *m);
+str_t machine_genblock(machine_t *m, uint64_t *pcs, int n);
 uint8_t *machine_compile(machine_t *m, str_t source);
+uint64_t codegen_ident();
+const char *compile_ident();
+
+/*
+ * prof.c
+ *
+ * SIGPROF sampling profiler. a sample is the guest pc plus the call stack
+ * found through ra and the s0 frame pointer chain, the report uses the
+ * folded format of flamegraph.pl.
+ */
+#define PROF_HZ 1000
+#define PROF_MAX_DEPTH 32
+#define PROF_MAX_SAMPLES (1024 * 1024)
+
+typedef struct {
+  uint32_t depth;
+  uint64_t pcs[PROF_MAX_DEPTH]; // leaf first
+} prof_sample_t;
+
+void prof_start(symtab_t *symtab);
+void prof_enter(state_t *state);
+void prof_report(FILE *f);
+
+/*
+ * snapshot.c
+ *
+ * the guest asks for a snapshot with the SYS_snapshot ecall. the file
+ * holds the machine state and the tracked mmu regions, page aligned, so
+ * a restore maps the guest memory copy-on-write straight from the file.
+ */
+#define SYS_snapshot 2048
+#define SNAPSHOT_MAGIC "RVSNAP02"
+
+void machine_snapshot(machine_t *m, const char *path);
+void machine_restore(machine_t *m, const char *path);
+
+/*
+ * timesrc.c
+ *
+ * the guest clocks and the cycle, time and instret csrs. the host clocks
+ * are read through the vDSO, so no query is a host syscall. with
+ * --virtual-clock every clock follows the retired instructions of the
+ * hart instead, one instruction is one cycle and VCLOCK_NS_PER_INST, and
+ * runs of the same input read the same times.
+ */
+#define CSR_CYCLE 0xc00
+#define CSR_TIME 0xc01
+#define CSR_INSTRET 0xc02
+#define TIMEBASE_FREQ 10000000 // ticks of the time csr per second
+#define VCLOCK_NS_PER_INST 1
+#define VCLOCK_EPOCH 1577836800 // realtime of the virtual clock at icount 0
+
+bool csr_is_counter(uint64_t csr);
+uint64_t csr_read(void *state, uint64_t csr, uint64_t instret);
+int guest_clock_gettime(machine_t *m, clockid_t clk, struct timespec *ts);
+
+/*
+ * forksrv.c
+ *
+ * the fork server of AFL: the driver writes 4 bytes to FORKSRV_FD for each
+ * run, gets the child pid and then its wait status on FORKSRV_FD + 1.
+ */
+#define FORKSRV_FD 198
+
+void fork_server(machine_t *m);
 
 #endif
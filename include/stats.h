@@ -0,0 +1,39 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * execution statistics of --stats. every hart adds into the same stats_t,
+ * so the counters are only touched with relaxed atomics.
+ */
+typedef struct {
+  uint64_t start_ns;
+  uint64_t interp_insts;
+  uint64_t jit_insts;
+  uint64_t interp_blocks;
+  uint64_t jit_blocks;
+  uint64_t interp_ns;
+  uint64_t jit_ns;
+  uint64_t syscall_ns;
+  uint64_t compile_ns;
+  uint64_t syscalls;
+  uint64_t fast_syscalls; // served inside JIT blocks
+  uint64_t compiles;
+} stats_t;
+
+inline uint64_t stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define STATS_ADD(stats, field, val)                                           \
+  __atomic_fetch_add(&(stats)->field, (val), __ATOMIC_RELAXED)
+
+extern stats_t *new_stats();
+extern void stats_report(stats_t *, FILE *);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef __SYMTAB_H__
+#define __SYMTAB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * address -> function index of the guest ELF. the file stays mmapped and
+ * the names point straight into its string table.
+ */
+typedef struct {
+  uint64_t addr;
+  uint32_t size;
+  uint32_t name; // offset in strtab
+} symbol_t;
+
+typedef struct {
+  uint8_t *image; // the whole ELF file, read only
+  size_t image_size;
+  const char *strtab;
+  symbol_t *syms; // sorted by addr
+  size_t nsyms;
+} symtab_t;
+
+extern symtab_t *symtab_load(int fd);
+extern void symtab_free(symtab_t *);
+extern const symbol_t *symtab_lookup(symtab_t *, uint64_t addr);
+extern const char *symtab_name(symtab_t *, const symbol_t *);
+extern int symtab_format(symtab_t *, uint64_t addr, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/*
+ * block trace of --trace. the file is TRACE_MAGIC followed by chunks, a
+ * chunk is a trace_chunk_t header and the records of one hart. a record
+ * is one executed block: the zigzag varint of its entry pc minus the
+ * previous entry pc of the chunk, then the varint of its instructions.
+ * every chunk starts from pc 0 so it decodes on its own.
+ */
+#define TRACE_MAGIC "RVTRACE1"
+#define TRACE_BUF_SIZE (1024 * 1024)
+#define TRACE_RECORD_MAX 20 // two 64 bit varints
+
+typedef struct {
+  uint32_t tid;
+  uint32_t size; // bytes of records after the header
+} trace_chunk_t;
+
+typedef struct trace_t {
+  int fd; // O_APPEND, shared by all harts
+  uint32_t tid;
+  uint64_t last_pc;
+  uint32_t len;
+  struct trace_t *next; // every trace is flushed at exit
+  uint8_t buf[TRACE_BUF_SIZE];
+} trace_t;
+
+inline uint8_t *trace_put_varint(uint8_t *p, uint64_t val) {
+  while (val >= 0x80) {
+    *p++ = val | 0x80;
+    val >>= 7;
+  }
+  *p++ = val;
+  return p;
+}
+
+inline const uint8_t *trace_get_varint(const uint8_t *p, const uint8_t *end,
+                                       uint64_t *val) {
+  uint64_t v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t b = *p++;
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *val = v;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+inline uint64_t trace_zigzag(int64_t v) { return (v << 1) ^ (v >> 63); }
+
+inline int64_t trace_unzigzag(uint64_t v) { return (v >> 1) ^ -(v & 1); }
+
+extern trace_t *new_trace(const char *path, uint32_t tid);
+extern trace_t *trace_hart(trace_t *, uint32_t tid);
+extern void trace_forked(trace_t *, uint32_t tid);
+extern void trace_flush(trace_t *);
+
+inline void trace_block(trace_t *trace, uint64_t pc, uint64_t insts) {
+  if (trace->len > TRACE_BUF_SIZE - TRACE_RECORD_MAX)
+    trace_flush(trace);
+
+  uint8_t *p = trace->buf + trace->len;
+  p = trace_put_varint(p, trace_zigzag(pc - trace->last_pc));
+  p = trace_put_varint(p, insts);
+  trace->len = p - trace->buf;
+  trace->last_pc = pc;
+}
+
+#endif
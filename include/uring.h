@@ -0,0 +1,50 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * io_uring backend of --io-uring, on raw syscalls. small writes to regular
+ * files are copied aside and queued as one linked, ordered chain, every
+ * other syscall flushes the chain first. reads, large writes and writes to
+ * pipes, ttys and sockets go to the ring straight from guest memory and
+ * wait for their completion, so the guest sees their errors and short
+ * counts.
+ */
+#define URING_ENTRIES 256
+#define URING_STAGING_SIZE (1024 * 1024)
+#define URING_DEFER_MAX (64 * 1024) // larger writes are not copied
+#define URING_MAX_FD 1024
+
+typedef struct {
+  int fd;
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t sq_mask;
+  uint32_t *sq_array;
+  struct io_uring_sqe *sqes;
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+  uint32_t queued;      // deferred writes not submitted yet
+  uint8_t *staging;     // copies of the deferred writes
+  size_t staging_used;
+  int64_t error;        // first failed deferred write, for the next fsync
+  int8_t regular[URING_MAX_FD]; // 0 unknown, 1 regular file, -1 not
+  pthread_mutex_t lock; // shared by all harts
+} uring_t;
+
+extern uring_t *new_uring(void);
+extern void uring_flush(uring_t *);
+extern int64_t uring_read(uring_t *, int fd, void *buf, size_t len,
+                          int64_t off);
+extern int64_t uring_write(uring_t *, int fd, const void *buf, size_t len,
+                           int64_t off);
+extern int64_t uring_fsync(uring_t *, int fd);
+extern void uring_forget(uring_t *, int fd);
+
+#endif
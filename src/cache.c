@@ -5,6 +5,38 @@
 
 static uint64_t hash(uint64_t pc) { return pc % CACHE_ENTRY_SIZE; }
 
+#define CODE_HASH_BYTES 32
+
+/**
+ * @brief FNV-1a, start from FNV_BASIS or the hash of earlier data
+ *
+ * @param h
+ * @param data
+ * @param len
+ * @return
+ */
+uint64_t fnv(uint64_t h, const void *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    h ^= ((const uint8_t *)data)[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/**
+ * @brief hash the guest code at pc, never crossing into the next page
+ *
+ * @param pc
+ * @return never 0, so 0 can mark an unpublished entry
+ */
+static uint64_t code_hash(uint64_t pc) {
+  uint64_t page_size = getpagesize();
+  uint64_t len = MIN(CODE_HASH_BYTES, page_size - (pc & (page_size - 1)));
+  uint8_t *code = (uint8_t *)GUEST_TO_HOST(pc);
+
+  return fnv(FNV_BASIS, code, len) | 1;
+}
+
 /**
  * @brief 创建完整 cache 组织结构
  *
@@ -12,34 +44,122 @@ static uint64_t hash(uint64_t pc) { return pc % CACHE_ENTRY_SIZE; }
  */
 cache_t *new_cache() {
   cache_t *cache = (cache_t *)calloc(1, sizeof(cache_t));
+  cache->index = (cache_index_t *)calloc(1, sizeof(cache_index_t));
   cache->jitcode =
       (uint8_t *)mmap(NULL, CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  cache->owner = getpid();
+  return cache;
+}
+
+/**
+ * @brief 创建进程间共享的 cache, 运行同一个 ELF 的实例共用已编译的代码块
+ *
+ * the cache lives in a POSIX shared memory object named after the binary
+ * identity and the build: the state_t layout the code assumes, the
+ * compilers and the index layout. so a cache an older rvemu left behind is
+ * never reused. it is never unlinked, remove /dev/shm/rvemu-cache-* to
+ * reset it.
+ *
+ * @param ident identity of the guest binary
+ * @return
+ */
+cache_t *new_shared_cache(uint64_t ident) {
+  uint64_t build = codegen_ident();
+  const char *compiler = compile_ident();
+  build = fnv(build, compiler, strlen(compiler));
+  uint64_t layout[] = {sizeof(cache_index_t), CACHE_SIZE};
+  build = fnv(build, layout, sizeof(layout));
+
+  char name[64];
+  sprintf(name, "/rvemu-cache-%016" PRIx64 "-%016" PRIx64, ident, build);
+
+  int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+  Assert(fd != -1, "shm_open %s: %s", name, strerror(errno));
+
+  uint64_t index_size = ROUNDUP(sizeof(cache_index_t), getpagesize());
+  uint64_t size = index_size + CACHE_SIZE;
+  // every instance truncates to the same size, the new pages are zero filled
+  Assert(ftruncate(fd, size) == 0, "ftruncate %s: %s", name, strerror(errno));
+
+  uint8_t *p = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                               MAP_SHARED, fd, 0);
+  Assert(p != MAP_FAILED, "mmap %s: %s", name, strerror(errno));
+  close(fd);
+
+  cache_t *cache = (cache_t *)calloc(1, sizeof(cache_t));
+  cache->index = (cache_index_t *)p;
+  cache->jitcode = p + index_size;
+  cache->shared = true;
+  cache->owner = getpid();
   return cache;
 }
 
+/**
+ * @brief 创建 fork 之后仍然共享的 cache, fork server 的子进程编译的代码块
+ * 对 server 和之后的子进程都可见
+ *
+ * @return
+ */
+cache_t *new_fork_cache() {
+  uint64_t index_size = ROUNDUP(sizeof(cache_index_t), getpagesize());
+  uint8_t *p = (uint8_t *)mmap(NULL, index_size + CACHE_SIZE,
+                               PROT_READ | PROT_WRITE | PROT_EXEC,
+                               MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+  Assert(p != MAP_FAILED, "mmap fork cache: %s", strerror(errno));
+
+  cache_t *cache = (cache_t *)calloc(1, sizeof(cache_t));
+  cache->index = (cache_index_t *)p;
+  cache->jitcode = p + index_size;
+  cache->owner = getpid();
+  return cache;
+}
+
+void cache_free(cache_t *cache) {
+  uint64_t index_size = ROUNDUP(sizeof(cache_index_t), getpagesize());
+  if (cache->jitcode == (uint8_t *)cache->index + index_size) {
+    munmap(cache->index, index_size + CACHE_SIZE);
+  } else {
+    free(cache->index);
+    munmap(cache->jitcode, CACHE_SIZE);
+  }
+  free(cache);
+}
+
 #define MAX_SEARCH_COUNT 32
 #define CACHE_HOT_COUNT 100000
-
-#define CACHE_IS_HOT (cache->table[index].hot >= CACHE_HOT_COUNT)
+#define CACHE_WARM_COUNT (CACHE_HOT_COUNT / 2)
 
 /**
  * @brief 查找PC是否在cache缓存中, hash直到table空项
  *
- * @param cache 
- * @param pc 
- * @return 
+ * lock free, an entry is only visible once cache_add publishes its hash.
+ *
+ * @param cache
+ * @param pc
+ * @return
  */
 uint8_t *cache_lookup(cache_t *cache, uint64_t pc) {
   Assert(pc != 0, "pc == 0 wrong");
 
+  cache_item_t *table = cache->index->table;
   uint64_t index = hash(pc);
+  uint64_t item_pc;
 
-  while (cache->table[index].pc != 0) {
-    if (cache->table[index].pc == pc) {
-      if (CACHE_IS_HOT)
-        return cache->jitcode + cache->table[index].offset;
-      break;
+  while ((item_pc = __atomic_load_n(&table[index].pc, __ATOMIC_ACQUIRE)) !=
+         0) {
+    if (item_pc == pc) {
+      uint64_t h = __atomic_load_n(&table[index].hash, __ATOMIC_ACQUIRE);
+      if (h == 0)
+        break;
+      if (cache->shared) {
+        if (h != code_hash(pc))
+          break;
+        if (table[index].owner != cache->owner)
+          cache->shared_hits++;
+      }
+      cache->hits++;
+      return cache->jitcode + table[index].offset;
     }
 
     index++;
@@ -55,49 +175,141 @@ static inline uint64_t align_to(uint64_t val, uint64_t align) {
   return (val + align - 1) & ~(align - 1);
 }
 
-uint8_t *cache_add(cache_t *cache, uint64_t pc, uint8_t *code, size_t sz,
-                   uint64_t align) {
-  cache->offset = align_to(cache->offset, align);
-  assert(cache->offset + sz <= CACHE_SIZE);
-
+/**
+ * @brief claim the table entry of pc, inserting it if it is missing
+ *
+ * @param cache
+ * @param pc
+ * @return
+ */
+static cache_item_t *cache_claim(cache_t *cache, uint64_t pc) {
+  cache_item_t *table = cache->index->table;
   uint64_t index = hash(pc);
   uint64_t search_count = 0;
-  while (cache->table[index].pc != 0) {
-    if (cache->table[index].pc == pc) {
-      break;
-    }
+
+  while (true) {
+    uint64_t item_pc = 0;
+    if (__atomic_compare_exchange_n(&table[index].pc, &item_pc, pc, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+        item_pc == pc)
+      return &table[index];
 
     index++;
     index = hash(index);
 
-    assert(++search_count <= MAX_SEARCH_COUNT);
+    Assert(++search_count <= MAX_SEARCH_COUNT,
+           "cache search count > MAX_SEARCH_COUNT");
   }
+}
 
-  memcpy(cache->jitcode + cache->offset, code, sz);
-  cache->table[index].pc = pc;
-  cache->table[index].offset = cache->offset;
-  cache->offset += sz;
-  sys_icache_invalidate(cache->jitcode + cache->table[index].offset, sz);
-  return cache->jitcode + cache->table[index].offset;
+/**
+ * @brief copy code into the jitcode area without publishing it
+ *
+ * @param cache
+ * @param code
+ * @param sz
+ * @param align
+ * @return host address of the copy
+ */
+uint8_t *cache_copy(cache_t *cache, uint8_t *code, size_t sz, uint64_t align) {
+  uint64_t offset = __atomic_load_n(&cache->index->offset, __ATOMIC_RELAXED);
+  uint64_t start;
+  do {
+    start = align_to(offset, align);
+    assert(start + sz <= CACHE_SIZE);
+  } while (!__atomic_compare_exchange_n(&cache->index->offset, &offset,
+                                        start + sz, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+
+  memcpy(cache->jitcode + start, code, sz);
+  sys_icache_invalidate(cache->jitcode + start, sz);
+  return cache->jitcode + start;
 }
 
-bool cache_hot(cache_t *cache, uint64_t pc) {
-  uint64_t index = hash(pc);
-  uint64_t search_count = 0;
-  while (cache->table[index].pc != 0) {
-    if (cache->table[index].pc == pc) {
-      cache->table[index].hot = MIN(++cache->table[index].hot, CACHE_HOT_COUNT);
-      return CACHE_IS_HOT;
-    }
+/**
+ * @brief publish code already copied into the jitcode as the block of pc
+ *
+ * @param cache
+ * @param pc
+ * @param addr returned by cache_copy
+ * @param sz
+ */
+void cache_install(cache_t *cache, uint64_t pc, uint8_t *addr, size_t sz) {
+  cache_item_t *item = cache_claim(cache, pc);
+  item->offset = addr - cache->jitcode;
+  item->owner = cache->owner;
+  __atomic_store_n(&item->hash, code_hash(pc), __ATOMIC_RELEASE);
+  cache->compiled++;
+  if (cache->perf != NULL)
+    perf_code_load(cache->perf, pc, addr, sz);
+}
 
-    index++;
-    index = hash(index);
+uint8_t *cache_add(cache_t *cache, uint64_t pc, uint8_t *code, size_t sz,
+                   uint64_t align) {
+  uint8_t *addr = cache_copy(cache, code, sz, align);
+  cache_install(cache, pc, addr, sz);
+  return addr;
+}
 
-    Assert(++search_count <= MAX_SEARCH_COUNT,
-           "cache search count > MAX_SEARCH_COUNT");
+// a full queue drops pc, it is compiled on its own once hot
+static void cache_pend(cache_t *cache, uint64_t pc) {
+  for (int i = 0; i < CACHE_BATCH; i++) {
+    uint64_t free_slot = 0;
+    if (__atomic_compare_exchange_n(&cache->pending[i], &free_slot, pc, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return;
+  }
+}
+
+/**
+ * @brief count an execution of the block at pc
+ *
+ * a block halfway to hot is queued, it goes to the compiler together with
+ * the next hot block, see cache_take_pending.
+ *
+ * @param cache
+ * @param pc
+ * @return true if pc should be compiled
+ */
+bool cache_hot(cache_t *cache, uint64_t pc) {
+  cache_item_t *item = cache_claim(cache, pc);
+  uint64_t hot = __atomic_add_fetch(&item->hot, 1, __ATOMIC_RELAXED);
+  if (hot == CACHE_WARM_COUNT)
+    cache_pend(cache, pc);
+  return hot >= CACHE_HOT_COUNT;
+}
+
+/**
+ * @brief empty the queue of warm blocks
+ *
+ * @param cache
+ * @param pcs
+ * @param cap
+ * @return the number of pcs not compiled yet
+ */
+int cache_take_pending(cache_t *cache, uint64_t *pcs, int cap) {
+  int n = 0;
+  for (int i = 0; i < CACHE_BATCH && n < cap; i++) {
+    uint64_t pc = __atomic_exchange_n(&cache->pending[i], 0, __ATOMIC_RELAXED);
+    if (pc == 0)
+      continue;
+    cache_item_t *item = cache_claim(cache, pc);
+    if (__atomic_load_n(&item->hash, __ATOMIC_ACQUIRE) == 0)
+      pcs[n++] = pc;
   }
+  return n;
+}
 
-  cache->table[index].pc = pc;
-  cache->table[index].hot = 1;
-  return false;
+/**
+ * @brief print how often the instance hit code compiled by other instances
+ *
+ * @param cache
+ * @param f
+ */
+void cache_report(cache_t *cache, FILE *f) {
+  fprintf(f, "cache: %" PRIu64 " hits, %" PRIu64 " shared (%.2f%%), %" PRIu64
+             " blocks compiled\n",
+          cache->hits, cache->shared_hits,
+          cache->hits ? 100.0 * cache->shared_hits / cache->hits : 0.0,
+          cache->compiled);
 }
@@ -0,0 +1,126 @@
+/**
+ * @file coalesce.c
+ * @brief gather small guest writes into fewer host writes, see coalesce.h
+ */
+
+#include "rvemu.h"
+
+static coalesce_t *coalesce_atexit;
+
+static void coalesce_flush_locked(coalesce_t *c) {
+  uint8_t *p = c->buf;
+  size_t len = c->len;
+  while (len > 0) {
+    ssize_t n = write(c->fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break; // the guest already got its byte count, drop the rest
+    p += n;
+    len -= n;
+  }
+  c->fd = -1;
+  c->len = 0;
+}
+
+void coalesce_flush(coalesce_t *c) {
+  pthread_mutex_lock(&c->lock);
+  coalesce_flush_locked(c);
+  pthread_mutex_unlock(&c->lock);
+}
+
+static void coalesce_flush_at_exit(void) { coalesce_flush(coalesce_atexit); }
+
+/**
+ * @brief the timer, a guest computing for long after a write still shows
+ * its output
+ *
+ * @param arg
+ * @return
+ */
+static void *coalesce_timer(void *arg) {
+  coalesce_t *c = (coalesce_t *)arg;
+  struct timespec delay = {0, COALESCE_DELAY_MS * 1000000L};
+  while (true) {
+    nanosleep(&delay, NULL);
+    pthread_mutex_lock(&c->lock);
+    if (c->len > 0 &&
+        stats_now() - c->since_ns >= COALESCE_DELAY_MS * 1000000ULL)
+      coalesce_flush_locked(c);
+    pthread_mutex_unlock(&c->lock);
+  }
+  return NULL;
+}
+
+coalesce_t *new_coalesce(void) {
+  coalesce_t *c = (coalesce_t *)calloc(1, sizeof(coalesce_t));
+  c->fd = -1;
+  pthread_mutex_init(&c->lock, NULL);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  Assert(pthread_create(&thread, &attr, coalesce_timer, c) == 0,
+         "coalesce timer: %s", strerror(errno));
+  pthread_attr_destroy(&attr);
+
+  coalesce_atexit = c;
+  atexit(coalesce_flush_at_exit);
+  return c;
+}
+
+static bool coalesce_seekable(coalesce_t *c, int fd) {
+  if (fd < 0 || fd >= COALESCE_MAX_FD)
+    return true;
+  if (c->seekable[fd] == 0)
+    c->seekable[fd] =
+        lseek(fd, 0, SEEK_CUR) == -1 && errno == ESPIPE ? -1 : 1;
+  return c->seekable[fd] == 1;
+}
+
+/**
+ * @brief the fd was closed or may name another file now
+ *
+ * @param c
+ * @param fd
+ */
+void coalesce_forget(coalesce_t *c, int fd) {
+  if (fd >= 0 && fd < COALESCE_MAX_FD)
+    c->seekable[fd] = 0;
+}
+
+/**
+ * @brief buffer a guest write
+ *
+ * @param c
+ * @param fd
+ * @param iov host pointers
+ * @param cnt
+ * @return the byte count written, or -1 if the write is not coalesced
+ * and has to go to the host now
+ */
+int64_t coalesce_writev(coalesce_t *c, int fd, const struct iovec *iov,
+                        int cnt) {
+  size_t total = 0;
+  for (int i = 0; i < cnt; i++)
+    total += iov[i].iov_len;
+  if (total > COALESCE_SIZE / 2 || coalesce_seekable(c, fd)) {
+    coalesce_flush(c);
+    return -1;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  if (c->fd != fd || c->len + total > COALESCE_SIZE)
+    coalesce_flush_locked(c);
+  if (c->len == 0) {
+    c->fd = fd;
+    c->since_ns = stats_now();
+  }
+  for (int i = 0; i < cnt; i++) {
+    memcpy(c->buf + c->len, iov[i].iov_base, iov[i].iov_len);
+    c->len += iov[i].iov_len;
+  }
+  pthread_mutex_unlock(&c->lock);
+  return total;
+}
@@ -1,4 +1,5 @@
 #include "decode.h"
+#include "ir.h"
 #include "rvemu.h"
 #include "set.h"
 #include "stack.h"
@@ -185,7 +186,7 @@ FUNC_ALUI(addiw, (sprintf(funcbuf2, "(int64_t)(int32_t)(rs1 + (int64_t)%ldLL)",
     REG_GET(inst->rs1, rs1);                                                   \
     REG_GET(inst->rs2, rs2);                                                   \
     REG_SET_EXPR(inst->rd, expr);                                              \
-    tracer_add_gp_reg_usage(tracer, inst->rs1, inst->rs2, -1);                 \
+    tracer_add_gp_reg_usage(tracer, inst->rs1, inst->rs2, inst->rd, -1);       \
     return s;                                                                  \
   }
 
@@ -195,6 +196,65 @@ FUNC_ALU(remw,
          "rs2 == 0 ? (int64_t)(int32_t)rs1 : "
          "(int64_t)(int32_t)((int64_t)(int32_t)rs1 % (int64_t)(int32_t)rs2)");
 
+/*************************************************************************
+ * BIT MANIPULATION INST
+ *************************************************************************/
+
+/*
+ * with -march=native clang turns these into lea, andn, lzcnt, tzcnt,
+ * popcnt, rol/ror, bswap and bts/btr/btc/bt.
+ */
+#define FUNC_ALUI_EXPR(name, expr)                                             \
+  FUNC_ALUI(name, (sprintf(funcbuf2, expr, inst->imm)))
+#define FUNC_ALU1(name, expr) FUNC_ALUI(name, (strcpy(funcbuf2, expr)))
+
+FUNC_ALU(add_uw, "(uint64_t)(uint32_t)rs1 + rs2");
+FUNC_ALU(sh1add, "(rs1 << 1) + rs2");
+FUNC_ALU(sh2add, "(rs1 << 2) + rs2");
+FUNC_ALU(sh3add, "(rs1 << 3) + rs2");
+FUNC_ALU(sh1add_uw, "((uint64_t)(uint32_t)rs1 << 1) + rs2");
+FUNC_ALU(sh2add_uw, "((uint64_t)(uint32_t)rs1 << 2) + rs2");
+FUNC_ALU(sh3add_uw, "((uint64_t)(uint32_t)rs1 << 3) + rs2");
+FUNC_ALUI_EXPR(slli_uw, "(uint64_t)(uint32_t)rs1 << (%d & 0x3f)");
+
+FUNC_ALU(andn, "rs1 & ~rs2");
+FUNC_ALU(orn, "rs1 | ~rs2");
+FUNC_ALU(xnor, "~(rs1 ^ rs2)");
+FUNC_ALU1(clz, "rs1 ? __builtin_clzll(rs1) : 64");
+FUNC_ALU1(clzw, "(uint32_t)rs1 ? __builtin_clz((uint32_t)rs1) : 32");
+FUNC_ALU1(ctz, "rs1 ? __builtin_ctzll(rs1) : 64");
+FUNC_ALU1(ctzw, "(uint32_t)rs1 ? __builtin_ctz((uint32_t)rs1) : 32");
+FUNC_ALU1(cpop, "__builtin_popcountll(rs1)");
+FUNC_ALU1(cpopw, "__builtin_popcount((uint32_t)rs1)");
+FUNC_ALU(max, "(int64_t)rs1 > (int64_t)rs2 ? rs1 : rs2");
+FUNC_ALU(maxu, "rs1 > rs2 ? rs1 : rs2");
+FUNC_ALU(min, "(int64_t)rs1 < (int64_t)rs2 ? rs1 : rs2");
+FUNC_ALU(minu, "rs1 < rs2 ? rs1 : rs2");
+FUNC_ALU1(sext_b, "(int64_t)(int8_t)rs1");
+FUNC_ALU1(sext_h, "(int64_t)(int16_t)rs1");
+FUNC_ALU(zext_h, "(uint16_t)rs1");
+FUNC_ALU(rol, "(rs1 << (rs2 & 0x3f)) | (rs1 >> (-rs2 & 0x3f))");
+FUNC_ALU(rolw, "(int64_t)(int32_t)(((uint32_t)rs1 << (rs2 & 0x1f)) | "
+               "((uint32_t)rs1 >> (-rs2 & 0x1f)))");
+FUNC_ALU(ror, "(rs1 >> (rs2 & 0x3f)) | (rs1 << (-rs2 & 0x3f))");
+FUNC_ALUI_EXPR(rori, "(rs1 >> (%1$d & 0x3f)) | (rs1 << (-%1$d & 0x3f))");
+FUNC_ALUI_EXPR(roriw, "(int64_t)(int32_t)(((uint32_t)rs1 >> (%1$d & 0x1f)) | "
+                      "((uint32_t)rs1 << (-%1$d & 0x1f)))");
+FUNC_ALU(rorw, "(int64_t)(int32_t)(((uint32_t)rs1 >> (rs2 & 0x1f)) | "
+               "((uint32_t)rs1 << (-rs2 & 0x1f)))");
+FUNC_ALU1(orc_b, "(((((rs1 & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | "
+                 "rs1) & 0x8080808080808080ULL) >> 7) * 0xff");
+FUNC_ALU1(rev8, "__builtin_bswap64(rs1)");
+
+FUNC_ALU(bclr, "rs1 & ~(1ULL << (rs2 & 0x3f))");
+FUNC_ALUI_EXPR(bclri, "rs1 & ~(1ULL << (%d & 0x3f))");
+FUNC_ALU(bext, "(rs1 >> (rs2 & 0x3f)) & 1");
+FUNC_ALUI_EXPR(bexti, "(rs1 >> (%d & 0x3f)) & 1");
+FUNC_ALU(binv, "rs1 ^ (1ULL << (rs2 & 0x3f))");
+FUNC_ALUI_EXPR(binvi, "rs1 ^ (1ULL << (%d & 0x3f))");
+FUNC_ALU(bset, "rs1 | (1ULL << (rs2 & 0x3f))");
+FUNC_ALUI_EXPR(bseti, "rs1 | (1ULL << (%d & 0x3f))");
+
 /*************************************************************************
  * BRANCH INST
  *************************************************************************/
@@ -258,8 +318,51 @@ static str_t func_jal(str_t s, inst_t *inst, tracer_t *tracer, stack_t *stack,
   return s;
 }
 
+// counter reads only, see interp.c
+#define FUNC_CSR(inst)                                                         \
+  static str_t func_##inst(str_t s, inst_t *inst, tracer_t *tracer,            \
+                           stack_t *stack, uint64_t pc) {                      \
+    Assert(csr_is_counter(inst->csr) && inst->rs1 == 0,                        \
+           "unimplemented csr %#x", inst->csr);                                \
+    tracer_add_gp_reg_usage(tracer, inst->rd, -1);                             \
+    sprintf(funcbuf2,                                                          \
+            "state->csr_read((void *)state, %d, state->icount + icount)",      \
+            inst->csr);                                                        \
+    REG_SET_EXPR(inst->rd, funcbuf2);                                          \
+    return s;                                                                  \
+  }
+
+FUNC_CSR(csrrc);
+FUNC_CSR(csrrci);
+FUNC_CSR(csrrs);
+FUNC_CSR(csrrsi);
+
+static bool block_fast_ecall(uint64_t pc);
+
 static str_t func_ecall(str_t s, inst_t *inst, tracer_t *tracer, stack_t *stack,
                         uint64_t pc) {
+  // trivial syscalls are served by a host helper and the block goes on.
+  // only for a known number, pc + 4 of other ecalls may not be code at all.
+  // the pointer lives in state because shared cache code has no addresses
+  if (!block_fast_ecall(pc))
+    goto exit;
+
+  s = str_append(s, "    if (state->fast_ecall) {\n");
+  // the virtual clock reads the retired instructions
+  s = str_append(s, "        state->icount += icount;\n");
+  s = str_append(s, "        icount = 0;\n");
+  s = str_append(s, "        uint64_t ret;\n");
+  s = str_append(s, "        if (state->fast_ecall((void *)state, x17, x10, "
+                    "x11, &ret)) {\n");
+  s = str_append(s, "            x10 = ret;\n");
+  sprintf(funcbuf, "            goto inst_%lx;\n", pc + 4);
+  s = str_append(s, funcbuf);
+  s = str_append(s, "        }\n");
+  s = str_append(s, "    }\n");
+  stack_push(stack, pc + 4);
+  tracer_add_gp_reg_usage(tracer, a0, a1, a7, -1);
+
+exit:
   s = str_append(s, "    state->exit_reason = ecall;\n");
   sprintf(funcbuf, "    state->reenter_pc = %luULL;\n", pc + 4);
   s = str_append(s, funcbuf);
@@ -283,6 +386,339 @@ static str_t func_ecall(str_t s, inst_t *inst, tracer_t *tracer, stack_t *stack,
 FUNC_FSTORE(fsw, "uint32_t");
 FUNC_FSTORE(fsd, "uint64_t");
 
+static str_t func_fence(str_t s, inst_t *inst, tracer_t *tracer,
+                        stack_t *stack, uint64_t pc) {
+  s = str_append(s, "    __atomic_thread_fence(__ATOMIC_SEQ_CST);\n");
+  return s;
+}
+
+/*************************************************************************
+ * ATOMIC INST
+ *************************************************************************/
+
+#define FUNC_LR(name, type)                                                    \
+  static str_t func_##name(str_t s, inst_t *inst, tracer_t *tracer,            \
+                           stack_t *stack, uint64_t pc) {                      \
+    REG_GET(inst->rs1, rs1);                                                   \
+    sprintf(funcbuf,                                                           \
+            "    %s rd = __atomic_load_n((%s *)GUEST_TO_HOST(rs1), "           \
+            "__ATOMIC_SEQ_CST);\n",                                            \
+            type, type);                                                       \
+    s = str_append(s, funcbuf);                                                \
+    s = str_append(s, "    state->reserve_addr = rs1;\n");                     \
+    s = str_append(s, "    state->reserve_val = (uint64_t)rd;\n");             \
+    REG_SET_EXPR(inst->rd, "(int64_t)rd");                                     \
+    tracer_add_gp_reg_usage(tracer, inst->rs1, inst->rd, -1);                  \
+    return s;                                                                  \
+  }
+
+FUNC_LR(lr_w, "int32_t");
+FUNC_LR(lr_d, "int64_t");
+
+#define FUNC_SC(name, type)                                                    \
+  static str_t func_##name(str_t s, inst_t *inst, tracer_t *tracer,            \
+                           stack_t *stack, uint64_t pc) {                      \
+    REG_GET(inst->rs1, rs1);                                                   \
+    REG_GET(inst->rs2, rs2);                                                   \
+    sprintf(funcbuf, "    %s expected = (%s)state->reserve_val;\n", type,      \
+            type);                                                             \
+    s = str_append(s, funcbuf);                                                \
+    s = str_append(s, "    bool ok = state->reserve_addr == rs1 && ");         \
+    sprintf(funcbuf, "__atomic_compare_exchange_n((%s *)GUEST_TO_HOST(rs1), ", \
+            type);                                                             \
+    s = str_append(s, funcbuf);                                                \
+    sprintf(funcbuf, "&expected, (%s)rs2, false, ", type);                     \
+    s = str_append(s, funcbuf);                                                \
+    s = str_append(s, "__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);\n");               \
+    s = str_append(s, "    state->reserve_addr = 0;\n");                       \
+    REG_SET_EXPR(inst->rd, "!ok");                                             \
+    tracer_add_gp_reg_usage(tracer, inst->rs1, inst->rs2, inst->rd, -1);       \
+    return s;                                                                  \
+  }
+
+FUNC_SC(sc_w, "int32_t");
+FUNC_SC(sc_d, "int64_t");
+
+#define FUNC_AMO(name, type, op)                                               \
+  static str_t func_##name(str_t s, inst_t *inst, tracer_t *tracer,            \
+                           stack_t *stack, uint64_t pc) {                      \
+    REG_GET(inst->rs1, rs1);                                                   \
+    REG_GET(inst->rs2, rs2);                                                   \
+    sprintf(funcbuf,                                                           \
+            "    %s old = " op "((%s *)GUEST_TO_HOST(rs1), (%s)rs2, "          \
+            "__ATOMIC_SEQ_CST);\n",                                            \
+            type, type, type);                                                 \
+    s = str_append(s, funcbuf);                                                \
+    REG_SET_EXPR(inst->rd, "(int64_t)old");                                    \
+    tracer_add_gp_reg_usage(tracer, inst->rs1, inst->rs2, inst->rd, -1);       \
+    return s;                                                                  \
+  }
+
+FUNC_AMO(amoswap_w, "int32_t", "__atomic_exchange_n");
+FUNC_AMO(amoadd_w, "int32_t", "__atomic_fetch_add");
+FUNC_AMO(amoxor_w, "int32_t", "__atomic_fetch_xor");
+FUNC_AMO(amoand_w, "int32_t", "__atomic_fetch_and");
+FUNC_AMO(amoor_w, "int32_t", "__atomic_fetch_or");
+FUNC_AMO(amoswap_d, "int64_t", "__atomic_exchange_n");
+FUNC_AMO(amoadd_d, "int64_t", "__atomic_fetch_add");
+FUNC_AMO(amoxor_d, "int64_t", "__atomic_fetch_xor");
+FUNC_AMO(amoand_d, "int64_t", "__atomic_fetch_and");
+FUNC_AMO(amoor_d, "int64_t", "__atomic_fetch_or");
+
+#define FUNC_AMO_MINMAX(name, type, stype, cmp)                                \
+  static str_t func_##name(str_t s, inst_t *inst, tracer_t *tracer,            \
+                           stack_t *stack, uint64_t pc) {                      \
+    REG_GET(inst->rs1, rs1);                                                   \
+    REG_GET(inst->rs2, rs2);                                                   \
+    sprintf(funcbuf, "    %s *mem = (%s *)GUEST_TO_HOST(rs1);\n", type, type); \
+    s = str_append(s, funcbuf);                                                \
+    sprintf(funcbuf,                                                           \
+            "    %s val = (%s)rs2, old = __atomic_load_n(mem, "                \
+            "__ATOMIC_RELAXED);\n",                                            \
+            type, type);                                                       \
+    s = str_append(s, funcbuf);                                                \
+    s = str_append(s, "    while (!__atomic_compare_exchange_n(mem, &old, "    \
+                      "val " cmp " old ? val : old, true, __ATOMIC_SEQ_CST, "  \
+                      "__ATOMIC_RELAXED));\n");                                \
+    REG_SET_EXPR(inst->rd, "(int64_t)(" stype ")old");                         \
+    tracer_add_gp_reg_usage(tracer, inst->rs1, inst->rs2, inst->rd, -1);       \
+    return s;                                                                  \
+  }
+
+FUNC_AMO_MINMAX(amomin_w, "int32_t", "int32_t", "<");
+FUNC_AMO_MINMAX(amomax_w, "int32_t", "int32_t", ">");
+FUNC_AMO_MINMAX(amominu_w, "uint32_t", "int32_t", "<");
+FUNC_AMO_MINMAX(amomaxu_w, "uint32_t", "int32_t", ">");
+FUNC_AMO_MINMAX(amomin_d, "int64_t", "int64_t", "<");
+FUNC_AMO_MINMAX(amomax_d, "int64_t", "int64_t", ">");
+FUNC_AMO_MINMAX(amominu_d, "uint64_t", "int64_t", "<");
+FUNC_AMO_MINMAX(amomaxu_d, "uint64_t", "int64_t", ">");
+
+/*************************************************************************
+ * VECTOR INST
+ *************************************************************************/
+
+/*
+ * vector instructions become element loops over state->vregs, see the
+ * V* macros in CODEGEN_PROLOGUE. clang vectorizes them for the host.
+ */
+enum { VOP_VV, VOP_VX, VOP_VI, VOP_VF };
+
+static char vecbuf[64] = {0};
+static char vecbuf2[64] = {0};
+
+// the second operand as an element expression, vecbuf2 is its double form
+static str_t vec_operand(str_t s, inst_t *inst, tracer_t *tracer, int kind) {
+  switch (kind) {
+  case VOP_VV:
+    sprintf(vecbuf, "VV(%d)", inst->rs1);
+    strcpy(vecbuf2, vecbuf);
+    break;
+  case VOP_VX:
+    REG_GET(inst->rs1, rs1);
+    tracer_add_gp_reg_usage(tracer, inst->rs1, -1);
+    sprintf(vecbuf, "(__typeof__(a))rs1");
+    break;
+  case VOP_VI:
+    sprintf(vecbuf, "(__typeof__(a))%ldLL", (int64_t)inst->imm);
+    break;
+  case VOP_VF:
+    tracer_add_fp_reg_usage(tracer, inst->rs1, -1);
+    sprintf(vecbuf, "f%d.f", inst->rs1);
+    sprintf(vecbuf2, "f%d.d", inst->rs1);
+    break;
+  default:
+    unreachable();
+  }
+  return s;
+}
+
+// avl of vsetvli and vsetvl, rs1 = x0 asks for vlmax or keeps vl
+static const char *vec_avl(inst_t *inst) {
+  if (inst->rs1 != zero)
+    return "rs1";
+  return inst->rd != zero ? "UINT64_MAX" : "state->vl";
+}
+
+static str_t func_vsetvli(str_t s, inst_t *inst, tracer_t *tracer,
+                          stack_t *stack, uint64_t pc) {
+  REG_GET(inst->rs1, rs1);
+  sprintf(funcbuf, "    uint64_t vl = VSETVL(%s, %ldULL);\n", vec_avl(inst),
+          (uint64_t)inst->imm);
+  s = str_append(s, funcbuf);
+  REG_SET_EXPR(inst->rd, "vl");
+  tracer_add_gp_reg_usage(tracer, inst->rs1, inst->rd, -1);
+  return s;
+}
+
+static str_t func_vsetivli(str_t s, inst_t *inst, tracer_t *tracer,
+                           stack_t *stack, uint64_t pc) {
+  sprintf(funcbuf, "    uint64_t vl = VSETVL(%dULL, %ldULL);\n", inst->rs1,
+          (uint64_t)inst->imm);
+  s = str_append(s, funcbuf);
+  REG_SET_EXPR(inst->rd, "vl");
+  tracer_add_gp_reg_usage(tracer, inst->rd, -1);
+  return s;
+}
+
+static str_t func_vsetvl(str_t s, inst_t *inst, tracer_t *tracer,
+                         stack_t *stack, uint64_t pc) {
+  REG_GET(inst->rs1, rs1);
+  REG_GET(inst->rs2, rs2);
+  sprintf(funcbuf, "    uint64_t vl = VSETVL(%s, rs2);\n", vec_avl(inst));
+  s = str_append(s, funcbuf);
+  REG_SET_EXPR(inst->rd, "vl");
+  tracer_add_gp_reg_usage(tracer, inst->rs1, inst->rs2, inst->rd, -1);
+  return s;
+}
+
+#define FUNC_VLOAD(name, eew)                                                  \
+  static str_t func_##name(str_t s, inst_t *inst, tracer_t *tracer,            \
+                           stack_t *stack, uint64_t pc) {                      \
+    REG_GET(inst->rs1, rs1);                                                   \
+    sprintf(funcbuf,                                                           \
+            "    VCOPY(VREG(%d), GUEST_TO_HOST(rs1), state->vl * %d);\n",      \
+            inst->rd, (eew) / 8);                                              \
+    s = str_append(s, funcbuf);                                                \
+    tracer_add_gp_reg_usage(tracer, inst->rs1, -1);                            \
+    return s;                                                                  \
+  }
+
+FUNC_VLOAD(vle8_v, 8);
+FUNC_VLOAD(vle16_v, 16);
+FUNC_VLOAD(vle32_v, 32);
+FUNC_VLOAD(vle64_v, 64);
+
+#define FUNC_VSTORE(name, eew)                                                 \
+  static str_t func_##name(str_t s, inst_t *inst, tracer_t *tracer,            \
+                           stack_t *stack, uint64_t pc) {                      \
+    REG_GET(inst->rs1, rs1);                                                   \
+    sprintf(funcbuf,                                                           \
+            "    VCOPY(GUEST_TO_HOST(rs1), VREG(%d), state->vl * %d);\n",      \
+            inst->rs2, (eew) / 8);                                             \
+    s = str_append(s, funcbuf);                                                \
+    tracer_add_gp_reg_usage(tracer, inst->rs1, -1);                            \
+    return s;                                                                  \
+  }
+
+FUNC_VSTORE(vse8_v, 8);
+FUNC_VSTORE(vse16_v, 16);
+FUNC_VSTORE(vse32_v, 32);
+FUNC_VSTORE(vse64_v, 64);
+
+#define FUNC_VINT(name, sign, kind, expr)                                      \
+  static str_t func_##name(str_t s, inst_t *inst, tracer_t *tracer,            \
+                           stack_t *stack, uint64_t pc) {                      \
+    s = vec_operand(s, inst, tracer, kind);                                    \
+    sprintf(funcbuf, "    VINT(" sign ", %d, %d, %s, " expr ");\n", inst->rd, \
+            inst->rs2, vecbuf);                                                \
+    s = str_append(s, funcbuf);                                                \
+    return s;                                                                  \
+  }
+
+FUNC_VINT(vadd_vv, "int", VOP_VV, "a + b");
+FUNC_VINT(vadd_vx, "int", VOP_VX, "a + b");
+FUNC_VINT(vadd_vi, "int", VOP_VI, "a + b");
+FUNC_VINT(vsub_vv, "int", VOP_VV, "a - b");
+FUNC_VINT(vsub_vx, "int", VOP_VX, "a - b");
+FUNC_VINT(vrsub_vx, "int", VOP_VX, "b - a");
+FUNC_VINT(vrsub_vi, "int", VOP_VI, "b - a");
+FUNC_VINT(vand_vv, "int", VOP_VV, "a & b");
+FUNC_VINT(vand_vx, "int", VOP_VX, "a & b");
+FUNC_VINT(vand_vi, "int", VOP_VI, "a & b");
+FUNC_VINT(vor_vv, "int", VOP_VV, "a | b");
+FUNC_VINT(vor_vx, "int", VOP_VX, "a | b");
+FUNC_VINT(vor_vi, "int", VOP_VI, "a | b");
+FUNC_VINT(vxor_vv, "int", VOP_VV, "a ^ b");
+FUNC_VINT(vxor_vx, "int", VOP_VX, "a ^ b");
+FUNC_VINT(vxor_vi, "int", VOP_VI, "a ^ b");
+FUNC_VINT(vminu_vv, "uint", VOP_VV, "a < b ? a : b");
+FUNC_VINT(vminu_vx, "uint", VOP_VX, "a < b ? a : b");
+FUNC_VINT(vmin_vv, "int", VOP_VV, "a < b ? a : b");
+FUNC_VINT(vmin_vx, "int", VOP_VX, "a < b ? a : b");
+FUNC_VINT(vmaxu_vv, "uint", VOP_VV, "a > b ? a : b");
+FUNC_VINT(vmaxu_vx, "uint", VOP_VX, "a > b ? a : b");
+FUNC_VINT(vmax_vv, "int", VOP_VV, "a > b ? a : b");
+FUNC_VINT(vmax_vx, "int", VOP_VX, "a > b ? a : b");
+FUNC_VINT(vmul_vv, "int", VOP_VV, "a * b");
+FUNC_VINT(vmul_vx, "int", VOP_VX, "a * b");
+FUNC_VINT(vmv_v_v, "int", VOP_VV, "b");
+FUNC_VINT(vmv_v_x, "int", VOP_VX, "b");
+FUNC_VINT(vmv_v_i, "int", VOP_VI, "b");
+
+#define FUNC_VFLT(name, kind, expr32, expr64)                                  \
+  static str_t func_##name(str_t s, inst_t *inst, tracer_t *tracer,            \
+                           stack_t *stack, uint64_t pc) {                      \
+    s = vec_operand(s, inst, tracer, kind);                                    \
+    sprintf(funcbuf, "    VFLT(%d, %d, %s, %s, " expr32 ", " expr64 ");\n",   \
+            inst->rd, inst->rs2, vecbuf, vecbuf2);                             \
+    s = str_append(s, funcbuf);                                                \
+    return s;                                                                  \
+  }
+
+FUNC_VFLT(vfadd_vv, VOP_VV, "a + b", "a + b");
+FUNC_VFLT(vfadd_vf, VOP_VF, "a + b", "a + b");
+FUNC_VFLT(vfsub_vv, VOP_VV, "a - b", "a - b");
+FUNC_VFLT(vfsub_vf, VOP_VF, "a - b", "a - b");
+FUNC_VFLT(vfmul_vv, VOP_VV, "a * b", "a * b");
+FUNC_VFLT(vfmul_vf, VOP_VF, "a * b", "a * b");
+FUNC_VFLT(vfdiv_vv, VOP_VV, "a / b", "a / b");
+FUNC_VFLT(vfdiv_vf, VOP_VF, "a / b", "a / b");
+FUNC_VFLT(vfmacc_vv, VOP_VV, "__builtin_fmaf(b, a, c)",
+          "__builtin_fma(b, a, c)");
+FUNC_VFLT(vfmacc_vf, VOP_VF, "__builtin_fmaf(b, a, c)",
+          "__builtin_fma(b, a, c)");
+FUNC_VFLT(vfmv_v_f, VOP_VF, "b", "b");
+
+#define FUNC_VRED(name, macro)                                                 \
+  static str_t func_##name(str_t s, inst_t *inst, tracer_t *tracer,            \
+                           stack_t *stack, uint64_t pc) {                      \
+    sprintf(funcbuf, "    " macro "(%d, %d, %d);\n", inst->rd, inst->rs1,     \
+            inst->rs2);                                                        \
+    s = str_append(s, funcbuf);                                                \
+    return s;                                                                  \
+  }
+
+FUNC_VRED(vredsum_vs, "VIRED");
+FUNC_VRED(vfredusum_vs, "VFRED");
+FUNC_VRED(vfredosum_vs, "VFRED");
+
+static str_t func_vmv_x_s(str_t s, inst_t *inst, tracer_t *tracer,
+                          stack_t *stack, uint64_t pc) {
+  sprintf(funcbuf2, "VGET0(%d)", inst->rs2);
+  REG_SET_EXPR(inst->rd, funcbuf2);
+  tracer_add_gp_reg_usage(tracer, inst->rd, -1);
+  return s;
+}
+
+static str_t func_vmv_s_x(str_t s, inst_t *inst, tracer_t *tracer,
+                          stack_t *stack, uint64_t pc) {
+  REG_GET(inst->rs1, rs1);
+  sprintf(funcbuf, "    VSET0(%d, rs1);\n", inst->rd);
+  s = str_append(s, funcbuf);
+  tracer_add_gp_reg_usage(tracer, inst->rs1, -1);
+  return s;
+}
+
+static str_t func_vfmv_f_s(str_t s, inst_t *inst, tracer_t *tracer,
+                           stack_t *stack, uint64_t pc) {
+  sprintf(funcbuf,
+          "    f%d.v = VSEW == 32 ? *(uint32_t *)VREG(%d) | (~0ULL << 32) "
+          ": *(uint64_t *)VREG(%d);\n",
+          inst->rd, inst->rs2, inst->rs2);
+  s = str_append(s, funcbuf);
+  tracer_add_fp_reg_usage(tracer, inst->rd, -1);
+  return s;
+}
+
+static str_t func_vfmv_s_f(str_t s, inst_t *inst, tracer_t *tracer,
+                           stack_t *stack, uint64_t pc) {
+  sprintf(funcbuf, "    VSET0(%d, f%d.v);\n", inst->rd, inst->rs1);
+  s = str_append(s, funcbuf);
+  tracer_add_fp_reg_usage(tracer, inst->rs1, -1);
+  return s;
+}
+
 typedef str_t(func_t)(str_t str, inst_t *inst, tracer_t *tracer, stack_t *stack,
                       uint64_t);
 
@@ -290,7 +726,7 @@ static func_t *funcs[] = {
     func_lb,    func_lh,    func_lw,    func_ld,    func_lbu,   func_lhu,
     func_lwu,
 
-    func_empty, func_empty,
+    func_fence, func_empty,
 
     func_addi,  func_slli,  func_empty, func_empty, func_empty, func_empty,
     func_empty, func_empty, func_empty, func_empty, func_addiw, func_empty,
@@ -313,7 +749,7 @@ static func_t *funcs[] = {
 
     func_jalr,  func_jal,   func_ecall, func_empty,
 
-    func_empty, func_empty, func_empty, func_empty, func_empty, func_empty,
+    func_csrrc, func_csrrci, func_csrrs, func_csrrsi, func_empty, func_empty,
 
     func_empty, func_fsw,
 
@@ -351,8 +787,95 @@ static func_t *funcs[] = {
     func_empty, func_empty,
 
     func_empty, func_empty, func_empty, func_empty,
+
+    func_lr_w,  func_sc_w,  func_amoswap_w, func_amoadd_w, func_amoxor_w,
+    func_amoand_w, func_amoor_w, func_amomin_w, func_amomax_w, func_amominu_w,
+    func_amomaxu_w,
+
+    func_lr_d,  func_sc_d,  func_amoswap_d, func_amoadd_d, func_amoxor_d,
+    func_amoand_d, func_amoor_d, func_amomin_d, func_amomax_d, func_amominu_d,
+    func_amomaxu_d,
+
+    func_vsetvli, func_vsetivli, func_vsetvl,
+
+    func_vle8_v, func_vle16_v, func_vle32_v, func_vle64_v, func_vse8_v,
+    func_vse16_v, func_vse32_v, func_vse64_v,
+
+    func_vadd_vv, func_vadd_vx, func_vadd_vi, func_vsub_vv, func_vsub_vx,
+    func_vrsub_vx, func_vrsub_vi, func_vand_vv, func_vand_vx, func_vand_vi,
+    func_vor_vv, func_vor_vx, func_vor_vi, func_vxor_vv, func_vxor_vx,
+    func_vxor_vi, func_vminu_vv, func_vminu_vx, func_vmin_vv, func_vmin_vx,
+    func_vmaxu_vv, func_vmaxu_vx, func_vmax_vv, func_vmax_vx, func_vmul_vv,
+    func_vmul_vx, func_vmv_v_v, func_vmv_v_x, func_vmv_v_i, func_vredsum_vs,
+    func_vmv_x_s, func_vmv_s_x,
+
+    func_vfadd_vv, func_vfadd_vf, func_vfsub_vv, func_vfsub_vf, func_vfmul_vv,
+    func_vfmul_vf, func_vfdiv_vv, func_vfdiv_vf, func_vfmacc_vv, func_vfmacc_vf,
+    func_vfmv_v_f, func_vfredusum_vs, func_vfredosum_vs, func_vfmv_f_s,
+    func_vfmv_s_f,
+
+    func_add_uw, func_sh1add, func_sh2add, func_sh3add, func_sh1add_uw,
+    func_sh2add_uw, func_sh3add_uw, func_slli_uw,
+
+    func_andn, func_orn, func_xnor, func_clz, func_clzw, func_ctz, func_ctzw,
+    func_cpop, func_cpopw, func_max, func_maxu, func_min, func_minu,
+    func_sext_b, func_sext_h, func_zext_h, func_rol, func_rolw, func_ror,
+    func_rori, func_roriw, func_rorw, func_orc_b, func_rev8,
+
+    func_bclr, func_bclri, func_bext, func_bexti, func_binv, func_binvi,
+    func_bset, func_bseti,
 };
 
+/*
+ * helpers of the vector instructions. a and b are the elements of vs2 and
+ * the second operand, c is the old element of vd.
+ */
+#define CODEGEN_VECTOR                                                         \
+  "#define VREG(n) ((uint8_t *)state->vregs + (n) * 16)\n"                     \
+  "#define VSEW (8 << ((state->vtype >> 3) & 7))\n"                            \
+  "#define VV(n) ((__typeof__(a) *)VREG(n))[i]\n"                              \
+  "#define VCOPY(dst, src, n) { uint8_t *d_ = (uint8_t *)(dst), "              \
+  "*s_ = (uint8_t *)(src); uint64_t n_ = (n); "                                \
+  "for (uint64_t i = 0; i < n_; i++) d_[i] = s_[i]; }\n"                       \
+  "#define VELEM(T, vd, vs2, B, expr) { T *d_ = (T *)VREG(vd), "               \
+  "*s_ = (T *)VREG(vs2); uint64_t vl_ = state->vl; "                           \
+  "for (uint64_t i = 0; i < vl_; i++) { T a = s_[i], b = (B), c = d_[i]; "     \
+  "(void)c; d_[i] = (expr); } }\n"                                             \
+  "#define VINT(S, vd, vs2, B, expr) switch (VSEW) { "                         \
+  "case 8: VELEM(S##8_t, vd, vs2, B, expr) break; "                            \
+  "case 16: VELEM(S##16_t, vd, vs2, B, expr) break; "                          \
+  "case 32: VELEM(S##32_t, vd, vs2, B, expr) break; "                          \
+  "default: VELEM(S##64_t, vd, vs2, B, expr) break; }\n"                       \
+  "#define VFLT(vd, vs2, B32, B64, E32, E64) switch (VSEW) { "                 \
+  "case 32: VELEM(float, vd, vs2, B32, E32) break; "                           \
+  "default: VELEM(double, vd, vs2, B64, E64) break; }\n"                       \
+  "#define VRED(T, vd, vs1, vs2) if (state->vl) { T *s_ = (T *)VREG(vs2); "    \
+  "T acc_ = *(T *)VREG(vs1); for (uint64_t i = 0; i < state->vl; i++) "        \
+  "acc_ += s_[i]; *(T *)VREG(vd) = acc_; }\n"                                  \
+  "#define VIRED(vd, vs1, vs2) switch (VSEW) { "                               \
+  "case 8: VRED(uint8_t, vd, vs1, vs2) break; "                                \
+  "case 16: VRED(uint16_t, vd, vs1, vs2) break; "                              \
+  "case 32: VRED(uint32_t, vd, vs1, vs2) break; "                              \
+  "default: VRED(uint64_t, vd, vs1, vs2) break; }\n"                           \
+  "#define VFRED(vd, vs1, vs2) switch (VSEW) { "                               \
+  "case 32: VRED(float, vd, vs1, vs2) break; "                                 \
+  "default: VRED(double, vd, vs1, vs2) break; }\n"                             \
+  "#define VGET0(n) (VSEW == 8 ? *(int8_t *)VREG(n) : "                        \
+  "VSEW == 16 ? *(int16_t *)VREG(n) : VSEW == 32 ? *(int32_t *)VREG(n) : "     \
+  "*(int64_t *)VREG(n))\n"                                                     \
+  "#define VSET0(n, x) if (state->vl) switch (VSEW) { "                        \
+  "case 8: *(uint8_t *)VREG(n) = (x); break; "                                 \
+  "case 16: *(uint16_t *)VREG(n) = (x); break; "                               \
+  "case 32: *(uint32_t *)VREG(n) = (x); break; "                               \
+  "default: *(uint64_t *)VREG(n) = (x); break; }\n"                            \
+  "#define VSETVL(avl, vt) ({ uint64_t vt_ = (vt), avl_ = (avl), "             \
+  "sew_ = (vt_ >> 3) & 7, lmul_ = vt_ & 7, max_ = 0; "                         \
+  "if (sew_ <= 3 && lmul_ != 4 && (vt_ >> 8) == 0) { "                         \
+  "max_ = 128 >> (3 + sew_); "                                                 \
+  "max_ = lmul_ < 4 ? max_ << lmul_ : max_ >> (8 - lmul_); } "                 \
+  "state->vtype = max_ ? vt_ : 1ULL << 63; "                                   \
+  "state->vl = avl_ < max_ ? avl_ : max_; })\n"
+
 #define CODEGEN_PROLOGUE                                                       \
   "#define OFFSET 0x088800000000ULL               \n"                          \
   "#define GUEST_TO_HOST(addr) (addr + OFFSET)    \n"                          \
@@ -375,65 +898,397 @@ static func_t *funcs[] = {
   "    uint64_t gp_regs[32];                      \n"                          \
   "    fp_reg_t fp_regs[32];                      \n"                          \
   "    uint64_t pc;                               \n"                          \
-  "    uint32_t fcsr;                             \n"                          \
+  "    uint64_t reserve_addr;                     \n"                          \
+  "    uint64_t reserve_val;                      \n"                          \
+  "    uint64_t icount;                           \n"                          \
+  "    uint64_t vl;                               \n"                          \
+  "    uint64_t vtype;                            \n"                          \
+  "    uint8_t vregs[512] __attribute__((aligned(16)));\n"                     \
+  "    _Bool (*fast_ecall)(void *, uint64_t, uint64_t, uint64_t, uint64_t *);\n" \
+  "    uint64_t (*csr_read)(void *, uint64_t, uint64_t);\n"                   \
   "} state_t;                                     \n"                          \
-  "void start(volatile state_t *restrict state) { \n"
+  CODEGEN_VECTOR
 
-#define CODEGEN_EPILOGUE "}"
+#define CODEGEN_EPILOGUE "}\n"
 
-str_t machine_genblock(machine_t *m) {
-  DECLEAR_STATIC_STR(body);
+/**
+ * @brief hash of the state_t layout and helpers the generated code assumes,
+ * part of the shared cache name
+ */
+uint64_t codegen_ident() {
+  static const char prologue[] = CODEGEN_PROLOGUE;
+  return fnv(FNV_BASIS, prologue, sizeof(prologue));
+}
+
+/*************************************************************************
+ * IR LOWERING
+ *************************************************************************/
 
+typedef struct {
+  uint64_t pc;
+  inst_t inst;
+  uint32_t preds;
+  bool leader;
+  bool fast_ecall; // an ecall that goes on at pc + 4, see ecall_fast_nr
+} block_inst_t;
+
+static block_inst_t *block_insts;
+static uint64_t block_len;
+static uint64_t block_cap;
+
+static int block_inst_cmp(const void *a, const void *b) {
+  uint64_t x = ((const block_inst_t *)a)->pc;
+  uint64_t y = ((const block_inst_t *)b)->pc;
+  return x < y ? -1 : x > y;
+}
+
+static block_inst_t *block_find(uint64_t pc) {
+  block_inst_t key = {.pc = pc};
+  return (block_inst_t *)bsearch(&key, block_insts, block_len,
+                                 sizeof(block_inst_t), block_inst_cmp);
+}
+
+static bool block_fast_ecall(uint64_t pc) {
+  block_inst_t *bi = block_find(pc);
+  return bi != NULL && bi->fast_ecall;
+}
+
+/**
+ * @brief whether the ecall at pc is a libc style "li a7, nr; ecall" with a
+ * nr of syscall_fast_nr
+ *
+ * only a decoded 4 byte instruction counts, the raw word at pc - 4 may be
+ * the tail of another instruction or not mapped at all. runs while the
+ * block is discovered and block_insts is not sorted yet.
+ *
+ * @param pc of the ecall
+ * @return
+ */
+static bool ecall_fast_nr(uint64_t pc) {
+  for (uint64_t i = 0; i < block_len; i++) {
+    inst_t *prev = &block_insts[i].inst;
+    if (block_insts[i].pc == pc - 4 && prev->type == inst_addi &&
+        !prev->rvc && prev->rd == a7 && prev->rs1 == zero)
+      return syscall_fast_nr(prev->imm);
+  }
+  return false;
+}
+
+/**
+ * @brief where control goes after bi
+ *
+ * @param next the fall through pc, -1 if none
+ * @param target the jump target, -1 if none
+ */
+static void inst_succs(block_inst_t *bi, uint64_t *next, uint64_t *target) {
+  uint64_t pc = bi->pc;
+  inst_t *inst = &bi->inst;
+  *next = inst->cont ? -1 : pc + (inst->rvc ? 2 : 4);
+  *target = -1;
+  switch (inst->type) {
+  case inst_beq:
+  case inst_bne:
+  case inst_blt:
+  case inst_bge:
+  case inst_bltu:
+  case inst_bgeu:
+  case inst_jal:
+    *target = pc + (int64_t)inst->imm;
+    break;
+  case inst_ecall:
+    // the fast syscall path of func_ecall goes on at pc + 4
+    if (bi->fast_ecall)
+      *target = pc + 4;
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * @brief decode the instructions reachable from entry and find the leaders
+ *
+ * a leader starts a segment: the entry, a jump target, or a join of
+ * several fall throughs and jumps.
+ *
+ * @param entry
+ */
+static void block_discover(uint64_t entry) {
   static stack_t stack = {0};
   stack_reset(&stack);
 
   static set_t set;
   set_reset(&set);
 
-  static tracer_t tracer;
-  tracer_reset(&tracer);
-
-  stack_push(&stack, m->state.pc);
+  block_len = 0;
+  stack_push(&stack, entry);
 
   uint64_t pc = -1;
-
   while (stack_pop(&stack, &pc)) {
-    if (!set_add(&set, pc)) {
+    if (!set_add(&set, pc))
       continue;
+
+    if (block_len == block_cap) {
+      block_cap = block_cap ? block_cap * 2 : 1024;
+      block_insts = (block_inst_t *)realloc(block_insts,
+                                            block_cap * sizeof(block_inst_t));
+      Assert(block_insts != NULL, "block insts: %s", strerror(errno));
     }
+    block_inst_t *bi = &block_insts[block_len++];
+    memset(bi, 0, sizeof(block_inst_t));
+    bi->pc = pc;
+    inst_decode(&bi->inst, *(uint32_t *)GUEST_TO_HOST(pc));
+    if (bi->inst.type == inst_ecall)
+      bi->fast_ecall = ecall_fast_nr(pc);
+
+    uint64_t next, target;
+    inst_succs(bi, &next, &target);
+    if (target != -1)
+      stack_push(&stack, target);
+    if (next != -1)
+      stack_push(&stack, next);
+  }
 
-    static char buf[128] = {0};
-    static inst_t inst = {0};
+  qsort(block_insts, block_len, sizeof(block_inst_t), block_inst_cmp);
+
+  block_find(entry)->leader = true;
+  for (uint64_t i = 0; i < block_len; i++) {
+    uint64_t next, target;
+    inst_succs(&block_insts[i], &next, &target);
+    if (next != -1)
+      block_find(next)->preds++;
+    if (target != -1) {
+      block_find(target)->preds++;
+      block_find(target)->leader = true;
+    }
+  }
+  for (uint64_t i = 0; i < block_len; i++)
+    if (block_insts[i].preds > 1)
+      block_insts[i].leader = true;
+}
 
-    sprintf(buf, "inst_%lx: {\n", pc);
-    body = str_append(body, buf);
+static const char *ir_int_type(uint8_t size, bool sign) {
+  switch (size) {
+  case 1:
+    return sign ? "int8_t" : "uint8_t";
+  case 2:
+    return sign ? "int16_t" : "uint16_t";
+  case 4:
+    return sign ? "int32_t" : "uint32_t";
+  default:
+    return sign ? "int64_t" : "uint64_t";
+  }
+}
 
-    uint32_t data = *(uint32_t *)GUEST_TO_HOST(pc);
-    inst_decode(&inst, data);
-    extern const char *inst_name[];
-    IFDEF(CONFIG_DEBUG,
-          printf("codegen: inst: %d, %s\n", inst.type, inst_name[inst.type]));
-    body = funcs[inst.type](body, &inst, &tracer, &stack, pc);
+// a value as an operand: a literal for constants, its local otherwise
+static const char *ir_operand(ir_t *ir, int32_t v, char *buf) {
+  while (ir->nodes[v].op == IR_COPY)
+    v = ir->nodes[v].a;
+  if (ir->nodes[v].op == IR_CONST)
+    sprintf(buf, "%luULL", ir->nodes[v].imm);
+  else
+    sprintf(buf, "v%d", v);
+  return buf;
+}
 
-    if (inst.cont)
+/**
+ * @brief lower an optimized segment to C
+ *
+ * values become locals of the segment, the guest registers stay in the x
+ * locals of the block. icount is bumped once per side exit instead of once
+ * per instruction.
+ */
+static str_t ir_lower(str_t s, ir_t *ir, tracer_t *tracer, uint64_t pc) {
+  static stack_t stack = {0};
+  static char buf[256];
+  char a[32], b[32];
+
+  sprintf(buf, "inst_%lx: {\n", pc);
+  s = str_append(s, buf);
+
+  uint32_t counted = 0;
+  for (uint32_t i = 0; i < ir->len; i++) {
+    ir_node_t *n = &ir->nodes[i];
+
+    switch (n->op) {
+    case IR_BRANCH:
+    case IR_GOTO:
+    case IR_EXIT:
+    case IR_LEGACY:
+      if (n->insts != counted) {
+        sprintf(buf, "    icount += %u;\n", n->insts - counted);
+        s = str_append(s, buf);
+        counted = n->insts;
+      }
+      break;
+    default:
+      break;
+    }
+
+    static const char *binops[] = {
+        [IR_ADD] = "+", [IR_SUB] = "-", [IR_AND] = "&", [IR_OR] = "|",
+        [IR_XOR] = "^", [IR_SHL] = "<<", [IR_SHR] = ">>", [IR_MUL] = "*",
+        [IR_SLTU] = "<"};
+    static const char *conds[] = {
+        [IR_EQ] = "==", [IR_NE] = "!=", [IR_LT] = "<",
+        [IR_GE] = ">=", [IR_LTU] = "<", [IR_GEU] = ">="};
+
+    switch (n->op) {
+    case IR_NOP:
+    case IR_CONST:
+    case IR_COPY:
+      continue;
+    case IR_GETREG:
+      sprintf(buf, "    uint64_t v%u = x%lu;\n", i, n->imm);
+      tracer_add_gp_reg_usage(tracer, (int)n->imm, -1);
+      break;
+    case IR_SETREG:
+      sprintf(buf, "    x%lu = %s;\n", n->imm, ir_operand(ir, n->a, a));
+      tracer_add_gp_reg_usage(tracer, (int)n->imm, -1);
+      break;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_AND:
+    case IR_OR:
+    case IR_XOR:
+    case IR_SHL:
+    case IR_SHR:
+    case IR_MUL:
+    case IR_SLTU:
+      sprintf(buf, "    uint64_t v%u = %s %s %s;\n", i, ir_operand(ir, n->a, a),
+              binops[n->op], ir_operand(ir, n->b, b));
+      break;
+    case IR_SAR:
+      sprintf(buf, "    uint64_t v%u = (int64_t)%s >> %s;\n", i,
+              ir_operand(ir, n->a, a), ir_operand(ir, n->b, b));
+      break;
+    case IR_SLT:
+      sprintf(buf, "    uint64_t v%u = (int64_t)%s < (int64_t)%s;\n", i,
+              ir_operand(ir, n->a, a), ir_operand(ir, n->b, b));
+      break;
+    case IR_SEXT:
+    case IR_ZEXT:
+      sprintf(buf, "    uint64_t v%u = (%s)%s;\n", i,
+              ir_int_type(n->size, n->op == IR_SEXT), ir_operand(ir, n->a, a));
+      break;
+    case IR_LOAD:
+      sprintf(buf, "    uint64_t v%u = *(%s *)GUEST_TO_HOST(%s);\n", i,
+              ir_int_type(n->size, n->sign), ir_operand(ir, n->a, a));
+      break;
+    case IR_STORE:
+      sprintf(buf, "    *(%s *)GUEST_TO_HOST(%s) = (%s)%s;\n",
+              ir_int_type(n->size, false), ir_operand(ir, n->a, a),
+              ir_int_type(n->size, false), ir_operand(ir, n->b, b));
+      break;
+    case IR_BRANCH: {
+      const char *type = n->cond == IR_LT || n->cond == IR_GE ? "(int64_t)" : "";
+      sprintf(buf, "    if (%s%s %s %s%s) goto inst_%lx;\n", type,
+              ir_operand(ir, n->a, a), conds[n->cond], type,
+              ir_operand(ir, n->b, b), n->imm);
+      break;
+    }
+    case IR_GOTO:
+      sprintf(buf, "    goto inst_%lx;\n", n->imm);
+      break;
+    case IR_EXIT:
+      s = str_append(s, "    state->exit_reason = indirect_branch;\n");
+      sprintf(buf, "    state->reenter_pc = %s;\n    goto end;\n",
+              ir_operand(ir, n->a, a));
+      break;
+    case IR_LEGACY:
+      // the emitters declare their own locals. the ones that end the
+      // segment close the brace themselves
+      stack_reset(&stack);
+      s = str_append(s, "    {\n");
+      s = funcs[n->inst.type](s, &n->inst, tracer, &stack, n->imm);
+      if (!n->inst.cont)
+        s = str_append(s, "    }\n");
       continue;
+    }
+    s = str_append(s, buf);
+  }
 
-    pc += (inst.rvc ? 2 : 4);
-    sprintf(buf, "    goto inst_%lx;\n", pc);
-    body = str_append(body, buf);
-    body = str_append(body, "}\n");
-    stack_push(&stack, pc);
+  s = str_append(s, "}\n");
+  return s;
+}
+
+/**
+ * @brief translate the code reachable from entry into the C function
+ * start_<entry>
+ *
+ * the code is cut into segments at the leaders. every segment goes to the
+ * IR, is optimized and lowered. instructions without IR support keep
+ * their str_t emitter.
+ *
+ * @param source
+ * @param entry
+ * @return str_t
+ */
+static str_t genblock_func(str_t source, uint64_t entry) {
+  DECLEAR_STATIC_STR(body);
+
+  static tracer_t tracer;
+  tracer_reset(&tracer);
+
+  static ir_t ir;
+
+  block_discover(entry);
+
+  for (uint64_t i = 0; i < block_len; i++) {
+    if (!block_insts[i].leader)
+      continue;
+
+    ir_reset(&ir);
+    block_inst_t *bi = &block_insts[i];
+    for (;;) {
+      extern const char *inst_name[];
+      IFDEF(CONFIG_DEBUG, printf("codegen: inst: %d, %s\n", bi->inst.type,
+                                 inst_name[bi->inst.type]));
+      if (!ir_add_inst(&ir, &bi->inst, bi->pc))
+        ir_add_legacy(&ir, &bi->inst, bi->pc);
+      if (bi->inst.cont)
+        break;
+
+      uint64_t next = bi->pc + (bi->inst.rvc ? 2 : 4);
+      bi = block_find(next);
+      if (bi->leader) {
+        ir_add_goto(&ir, next);
+        break;
+      }
+    }
+
+    ir_optimize(&ir);
+    body = ir_lower(body, &ir, &tracer, block_insts[i].pc);
   }
 
-  DECLEAR_STATIC_STR(source);
-  source = str_append(source, "#include <stdint.h>\n");
-  source = str_append(source, "#include <stdbool.h>\n");
-  source = str_append(source, CODEGEN_PROLOGUE);
+  static char buf[128];
+  sprintf(buf, "void start_%lx(volatile state_t *restrict state) {\n", entry);
+  source = str_append(source, buf);
+  source = str_append(source, "    uint64_t icount = 0;\n");
   source = tracer_append_prologue(&tracer, source);
   source = str_append(source, body);
   source = str_append(source, "end:;\n");
+  source = str_append(source, "    state->icount += icount;\n");
   source = tracer_append_epilogue(&tracer, source);
   source = str_append(source, CODEGEN_EPILOGUE);
+  return source;
+}
+
+/**
+ * @brief one translation unit with a start_<pc> function for every pc
+ *
+ * @param m
+ * @param pcs
+ * @param n
+ * @return str_t
+ */
+str_t machine_genblock(machine_t *m, uint64_t *pcs, int n) {
+  DECLEAR_STATIC_STR(source);
+  source = str_append(source, "#include <stdint.h>\n");
+  source = str_append(source, "#include <stdbool.h>\n");
+  source = str_append(source, CODEGEN_PROLOGUE);
+  for (int i = 0; i < n; i++)
+    source = genblock_func(source, pcs[i]);
 
   // printf("%s\n", source);
 
@@ -1,105 +1,291 @@
+#define _GNU_SOURCE
 #include "rvemu.h"
 
-#define BINBUF_CAP 64 * 1024
+#ifdef CONFIG_LIBTCC
+#include <libtcc.h>
+#endif
 
-static uint8_t elfbuf[BINBUF_CAP] = {0};
+#include <sys/stat.h>
 
-uint8_t *machine_compile(machine_t *m, str_t source) {
-  int saved_stdout = dup(STDOUT_FILENO);
-  int outp[2];
+// the object file of the last block, it grows to fit
+static uint8_t *elfbuf;
+static size_t elfbuf_cap;
+
+// the compilers write the object file here, see object_path
+static int objfd = -1;
+static pid_t objfd_owner;
+
+static const char *object_path() {
+  static char path[64];
+  // a child of the fork server compiles into its own file
+  if (objfd < 0 || objfd_owner != getpid()) {
+    if (objfd >= 0)
+      close(objfd);
+    objfd = memfd_create("rvemu-jit", MFD_CLOEXEC);
+    objfd_owner = getpid();
+    if (objfd < 0)
+      fatal("cannot create the object file");
+    sprintf(path, "/proc/%d/fd/%d", getpid(), objfd);
+  }
+  return path;
+}
+
+static uint8_t *object_read() {
+  struct stat st;
+  if (fstat(objfd, &st) != 0 || st.st_size == 0)
+    return NULL;
+
+  if (elfbuf_cap < (size_t)st.st_size) {
+    elfbuf_cap = st.st_size;
+    elfbuf = (uint8_t *)realloc(elfbuf, elfbuf_cap);
+    Assert(elfbuf != NULL, "elfbuf: %s", strerror(errno));
+  }
+  for (size_t off = 0; off < (size_t)st.st_size;) {
+    ssize_t n = pread(objfd, elfbuf + off, st.st_size - off, off);
+    if (n <= 0)
+      fatal("cannot read the object file");
+    off += n;
+  }
+  return elfbuf;
+}
+
+static elf64_shdr_t *elf_shdr(uint8_t *elf, int64_t idx) {
+  elf64_ehdr_t *ehdr = (elf64_ehdr_t *)elf;
+  return (elf64_shdr_t *)(elf + ehdr->e_shoff + idx * sizeof(elf64_shdr_t));
+}
 
-  if (pipe(outp) != 0)
-    fatal("cannot make a pipe");
-  dup2(outp[1], STDOUT_FILENO);
-  close(outp[1]);
+// -march=native lets the vector loops use the host SIMD width,
+// -fno-builtin keeps loops from becoming memcpy calls we cannot link and
+// -fPIC keeps jump tables position independent, the cache is above 4GiB
+#define CLANG_CMD                                                              \
+  "clang -O3 -march=native -fno-builtin -fPIC "                                \
+  "-fno-asynchronous-unwind-tables -c -xc -o - - > "
 
-  FILE *f;
-  f = popen("clang -O3 -c -xc -o /dev/stdout -", "w");
+/**
+ * @brief the compilers the code comes from, part of the shared cache name
+ */
+const char *compile_ident() {
+#ifdef CONFIG_LIBTCC
+  return CLANG_CMD "libtcc";
+#else
+  return CLANG_CMD;
+#endif
+}
+
+static uint8_t *compile_clang(str_t source) {
+  static char cmd[256];
+  sprintf(cmd, CLANG_CMD "%s", object_path());
+
+  FILE *f = popen(cmd, "w");
   if (f == NULL)
     fatal("cannot compile program");
   fwrite(source, 1, str_len(source), f);
-  pclose(f);
-  fflush(stdout);
+  if (pclose(f) != 0)
+    fatal("cannot compile program");
+  return object_read();
+}
 
-  read(outp[0], elfbuf, BINBUF_CAP);
-  dup2(saved_stdout, STDOUT_FILENO);
+#ifdef CONFIG_LIBTCC
+static void tcc_quiet(void *opaque, const char *msg) {}
 
-  elf64_ehdr_t *ehdr = (elf64_ehdr_t *)elfbuf;
+/**
+ * @brief compile in process, no fork, exec or pipe per block
+ *
+ * tcc is much faster than clang and its code is much slower. blocks tcc
+ * cannot take go to clang: a compile error, or calls to runtime helpers
+ * (the __atomic builtins) the linker below cannot resolve.
+ *
+ * @return NULL to use clang
+ */
+static uint8_t *compile_tcc(str_t source) {
+  TCCState *s = tcc_new();
+  if (s == NULL)
+    return NULL;
+  tcc_set_error_func(s, NULL, tcc_quiet);
+  tcc_set_output_type(s, TCC_OUTPUT_OBJ);
 
-  /**
-   * for some instructions, clang will generate a corresponding .rodata section.
-   * this means we need to write a mini-linker that puts the .rodata section
-   * into memory, takes its actual address, and uses symbols and relocations to
-   * apply it back to the corresponding location in the .text section.
-   */
+  bool ok = tcc_compile_string(s, source) == 0 &&
+            tcc_output_file(s, object_path()) == 0;
+  tcc_delete(s);
+  if (!ok)
+    return NULL;
 
-  int64_t text_idx = 0, symtab_idx = 0, rela_idx = 0, rodata_idx = 0;
-  {
-    uint64_t shstr_shoff =
-        ehdr->e_shoff + ehdr->e_shstrndx * sizeof(elf64_shdr_t);
-    elf64_shdr_t *shstr_shdr = (elf64_shdr_t *)(elfbuf + shstr_shoff);
-    assert(ehdr->e_shnum != 0);
-
-    for (int64_t idx = 0; idx < ehdr->e_shnum; idx++) {
-      uint64_t shoff = ehdr->e_shoff + idx * sizeof(elf64_shdr_t);
-      elf64_shdr_t *shdr = (elf64_shdr_t *)(elfbuf + shoff);
-      char *str = (char *)(elfbuf + shstr_shdr->sh_offset + shdr->sh_name);
-      if (strcmp(str, ".text") == 0)
-        text_idx = idx;
-      if (strcmp(str, ".rela.text") == 0)
-        rela_idx = idx;
-      if (strncmp(str, ".rodata.", strlen(".rodata.")) == 0)
-        rodata_idx = idx;
-      if (strcmp(str, ".symtab") == 0)
-        symtab_idx = idx;
+  uint8_t *elf = object_read();
+  if (elf == NULL)
+    return NULL;
+
+  elf64_ehdr_t *ehdr = (elf64_ehdr_t *)elf;
+  for (int64_t idx = 0; idx < ehdr->e_shnum; idx++) {
+    elf64_shdr_t *shdr = elf_shdr(elf, idx);
+    if (shdr->sh_type != SHT_SYMTAB)
+      continue;
+    int64_t syms = shdr->sh_size / sizeof(elf64_sym_t);
+    for (int64_t i = 1; i < syms; i++) {
+      elf64_sym_t *sym = (elf64_sym_t *)(elf + shdr->sh_offset +
+                                         i * sizeof(elf64_sym_t));
+      if (sym->st_shndx == SHN_UNDEF && sym->st_name != 0)
+        return NULL;
     }
   }
+  return elf;
+}
+#endif
 
-  assert(text_idx != 0 && symtab_idx != 0);
+/**
+ * @brief apply the relocations of one placed section
+ *
+ * @param elf
+ * @param rela the SHT_RELA section, sh_info is the section it patches
+ * @param secaddr where each section was placed, NULL if it was not
+ */
+static void elf_relocate(uint8_t *elf, elf64_shdr_t *rela, uint8_t **secaddr) {
+#ifndef __x86_64__
+  fatal("only support x86_64 for now");
+#endif
+  elf64_ehdr_t *ehdr = (elf64_ehdr_t *)elf;
+  elf64_shdr_t *symtab = elf_shdr(elf, rela->sh_link);
+  elf64_shdr_t *strtab = elf_shdr(elf, symtab->sh_link);
+  uint8_t *base = secaddr[rela->sh_info];
+  int64_t rels = rela->sh_size / sizeof(elf64_rela_t);
+
+  for (int64_t idx = 0; idx < rels; idx++) {
+    elf64_rela_t *rel =
+        (elf64_rela_t *)(elf + rela->sh_offset + idx * sizeof(elf64_rela_t));
+    elf64_sym_t *sym = (elf64_sym_t *)(elf + symtab->sh_offset +
+                                       rel->r_sym * sizeof(elf64_sym_t));
 
-  uint64_t text_shoff = ehdr->e_shoff + text_idx * sizeof(elf64_shdr_t);
-  elf64_shdr_t *text_shdr = (elf64_shdr_t *)(elfbuf + text_shoff);
+    uint64_t s = sym->st_value;
+    if (sym->st_shndx != SHN_ABS) {
+      // a call of a libc or compiler runtime function we cannot link
+      Assert(sym->st_shndx != SHN_UNDEF && sym->st_shndx < ehdr->e_shnum &&
+                 secaddr[sym->st_shndx] != NULL,
+             "jit code needs symbol %s",
+             (char *)(elf + strtab->sh_offset + sym->st_name));
+      s += (uint64_t)secaddr[sym->st_shndx];
+    }
+    uint64_t p = (uint64_t)base + rel->r_offset;
+    int64_t v = (int64_t)(s + rel->r_addend);
 
-  if (rela_idx == 0 || rodata_idx == 0) {
-    return cache_add(m->cache, m->state.pc, elfbuf + text_shdr->sh_offset,
-                     text_shdr->sh_size, text_shdr->sh_addralign);
+    switch (rel->r_type) {
+    case R_X86_64_64:
+      *(uint64_t *)p = v;
+      break;
+    case R_X86_64_PC64:
+      *(uint64_t *)p = v - p;
+      break;
+    case R_X86_64_PC32:
+    case R_X86_64_PLT32:
+      v -= p;
+      Assert(v == (int32_t)v, "relocation %u out of range", rel->r_type);
+      *(uint32_t *)p = v;
+      break;
+    case R_X86_64_32:
+      Assert((uint64_t)v == (uint32_t)v, "relocation %u out of range",
+             rel->r_type);
+      *(uint32_t *)p = v;
+      break;
+    case R_X86_64_32S:
+      Assert(v == (int32_t)v, "relocation %u out of range", rel->r_type);
+      *(uint32_t *)p = v;
+      break;
+    default:
+      fatalf("unsupported relocation %u", rel->r_type);
+    }
   }
+}
 
-  uint64_t text_addr = 0;
-  {
-    uint64_t shoff = ehdr->e_shoff + rodata_idx * sizeof(elf64_shdr_t);
-    elf64_shdr_t *shdr = (elf64_shdr_t *)(elfbuf + shoff);
-    cache_add(m->cache, m->state.pc, elfbuf + shdr->sh_offset, shdr->sh_size,
-              shdr->sh_addralign);
-    text_addr = (uint64_t)cache_add(
-        m->cache, m->state.pc, elfbuf + text_shdr->sh_offset,
-        text_shdr->sh_size, text_shdr->sh_addralign);
+/**
+ * @brief compile the blocks of machine_genblock and publish them
+ *
+ * @param m
+ * @param source
+ * @return the code of the block at the pc of m
+ */
+uint8_t *machine_compile(machine_t *m, str_t source) {
+  object_path();
+
+  uint8_t *elf = NULL;
+#ifdef CONFIG_LIBTCC
+  elf = compile_tcc(source);
+#endif
+  if (elf == NULL)
+    elf = compile_clang(source);
+  if (elf == NULL)
+    fatal("cannot compile program");
+
+  elf64_ehdr_t *ehdr = (elf64_ehdr_t *)elf;
+  assert(ehdr->e_shnum != 0);
+  char *shstr = (char *)(elf + elf_shdr(elf, ehdr->e_shstrndx)->sh_offset);
+
+  /**
+   * a mini-linker. clang puts constants, literal pools and jump tables into
+   * .rodata.* sections next to .text. every allocated section is copied
+   * into the cache, then the relocations of each are applied against the
+   * addresses the sections got.
+   */
+  static uint8_t **secaddr;
+  static uint64_t secaddr_cap;
+  if (secaddr_cap < ehdr->e_shnum) {
+    secaddr_cap = ehdr->e_shnum;
+    secaddr = (uint8_t **)realloc(secaddr, secaddr_cap * sizeof(uint8_t *));
+    Assert(secaddr != NULL, "secaddr: %s", strerror(errno));
+  }
+  memset(secaddr, 0, ehdr->e_shnum * sizeof(uint8_t *));
+
+  int64_t symtab_idx = 0;
+  for (int64_t idx = 0; idx < ehdr->e_shnum; idx++) {
+    elf64_shdr_t *shdr = elf_shdr(elf, idx);
+    if (shdr->sh_type == SHT_SYMTAB)
+      symtab_idx = idx;
+    // unwind tables are allocated too, nothing unwinds jit code
+    if (!(shdr->sh_flags & SHF_ALLOC) || shdr->sh_size == 0 ||
+        strcmp(shstr + shdr->sh_name, ".eh_frame") == 0)
+      continue;
+
+    if (shdr->sh_type == SHT_NOBITS) {
+      uint8_t *zeros = (uint8_t *)calloc(1, shdr->sh_size);
+      secaddr[idx] =
+          cache_copy(m->cache, zeros, shdr->sh_size, shdr->sh_addralign);
+      free(zeros);
+    } else {
+      secaddr[idx] = cache_copy(m->cache, elf + shdr->sh_offset,
+                                shdr->sh_size, shdr->sh_addralign);
+    }
+  }
+
+  assert(symtab_idx != 0);
+
+  for (int64_t idx = 0; idx < ehdr->e_shnum; idx++) {
+    elf64_shdr_t *shdr = elf_shdr(elf, idx);
+    if (shdr->sh_type == SHT_RELA && secaddr[shdr->sh_info] != NULL)
+      elf_relocate(elf, shdr, secaddr);
   }
 
-  // apply relocations to .text section.
+  // publish every start_<pc> of the batch once the code is final
+  uint8_t *code = NULL;
   {
-    uint64_t shoff = ehdr->e_shoff + rela_idx * sizeof(elf64_shdr_t);
-    elf64_shdr_t *shdr = (elf64_shdr_t *)(elfbuf + shoff);
-    int64_t rels = shdr->sh_size / sizeof(elf64_rela_t);
+    elf64_shdr_t *symtab_shdr = elf_shdr(elf, symtab_idx);
+    elf64_shdr_t *strtab_shdr = elf_shdr(elf, symtab_shdr->sh_link);
+    int64_t syms = symtab_shdr->sh_size / sizeof(elf64_sym_t);
 
-    uint64_t symtab_shoff = ehdr->e_shoff + symtab_idx * sizeof(elf64_shdr_t);
-    elf64_shdr_t *symtab_shdr = (elf64_shdr_t *)(elfbuf + symtab_shoff);
+    for (int64_t idx = 0; idx < syms; idx++) {
+      elf64_sym_t *sym = (elf64_sym_t *)(elf + symtab_shdr->sh_offset +
+                                         idx * sizeof(elf64_sym_t));
+      char *name = (char *)(elf + strtab_shdr->sh_offset + sym->st_name);
+      if (ELF64_ST_TYPE(sym->st_info) != STT_FUNC ||
+          strncmp(name, "start_", strlen("start_")) != 0)
+        continue;
+      Assert(sym->st_shndx < ehdr->e_shnum && secaddr[sym->st_shndx],
+             "%s is not placed", name);
 
-    for (int64_t idx = 0; idx < rels; idx++) {
-#ifndef __x86_64__
-      fatal("only support x86_64 for now");
-#endif
-      elf64_rela_t *rel = (elf64_rela_t *)(elfbuf + shdr->sh_offset +
-                                           idx * sizeof(elf64_rela_t));
-      assert(rel->r_type == R_X86_64_PC32);
-
-      elf64_sym_t *sym = (elf64_sym_t *)(elfbuf + symtab_shdr->sh_offset +
-                                         rel->r_sym * sizeof(elf64_sym_t));
-      uint32_t *loc = (uint32_t *)(text_addr + rel->r_offset);
-      *loc = (uint32_t)((int64_t)sym->st_value + rel->r_addend -
-                        (int64_t)rel->r_offset);
+      uint64_t pc = strtoull(name + strlen("start_"), NULL, 16);
+      uint8_t *addr = secaddr[sym->st_shndx] + sym->st_value;
+      cache_install(m->cache, pc, addr, sym->st_size);
+      if (pc == m->state.pc)
+        code = addr;
     }
   }
 
-  return (uint8_t *)text_addr;
+  Assert(code != NULL, "no code for pc %#lx", m->state.pc);
+  return code;
 }
@@ -107,6 +107,34 @@ static inline inst_t inst_fprtype_read(uint32_t data) {
   };
 }
 
+/**
+ * vector types
+ */
+#define FUNCT6(data) (((data) >> 26) & 0x3f)
+#define VM(data) (((data) >> 25) & 0x1)
+
+static inline inst_t inst_vltype_read(uint32_t data) {
+  uint32_t mop = (data >> 26) & 0x3;
+  uint32_t nf = (data >> 29) & 0x7;
+  Assert(mop == 0 && nf == 0 && RS2(data) == 0,
+         "only unit-stride vector load/store is supported, %08x", data);
+  Assert(VM(data), "masked vector load/store is not supported, %08x", data);
+  return (inst_t){
+      .rs1 = RS1(data),
+      .rd = RD(data),
+  };
+}
+
+static inline inst_t inst_vtype_read(uint32_t data) {
+  Assert(VM(data), "masked vector instruction is not supported, %08x", data);
+  return (inst_t){
+      .imm = (int32_t)(RS1(data) << 27) >> 27, // simm5 of .vi
+      .rs1 = RS1(data),
+      .rs2 = RS2(data),
+      .rd = RD(data),
+  };
+}
+
 /**
  * compressed types
  */
@@ -765,6 +793,13 @@ void inst_decode(inst_t *inst, uint32_t data) {
       case 0x3: /* FLD */
         inst->type = inst_fld;
         return;
+      case 0x0: /* VLE8.V */
+      case 0x5: /* VLE16.V */
+      case 0x6: /* VLE32.V */
+      case 0x7: /* VLE64.V */
+        *inst = inst_vltype_read(data);
+        inst->type = inst_vle8_v + (funct3 == 0 ? 0 : funct3 - 4);
+        return;
       default:
         unreachable();
       }
@@ -804,6 +839,32 @@ void inst_decode(inst_t *inst, uint32_t data) {
         uint32_t imm116 = IMM116(data);
         if (imm116 == 0) { /* SLLI */
           inst->type = inst_slli;
+        } else if (imm116 == 0x0a) { /* BSETI */
+          inst->type = inst_bseti;
+        } else if (imm116 == 0x12) { /* BCLRI */
+          inst->type = inst_bclri;
+        } else if (imm116 == 0x1a) { /* BINVI */
+          inst->type = inst_binvi;
+        } else if (imm116 == 0x18) {
+          switch (RS2(data)) {
+          case 0x0: /* CLZ */
+            inst->type = inst_clz;
+            return;
+          case 0x1: /* CTZ */
+            inst->type = inst_ctz;
+            return;
+          case 0x2: /* CPOP */
+            inst->type = inst_cpop;
+            return;
+          case 0x4: /* SEXT.B */
+            inst->type = inst_sext_b;
+            return;
+          case 0x5: /* SEXT.H */
+            inst->type = inst_sext_h;
+            return;
+          default:
+            unreachable();
+          }
         } else {
           unreachable();
         }
@@ -825,6 +886,14 @@ void inst_decode(inst_t *inst, uint32_t data) {
           inst->type = inst_srli;
         } else if (imm116 == 0x10) { /* SRAI */
           inst->type = inst_srai;
+        } else if (imm116 == 0x12) { /* BEXTI */
+          inst->type = inst_bexti;
+        } else if (imm116 == 0x18) { /* RORI */
+          inst->type = inst_rori;
+        } else if ((data >> 20) == 0x287) { /* ORC.B */
+          inst->type = inst_orc_b;
+        } else if ((data >> 20) == 0x6b8) { /* REV8 */
+          inst->type = inst_rev8;
         } else {
           unreachable();
         }
@@ -856,10 +925,30 @@ void inst_decode(inst_t *inst, uint32_t data) {
       case 0x0: /* ADDIW */
         inst->type = inst_addiw;
         return;
-      case 0x1: /* SLLIW */
-        Assert(funct7 == 0, "the data is not match ADDIW funct7 00000000");
-        inst->type = inst_slliw;
+      case 0x1: {
+        if (funct7 == 0) { /* SLLIW */
+          inst->type = inst_slliw;
+        } else if (IMM116(data) == 0x02) { /* SLLI.UW */
+          inst->type = inst_slli_uw;
+        } else if (funct7 == 0x30) {
+          switch (RS2(data)) {
+          case 0x0: /* CLZW */
+            inst->type = inst_clzw;
+            return;
+          case 0x1: /* CTZW */
+            inst->type = inst_ctzw;
+            return;
+          case 0x2: /* CPOPW */
+            inst->type = inst_cpopw;
+            return;
+          default:
+            unreachable();
+          }
+        } else {
+          unreachable();
+        }
         return;
+      }
       case 0x5: {
         switch (funct7) {
         case 0x0: /* SRLIW */
@@ -868,6 +957,9 @@ void inst_decode(inst_t *inst, uint32_t data) {
         case 0x20: /* SRAIW */
           inst->type = inst_sraiw;
           return;
+        case 0x30: /* RORIW */
+          inst->type = inst_roriw;
+          return;
         default:
           unreachable();
         }
@@ -911,6 +1003,73 @@ void inst_decode(inst_t *inst, uint32_t data) {
       case 0x3: /* FSD */
         inst->type = inst_fsd;
         return;
+      case 0x0: /* VSE8.V */
+      case 0x5: /* VSE16.V */
+      case 0x6: /* VSE32.V */
+      case 0x7: /* VSE64.V */
+        *inst = inst_vltype_read(data);
+        // the store data vs3 sits in the rd field, keep it in rs2 like sw
+        inst->rs2 = inst->rd;
+        inst->rd = 0;
+        inst->type = inst_vse8_v + (funct3 == 0 ? 0 : funct3 - 4);
+        return;
+      default:
+        unreachable();
+      }
+    }
+      unreachable();
+    case 0xb: {
+      uint32_t funct3 = FUNCT3(data);
+      uint32_t funct5 = (data >> 27) & 0x1f;
+
+      *inst = inst_rtype_read(data);
+      // the D variants follow the W ones in inst_type_t
+      int32_t d = 0;
+      switch (funct3) {
+      case 0x2: /* .W */
+        break;
+      case 0x3: /* .D */
+        d = inst_lr_d - inst_lr_w;
+        break;
+      default:
+        unreachable();
+      }
+
+      switch (funct5) {
+      case 0x02: /* LR */
+        Assert(inst->rs2 == 0, "lr rs2 should be 0");
+        inst->type = inst_lr_w + d;
+        return;
+      case 0x03: /* SC */
+        inst->type = inst_sc_w + d;
+        return;
+      case 0x01: /* AMOSWAP */
+        inst->type = inst_amoswap_w + d;
+        return;
+      case 0x00: /* AMOADD */
+        inst->type = inst_amoadd_w + d;
+        return;
+      case 0x04: /* AMOXOR */
+        inst->type = inst_amoxor_w + d;
+        return;
+      case 0x0c: /* AMOAND */
+        inst->type = inst_amoand_w + d;
+        return;
+      case 0x08: /* AMOOR */
+        inst->type = inst_amoor_w + d;
+        return;
+      case 0x10: /* AMOMIN */
+        inst->type = inst_amomin_w + d;
+        return;
+      case 0x14: /* AMOMAX */
+        inst->type = inst_amomax_w + d;
+        return;
+      case 0x18: /* AMOMINU */
+        inst->type = inst_amominu_w + d;
+        return;
+      case 0x1c: /* AMOMAXU */
+        inst->type = inst_amomaxu_w + d;
+        return;
       default:
         unreachable();
       }
@@ -992,11 +1151,89 @@ void inst_decode(inst_t *inst, uint32_t data) {
         case 0x5: /* SRA */
           inst->type = inst_sra;
           return;
+        case 0x4: /* XNOR */
+          inst->type = inst_xnor;
+          return;
+        case 0x6: /* ORN */
+          inst->type = inst_orn;
+          return;
+        case 0x7: /* ANDN */
+          inst->type = inst_andn;
+          return;
+        default:
+          unreachable();
+        }
+      }
+        unreachable();
+      case 0x05: {
+        switch (funct3) {
+        case 0x4: /* MIN */
+          inst->type = inst_min;
+          return;
+        case 0x5: /* MINU */
+          inst->type = inst_minu;
+          return;
+        case 0x6: /* MAX */
+          inst->type = inst_max;
+          return;
+        case 0x7: /* MAXU */
+          inst->type = inst_maxu;
+          return;
+        default:
+          unreachable();
+        }
+      }
+        unreachable();
+      case 0x10: {
+        switch (funct3) {
+        case 0x2: /* SH1ADD */
+          inst->type = inst_sh1add;
+          return;
+        case 0x4: /* SH2ADD */
+          inst->type = inst_sh2add;
+          return;
+        case 0x6: /* SH3ADD */
+          inst->type = inst_sh3add;
+          return;
+        default:
+          unreachable();
+        }
+      }
+        unreachable();
+      case 0x30: {
+        switch (funct3) {
+        case 0x1: /* ROL */
+          inst->type = inst_rol;
+          return;
+        case 0x5: /* ROR */
+          inst->type = inst_ror;
+          return;
+        default:
+          unreachable();
+        }
+      }
+        unreachable();
+      case 0x14: /* BSET */
+        Assert(funct3 == 0x1, "unrecognized funct3");
+        inst->type = inst_bset;
+        return;
+      case 0x24: {
+        switch (funct3) {
+        case 0x1: /* BCLR */
+          inst->type = inst_bclr;
+          return;
+        case 0x5: /* BEXT */
+          inst->type = inst_bext;
+          return;
         default:
           unreachable();
         }
       }
         unreachable();
+      case 0x34: /* BINV */
+        Assert(funct3 == 0x1, "unrecognized funct3");
+        inst->type = inst_binv;
+        return;
       default:
         unreachable();
       }
@@ -1064,6 +1301,49 @@ void inst_decode(inst_t *inst, uint32_t data) {
         }
       }
         unreachable();
+      case 0x04: {
+        switch (funct3) {
+        case 0x0: /* ADD.UW */
+          inst->type = inst_add_uw;
+          return;
+        case 0x4: /* ZEXT.H */
+          Assert(inst->rs2 == 0, "zext.h rs2 should be 0");
+          inst->type = inst_zext_h;
+          return;
+        default:
+          unreachable();
+        }
+      }
+        unreachable();
+      case 0x10: {
+        switch (funct3) {
+        case 0x2: /* SH1ADD.UW */
+          inst->type = inst_sh1add_uw;
+          return;
+        case 0x4: /* SH2ADD.UW */
+          inst->type = inst_sh2add_uw;
+          return;
+        case 0x6: /* SH3ADD.UW */
+          inst->type = inst_sh3add_uw;
+          return;
+        default:
+          unreachable();
+        }
+      }
+        unreachable();
+      case 0x30: {
+        switch (funct3) {
+        case 0x1: /* ROLW */
+          inst->type = inst_rolw;
+          return;
+        case 0x5: /* RORW */
+          inst->type = inst_rorw;
+          return;
+        default:
+          unreachable();
+        }
+      }
+        unreachable();
       default:
         unreachable();
       }
@@ -1408,6 +1688,211 @@ void inst_decode(inst_t *inst, uint32_t data) {
       }
     }
       unreachable();
+    case 0x15: {
+      uint32_t funct3 = FUNCT3(data);
+      uint32_t funct6 = FUNCT6(data);
+
+      if (funct3 == 0x7) {
+        *inst = inst_rtype_read(data);
+        if ((data >> 31) == 0) { /* VSETVLI */
+          inst->imm = (data >> 20) & 0x7ff;
+          inst->type = inst_vsetvli;
+        } else if ((data >> 30) == 0x3) { /* VSETIVLI */
+          inst->imm = (data >> 20) & 0x3ff;
+          inst->type = inst_vsetivli;
+        } else { /* VSETVL */
+          inst->type = inst_vsetvl;
+        }
+        return;
+      }
+
+      *inst = inst_vtype_read(data);
+      switch (funct3) {
+      case 0x0: /* OPIVV */
+        switch (funct6) {
+        case 0x00: /* VADD.VV */
+          inst->type = inst_vadd_vv;
+          return;
+        case 0x02: /* VSUB.VV */
+          inst->type = inst_vsub_vv;
+          return;
+        case 0x04: /* VMINU.VV */
+          inst->type = inst_vminu_vv;
+          return;
+        case 0x05: /* VMIN.VV */
+          inst->type = inst_vmin_vv;
+          return;
+        case 0x06: /* VMAXU.VV */
+          inst->type = inst_vmaxu_vv;
+          return;
+        case 0x07: /* VMAX.VV */
+          inst->type = inst_vmax_vv;
+          return;
+        case 0x09: /* VAND.VV */
+          inst->type = inst_vand_vv;
+          return;
+        case 0x0a: /* VOR.VV */
+          inst->type = inst_vor_vv;
+          return;
+        case 0x0b: /* VXOR.VV */
+          inst->type = inst_vxor_vv;
+          return;
+        case 0x17: /* VMV.V.V */
+          inst->type = inst_vmv_v_v;
+          return;
+        default:
+          panic("unimplemented vector instruction %08x", data);
+        }
+      case 0x4: /* OPIVX */
+        switch (funct6) {
+        case 0x00: /* VADD.VX */
+          inst->type = inst_vadd_vx;
+          return;
+        case 0x02: /* VSUB.VX */
+          inst->type = inst_vsub_vx;
+          return;
+        case 0x03: /* VRSUB.VX */
+          inst->type = inst_vrsub_vx;
+          return;
+        case 0x04: /* VMINU.VX */
+          inst->type = inst_vminu_vx;
+          return;
+        case 0x05: /* VMIN.VX */
+          inst->type = inst_vmin_vx;
+          return;
+        case 0x06: /* VMAXU.VX */
+          inst->type = inst_vmaxu_vx;
+          return;
+        case 0x07: /* VMAX.VX */
+          inst->type = inst_vmax_vx;
+          return;
+        case 0x09: /* VAND.VX */
+          inst->type = inst_vand_vx;
+          return;
+        case 0x0a: /* VOR.VX */
+          inst->type = inst_vor_vx;
+          return;
+        case 0x0b: /* VXOR.VX */
+          inst->type = inst_vxor_vx;
+          return;
+        case 0x17: /* VMV.V.X */
+          inst->type = inst_vmv_v_x;
+          return;
+        default:
+          panic("unimplemented vector instruction %08x", data);
+        }
+      case 0x3: /* OPIVI */
+        switch (funct6) {
+        case 0x00: /* VADD.VI */
+          inst->type = inst_vadd_vi;
+          return;
+        case 0x03: /* VRSUB.VI */
+          inst->type = inst_vrsub_vi;
+          return;
+        case 0x09: /* VAND.VI */
+          inst->type = inst_vand_vi;
+          return;
+        case 0x0a: /* VOR.VI */
+          inst->type = inst_vor_vi;
+          return;
+        case 0x0b: /* VXOR.VI */
+          inst->type = inst_vxor_vi;
+          return;
+        case 0x17: /* VMV.V.I */
+          inst->type = inst_vmv_v_i;
+          return;
+        default:
+          panic("unimplemented vector instruction %08x", data);
+        }
+      case 0x2: /* OPMVV */
+        switch (funct6) {
+        case 0x00: /* VREDSUM.VS */
+          inst->type = inst_vredsum_vs;
+          return;
+        case 0x10: /* VMV.X.S */
+          Assert(inst->rs1 == 0, "vwxunary0 %08x", data);
+          inst->type = inst_vmv_x_s;
+          return;
+        case 0x25: /* VMUL.VV */
+          inst->type = inst_vmul_vv;
+          return;
+        default:
+          panic("unimplemented vector instruction %08x", data);
+        }
+      case 0x6: /* OPMVX */
+        switch (funct6) {
+        case 0x10: /* VMV.S.X */
+          Assert(inst->rs2 == 0, "vrxunary0 %08x", data);
+          inst->type = inst_vmv_s_x;
+          return;
+        case 0x25: /* VMUL.VX */
+          inst->type = inst_vmul_vx;
+          return;
+        default:
+          panic("unimplemented vector instruction %08x", data);
+        }
+      case 0x1: /* OPFVV */
+        switch (funct6) {
+        case 0x00: /* VFADD.VV */
+          inst->type = inst_vfadd_vv;
+          return;
+        case 0x01: /* VFREDUSUM.VS */
+          inst->type = inst_vfredusum_vs;
+          return;
+        case 0x02: /* VFSUB.VV */
+          inst->type = inst_vfsub_vv;
+          return;
+        case 0x03: /* VFREDOSUM.VS */
+          inst->type = inst_vfredosum_vs;
+          return;
+        case 0x10: /* VFMV.F.S */
+          Assert(inst->rs1 == 0, "vwfunary0 %08x", data);
+          inst->type = inst_vfmv_f_s;
+          return;
+        case 0x20: /* VFDIV.VV */
+          inst->type = inst_vfdiv_vv;
+          return;
+        case 0x24: /* VFMUL.VV */
+          inst->type = inst_vfmul_vv;
+          return;
+        case 0x2c: /* VFMACC.VV */
+          inst->type = inst_vfmacc_vv;
+          return;
+        default:
+          panic("unimplemented vector instruction %08x", data);
+        }
+      case 0x5: /* OPFVF */
+        switch (funct6) {
+        case 0x00: /* VFADD.VF */
+          inst->type = inst_vfadd_vf;
+          return;
+        case 0x02: /* VFSUB.VF */
+          inst->type = inst_vfsub_vf;
+          return;
+        case 0x10: /* VFMV.S.F */
+          Assert(inst->rs2 == 0, "vrfunary0 %08x", data);
+          inst->type = inst_vfmv_s_f;
+          return;
+        case 0x17: /* VFMV.V.F */
+          inst->type = inst_vfmv_v_f;
+          return;
+        case 0x20: /* VFDIV.VF */
+          inst->type = inst_vfdiv_vf;
+          return;
+        case 0x24: /* VFMUL.VF */
+          inst->type = inst_vfmul_vf;
+          return;
+        case 0x2c: /* VFMACC.VF */
+          inst->type = inst_vfmacc_vf;
+          return;
+        default:
+          panic("unimplemented vector instruction %08x", data);
+        }
+      default:
+        unreachable();
+      }
+    }
+      unreachable();
     case 0x18: {
       *inst = inst_btype_read(data);
 
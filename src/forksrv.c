@@ -0,0 +1,58 @@
+/**
+ * @file forksrv.c
+ * @brief fork the initialized machine once per run of a fuzzer or batch
+ */
+
+#include "rvemu.h"
+#include <sys/wait.h>
+
+static bool forksrv_read(void) {
+  uint32_t cmd;
+  ssize_t n;
+  do {
+    n = read(FORKSRV_FD, &cmd, sizeof(cmd));
+  } while (n < 0 && errno == EINTR);
+  return n == sizeof(cmd);
+}
+
+static void forksrv_write(uint32_t val) {
+  ssize_t n;
+  do {
+    n = write(FORKSRV_FD + 1, &val, sizeof(val));
+  } while (n < 0 && errno == EINTR);
+  Assert(n == sizeof(val), "fork server: %s", strerror(errno));
+}
+
+/**
+ * @brief serve forks until the driver closes the control pipe
+ *
+ * only returns in a child, which goes on running the guest. children
+ * share guest memory with the server copy-on-write, and the JIT cache
+ * for real when it was created with new_fork_cache.
+ *
+ * @param m
+ */
+void fork_server(machine_t *m) {
+  // the driver is not there, run the guest once
+  if (fcntl(FORKSRV_FD, F_GETFD) == -1 || fcntl(FORKSRV_FD + 1, F_GETFD) == -1)
+    return;
+
+  forksrv_write(0); // hello
+
+  while (forksrv_read()) {
+    pid_t pid = machine_fork(m);
+    Assert(pid != -1, "fork server: %s", strerror(errno));
+    if (pid == 0) {
+      close(FORKSRV_FD);
+      close(FORKSRV_FD + 1);
+      return;
+    }
+
+    forksrv_write(pid);
+    int status;
+    while (waitpid(pid, &status, 0) == -1)
+      Assert(errno == EINTR, "fork server: %s", strerror(errno));
+    forksrv_write(status);
+  }
+  exit(0);
+}
@@ -6,6 +6,7 @@
 #include "decode.h"
 #include "interp_util.h"
 #include "rvemu.h"
+#include <math.h>
 
 const char *inst_name[] = {
     "inst_lb",        "inst_lh",        "inst_lw",        "inst_ld",
@@ -79,6 +80,44 @@ const char *inst_name[] = {
     "inst_fcvt_l_d",  "inst_fcvt_lu_d",
 
     "inst_fmv_x_d",   "inst_fcvt_d_l",  "inst_fcvt_d_lu", "inst_fmv_d_x",
+
+    "inst_lr_w",      "inst_sc_w",      "inst_amoswap_w", "inst_amoadd_w",
+    "inst_amoxor_w",  "inst_amoand_w",  "inst_amoor_w",   "inst_amomin_w",
+    "inst_amomax_w",  "inst_amominu_w", "inst_amomaxu_w",
+
+    "inst_lr_d",      "inst_sc_d",      "inst_amoswap_d", "inst_amoadd_d",
+    "inst_amoxor_d",  "inst_amoand_d",  "inst_amoor_d",   "inst_amomin_d",
+    "inst_amomax_d",  "inst_amominu_d", "inst_amomaxu_d",
+
+    "inst_vsetvli",   "inst_vsetivli",  "inst_vsetvl",    "inst_vle8_v",
+    "inst_vle16_v",   "inst_vle32_v",   "inst_vle64_v",   "inst_vse8_v",
+    "inst_vse16_v",   "inst_vse32_v",   "inst_vse64_v",
+
+    "inst_vadd_vv",   "inst_vadd_vx",   "inst_vadd_vi",   "inst_vsub_vv",
+    "inst_vsub_vx",   "inst_vrsub_vx",  "inst_vrsub_vi",  "inst_vand_vv",
+    "inst_vand_vx",   "inst_vand_vi",   "inst_vor_vv",    "inst_vor_vx",
+    "inst_vor_vi",    "inst_vxor_vv",   "inst_vxor_vx",   "inst_vxor_vi",
+    "inst_vminu_vv",  "inst_vminu_vx",  "inst_vmin_vv",   "inst_vmin_vx",
+    "inst_vmaxu_vv",  "inst_vmaxu_vx",  "inst_vmax_vv",   "inst_vmax_vx",
+    "inst_vmul_vv",   "inst_vmul_vx",   "inst_vmv_v_v",   "inst_vmv_v_x",
+    "inst_vmv_v_i",   "inst_vredsum_vs", "inst_vmv_x_s",   "inst_vmv_s_x",
+
+    "inst_vfadd_vv",  "inst_vfadd_vf",  "inst_vfsub_vv",  "inst_vfsub_vf",
+    "inst_vfmul_vv",  "inst_vfmul_vf",  "inst_vfdiv_vv",  "inst_vfdiv_vf",
+    "inst_vfmacc_vv", "inst_vfmacc_vf", "inst_vfmv_v_f",  "inst_vfredusum_vs",
+    "inst_vfredosum_vs", "inst_vfmv_f_s",  "inst_vfmv_s_f",
+    "inst_add_uw", "inst_sh1add", "inst_sh2add", "inst_sh3add",
+    "inst_sh1add_uw", "inst_sh2add_uw", "inst_sh3add_uw", "inst_slli_uw",
+
+    "inst_andn", "inst_orn", "inst_xnor", "inst_clz",
+    "inst_clzw", "inst_ctz", "inst_ctzw", "inst_cpop",
+    "inst_cpopw", "inst_max", "inst_maxu", "inst_min",
+    "inst_minu", "inst_sext_b", "inst_sext_h", "inst_zext_h",
+    "inst_rol", "inst_rolw", "inst_ror", "inst_rori",
+    "inst_roriw", "inst_rorw", "inst_orc_b", "inst_rev8",
+
+    "inst_bclr", "inst_bclri", "inst_bext", "inst_bexti",
+    "inst_binv", "inst_binvi", "inst_bset", "inst_bseti",
 };
 
 static void func_empty(state_t *state, inst_t *inst) { panic("unimplement"); }
@@ -143,6 +182,12 @@ FUNC_STORE(sd, uint64_t);
     state->gp_regs[inst->rd] = (expr);                                         \
   }
 
+#define FUNC_ALU1(inst, expr)                                                  \
+  static void func_##inst(state_t *state, inst_t *inst) {                      \
+    uint64_t rs1 = state->gp_regs[inst->rs1];                                  \
+    state->gp_regs[inst->rd] = (expr);                                         \
+  }
+
 FUNC_ALU(add, rs1 + rs2);
 FUNC_ALU(sll, rs1 << (rs2 & 0x3f));
 FUNC_ALU(slt, (int64_t)rs1 < (int64_t)rs2);
@@ -177,6 +222,53 @@ FUNC_ALU(remuw, rs2 == 0 ? (int64_t)(int32_t)(uint32_t)rs1
 FUNC_ALU(subw, (int64_t)(int32_t)(rs1 - rs2));
 FUNC_ALU(sraw, (int64_t)(int32_t)((int32_t)rs1 >> (rs2 & 0x1f)));
 
+/*
+ * Zba, Zbb and Zbs. the builtins compile to single host instructions
+ * (lzcnt, tzcnt, popcnt, bswap) and the shifted adds to lea.
+ */
+FUNC_ALU(add_uw, (uint64_t)(uint32_t)rs1 + rs2);
+FUNC_ALU(sh1add, (rs1 << 1) + rs2);
+FUNC_ALU(sh2add, (rs1 << 2) + rs2);
+FUNC_ALU(sh3add, (rs1 << 3) + rs2);
+FUNC_ALU(sh1add_uw, ((uint64_t)(uint32_t)rs1 << 1) + rs2);
+FUNC_ALU(sh2add_uw, ((uint64_t)(uint32_t)rs1 << 2) + rs2);
+FUNC_ALU(sh3add_uw, ((uint64_t)(uint32_t)rs1 << 3) + rs2);
+FUNC_ALUI(slli_uw, (uint64_t)(uint32_t)rs1 << (imm & 0x3f));
+
+FUNC_ALU(andn, rs1 & ~rs2);
+FUNC_ALU(orn, rs1 | ~rs2);
+FUNC_ALU(xnor, ~(rs1 ^ rs2));
+FUNC_ALU1(clz, rs1 ? __builtin_clzll(rs1) : 64);
+FUNC_ALU1(clzw, (uint32_t)rs1 ? __builtin_clz((uint32_t)rs1) : 32);
+FUNC_ALU1(ctz, rs1 ? __builtin_ctzll(rs1) : 64);
+FUNC_ALU1(ctzw, (uint32_t)rs1 ? __builtin_ctz((uint32_t)rs1) : 32);
+FUNC_ALU1(cpop, __builtin_popcountll(rs1));
+FUNC_ALU1(cpopw, __builtin_popcount((uint32_t)rs1));
+FUNC_ALU(max, (int64_t)rs1 > (int64_t)rs2 ? rs1 : rs2);
+FUNC_ALU(maxu, rs1 > rs2 ? rs1 : rs2);
+FUNC_ALU(min, (int64_t)rs1 < (int64_t)rs2 ? rs1 : rs2);
+FUNC_ALU(minu, rs1 < rs2 ? rs1 : rs2);
+FUNC_ALU1(sext_b, (int64_t)(int8_t)rs1);
+FUNC_ALU1(sext_h, (int64_t)(int16_t)rs1);
+FUNC_ALU1(zext_h, (uint16_t)rs1);
+FUNC_ALU(rol, rol64(rs1, rs2));
+FUNC_ALU(rolw, (int64_t)(int32_t)rol32(rs1, rs2));
+FUNC_ALU(ror, ror64(rs1, rs2));
+FUNC_ALUI(rori, ror64(rs1, imm));
+FUNC_ALUI(roriw, (int64_t)(int32_t)ror32(rs1, imm));
+FUNC_ALU(rorw, (int64_t)(int32_t)ror32(rs1, rs2));
+FUNC_ALU1(orc_b, orc_b_helper(rs1));
+FUNC_ALU1(rev8, __builtin_bswap64(rs1));
+
+FUNC_ALU(bclr, rs1 & ~(1ULL << (rs2 & 0x3f)));
+FUNC_ALUI(bclri, rs1 & ~(1ULL << (imm & 0x3f)));
+FUNC_ALU(bext, (rs1 >> (rs2 & 0x3f)) & 1);
+FUNC_ALUI(bexti, (rs1 >> (imm & 0x3f)) & 1);
+FUNC_ALU(binv, rs1 ^ (1ULL << (rs2 & 0x3f)));
+FUNC_ALUI(binvi, rs1 ^ (1ULL << (imm & 0x3f)));
+FUNC_ALU(bset, rs1 | (1ULL << (rs2 & 0x3f)));
+FUNC_ALUI(bseti, rs1 | (1ULL << (imm & 0x3f)));
+
 #define FUNC_BR(inst, expr)                                                    \
   static void func_##inst(state_t *state, inst_t *inst) {                      \
     uint64_t rs1 = state->gp_regs[inst->rs1];                                  \
@@ -298,13 +390,396 @@ FUNC_FBR_D(feq_d, rs1 == rs2);
 FUNC_FBR_D(flt_d, rs1 < rs2);
 FUNC_FBR_D(fle_d, rs1 <= rs2);
 
+/*
+ * Zicsr, only reads of the cycle, time and instret counters. they are read
+ * only, csrrs/csrrc with rs1 zero (uimm 0 for the i forms) read without a
+ * write. instret counts the csr instruction itself, as in JIT code.
+ */
+#define FUNC_CSR(inst)                                                         \
+  static void func_##inst(state_t *state, inst_t *inst) {                      \
+    Assert(csr_is_counter(inst->csr) && inst->rs1 == 0,                        \
+           "unimplemented csr %#x", inst->csr);                                \
+    state->gp_regs[inst->rd] = csr_read(state, inst->csr, state->icount);      \
+  }
+
+FUNC_CSR(csrrc);
+FUNC_CSR(csrrci);
+FUNC_CSR(csrrs);
+FUNC_CSR(csrrsi);
+
+static void func_fence(state_t *state, inst_t *inst) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * A extension, every AMO is a single host atomic (lock prefixed on x86).
+ * lr remembers the loaded value, sc succeeds if a cas from that value
+ * succeeds, so stores of other harts in between break the reservation.
+ */
+#define FUNC_LR(inst, typ)                                                     \
+  static void func_##inst(state_t *state, inst_t *inst) {                      \
+    uint64_t addr = state->gp_regs[inst->rs1];                                 \
+    typ val = __atomic_load_n((typ *)GUEST_TO_HOST(addr), __ATOMIC_SEQ_CST);   \
+    state->reserve_addr = addr;                                                \
+    state->reserve_val = (uint64_t)val;                                        \
+    state->gp_regs[inst->rd] = (int64_t)val;                                   \
+  }
+
+FUNC_LR(lr_w, int32_t);
+FUNC_LR(lr_d, int64_t);
+
+#define FUNC_SC(inst, typ)                                                     \
+  static void func_##inst(state_t *state, inst_t *inst) {                      \
+    uint64_t addr = state->gp_regs[inst->rs1];                                 \
+    typ expected = (typ)state->reserve_val;                                    \
+    bool ok = state->reserve_addr == addr &&                                   \
+              __atomic_compare_exchange_n(                                     \
+                  (typ *)GUEST_TO_HOST(addr), &expected,                       \
+                  (typ)state->gp_regs[inst->rs2], false, __ATOMIC_SEQ_CST,     \
+                  __ATOMIC_SEQ_CST);                                           \
+    state->reserve_addr = 0;                                                   \
+    state->gp_regs[inst->rd] = !ok;                                            \
+  }
+
+FUNC_SC(sc_w, int32_t);
+FUNC_SC(sc_d, int64_t);
+
+#define FUNC_AMO(inst, typ, op)                                                \
+  static void func_##inst(state_t *state, inst_t *inst) {                      \
+    uint64_t rs1 = state->gp_regs[inst->rs1];                                  \
+    uint64_t rs2 = state->gp_regs[inst->rs2];                                  \
+    typ old = op((typ *)GUEST_TO_HOST(rs1), (typ)rs2, __ATOMIC_SEQ_CST);       \
+    state->gp_regs[inst->rd] = (int64_t)old;                                   \
+  }
+
+FUNC_AMO(amoswap_w, int32_t, __atomic_exchange_n);
+FUNC_AMO(amoadd_w, int32_t, __atomic_fetch_add);
+FUNC_AMO(amoxor_w, int32_t, __atomic_fetch_xor);
+FUNC_AMO(amoand_w, int32_t, __atomic_fetch_and);
+FUNC_AMO(amoor_w, int32_t, __atomic_fetch_or);
+FUNC_AMO(amoswap_d, int64_t, __atomic_exchange_n);
+FUNC_AMO(amoadd_d, int64_t, __atomic_fetch_add);
+FUNC_AMO(amoxor_d, int64_t, __atomic_fetch_xor);
+FUNC_AMO(amoand_d, int64_t, __atomic_fetch_and);
+FUNC_AMO(amoor_d, int64_t, __atomic_fetch_or);
+
+// the host has no atomic min/max, retry a cas until it sticks
+#define FUNC_AMO_MINMAX(inst, typ, styp, cmp)                                  \
+  static void func_##inst(state_t *state, inst_t *inst) {                      \
+    uint64_t rs1 = state->gp_regs[inst->rs1];                                  \
+    typ rs2 = (typ)state->gp_regs[inst->rs2];                                  \
+    typ *mem = (typ *)GUEST_TO_HOST(rs1);                                      \
+    typ old = __atomic_load_n(mem, __ATOMIC_RELAXED);                          \
+    while (!__atomic_compare_exchange_n(mem, &old, rs2 cmp old ? rs2 : old,    \
+                                        true, __ATOMIC_SEQ_CST,                \
+                                        __ATOMIC_RELAXED))                     \
+      ;                                                                        \
+    state->gp_regs[inst->rd] = (int64_t)(styp)old;                             \
+  }
+
+FUNC_AMO_MINMAX(amomin_w, int32_t, int32_t, <);
+FUNC_AMO_MINMAX(amomax_w, int32_t, int32_t, >);
+FUNC_AMO_MINMAX(amominu_w, uint32_t, int32_t, <);
+FUNC_AMO_MINMAX(amomaxu_w, uint32_t, int32_t, >);
+FUNC_AMO_MINMAX(amomin_d, int64_t, int64_t, <);
+FUNC_AMO_MINMAX(amomax_d, int64_t, int64_t, >);
+FUNC_AMO_MINMAX(amominu_d, uint64_t, int64_t, <);
+FUNC_AMO_MINMAX(amomaxu_d, uint64_t, int64_t, >);
+
+/*
+ * V extension. the handlers compute on VLENB byte host vectors (SSE, or
+ * AVX2 with -march=native) and only write the first vl elements of vd,
+ * the tail is left undisturbed. register groups (LMUL > 1) are contiguous
+ * in state->vregs, so they are simply longer loops.
+ */
+typedef int8_t vi8_t __attribute__((vector_size(VLENB)));
+typedef uint8_t vu8_t __attribute__((vector_size(VLENB)));
+typedef int16_t vi16_t __attribute__((vector_size(VLENB)));
+typedef uint16_t vu16_t __attribute__((vector_size(VLENB)));
+typedef int32_t vi32_t __attribute__((vector_size(VLENB)));
+typedef uint32_t vu32_t __attribute__((vector_size(VLENB)));
+typedef int64_t vi64_t __attribute__((vector_size(VLENB)));
+typedef uint64_t vu64_t __attribute__((vector_size(VLENB)));
+typedef float vf32_t __attribute__((vector_size(VLENB)));
+typedef double vf64_t __attribute__((vector_size(VLENB)));
+
+#define VREG(n) (state->vregs + (n)*VLENB)
+#define VLOAD(n) (*(vt *)(VREG(n) + off))
+#define VSPLAT(x) ((vt){} + (__typeof__(((vt){})[0]))(x))
+#define VMIN(a, b) (((a) & (vt)((a) < (b))) | ((b) & (vt)((a) >= (b))))
+#define VMAX(a, b) (((a) & (vt)((a) > (b))) | ((b) & (vt)((a) <= (b))))
+
+#define VOP_VV VLOAD(inst->rs1)
+#define VOP_VX VSPLAT(state->gp_regs[inst->rs1])
+#define VOP_VI VSPLAT(inst->imm)
+
+#define VEC_LOOP(VT, A, B, expr)                                               \
+  do {                                                                         \
+    typedef VT vt;                                                             \
+    uint64_t n = state->vl * sizeof(((vt){})[0]);                              \
+    for (uint64_t off = 0; off < n; off += VLENB) {                            \
+      vt a = (A), b = (B), r = (expr);                                         \
+      (void)a;                                                                 \
+      memcpy(VREG(inst->rd) + off, &r, MIN(n - off, VLENB));                   \
+    }                                                                          \
+  } while (0)
+
+#define FUNC_VINT(name, S, B, expr)                                            \
+  static void func_##name(state_t *state, inst_t *inst) {                      \
+    switch (VTYPE_SEW(state->vtype)) {                                         \
+    case 8:                                                                    \
+      VEC_LOOP(v##S##8_t, VLOAD(inst->rs2), B, expr);                          \
+      break;                                                                   \
+    case 16:                                                                   \
+      VEC_LOOP(v##S##16_t, VLOAD(inst->rs2), B, expr);                         \
+      break;                                                                   \
+    case 32:                                                                   \
+      VEC_LOOP(v##S##32_t, VLOAD(inst->rs2), B, expr);                         \
+      break;                                                                   \
+    case 64:                                                                   \
+      VEC_LOOP(v##S##64_t, VLOAD(inst->rs2), B, expr);                         \
+      break;                                                                   \
+    default:                                                                   \
+      unreachable();                                                           \
+    }                                                                          \
+  }
+
+FUNC_VINT(vadd_vv, i, VOP_VV, a + b);
+FUNC_VINT(vadd_vx, i, VOP_VX, a + b);
+FUNC_VINT(vadd_vi, i, VOP_VI, a + b);
+FUNC_VINT(vsub_vv, i, VOP_VV, a - b);
+FUNC_VINT(vsub_vx, i, VOP_VX, a - b);
+FUNC_VINT(vrsub_vx, i, VOP_VX, b - a);
+FUNC_VINT(vrsub_vi, i, VOP_VI, b - a);
+FUNC_VINT(vand_vv, i, VOP_VV, a &b);
+FUNC_VINT(vand_vx, i, VOP_VX, a &b);
+FUNC_VINT(vand_vi, i, VOP_VI, a &b);
+FUNC_VINT(vor_vv, i, VOP_VV, a | b);
+FUNC_VINT(vor_vx, i, VOP_VX, a | b);
+FUNC_VINT(vor_vi, i, VOP_VI, a | b);
+FUNC_VINT(vxor_vv, i, VOP_VV, a ^ b);
+FUNC_VINT(vxor_vx, i, VOP_VX, a ^ b);
+FUNC_VINT(vxor_vi, i, VOP_VI, a ^ b);
+FUNC_VINT(vminu_vv, u, VOP_VV, VMIN(a, b));
+FUNC_VINT(vminu_vx, u, VOP_VX, VMIN(a, b));
+FUNC_VINT(vmin_vv, i, VOP_VV, VMIN(a, b));
+FUNC_VINT(vmin_vx, i, VOP_VX, VMIN(a, b));
+FUNC_VINT(vmaxu_vv, u, VOP_VV, VMAX(a, b));
+FUNC_VINT(vmaxu_vx, u, VOP_VX, VMAX(a, b));
+FUNC_VINT(vmax_vv, i, VOP_VV, VMAX(a, b));
+FUNC_VINT(vmax_vx, i, VOP_VX, VMAX(a, b));
+FUNC_VINT(vmul_vv, i, VOP_VV, a *b);
+FUNC_VINT(vmul_vx, i, VOP_VX, a *b);
+FUNC_VINT(vmv_v_v, i, VOP_VV, b);
+FUNC_VINT(vmv_v_x, i, VOP_VX, b);
+FUNC_VINT(vmv_v_i, i, VOP_VI, b);
+
+// reg.h names the float view of a fp register d and the double view f
+#define FUNC_VFLT(name, B32, B64, expr)                                        \
+  static void func_##name(state_t *state, inst_t *inst) {                      \
+    switch (VTYPE_SEW(state->vtype)) {                                         \
+    case 32:                                                                   \
+      VEC_LOOP(vf32_t, VLOAD(inst->rs2), B32, expr);                           \
+      break;                                                                   \
+    case 64:                                                                   \
+      VEC_LOOP(vf64_t, VLOAD(inst->rs2), B64, expr);                           \
+      break;                                                                   \
+    default:                                                                   \
+      panic("unsupported sew for floating point vector");                      \
+    }                                                                          \
+  }
+
+#define VOP_VF32 VSPLAT(state->fp_regs[inst->rs1].d)
+#define VOP_VF64 VSPLAT(state->fp_regs[inst->rs1].f)
+
+FUNC_VFLT(vfadd_vv, VOP_VV, VOP_VV, a + b);
+FUNC_VFLT(vfadd_vf, VOP_VF32, VOP_VF64, a + b);
+FUNC_VFLT(vfsub_vv, VOP_VV, VOP_VV, a - b);
+FUNC_VFLT(vfsub_vf, VOP_VF32, VOP_VF64, a - b);
+FUNC_VFLT(vfmul_vv, VOP_VV, VOP_VV, a *b);
+FUNC_VFLT(vfmul_vf, VOP_VF32, VOP_VF64, a *b);
+FUNC_VFLT(vfdiv_vv, VOP_VV, VOP_VV, a / b);
+FUNC_VFLT(vfdiv_vf, VOP_VF32, VOP_VF64, a / b);
+FUNC_VFLT(vfmv_v_f, VOP_VF32, VOP_VF64, b);
+
+// vd = vs1 * vs2 + vd must round once, so it goes through fma per element
+#define FUNC_VFMACC(name, S32, S64)                                            \
+  static void func_##name(state_t *state, inst_t *inst) {                      \
+    switch (VTYPE_SEW(state->vtype)) {                                         \
+    case 32: {                                                                 \
+      float *d = (float *)VREG(inst->rd), *b = (float *)VREG(inst->rs2);       \
+      for (uint64_t i = 0; i < state->vl; i++)                                 \
+        d[i] = fmaf(S32, b[i], d[i]);                                          \
+      break;                                                                   \
+    }                                                                          \
+    case 64: {                                                                 \
+      double *d = (double *)VREG(inst->rd), *b = (double *)VREG(inst->rs2);    \
+      for (uint64_t i = 0; i < state->vl; i++)                                 \
+        d[i] = fma(S64, b[i], d[i]);                                           \
+      break;                                                                   \
+    }                                                                          \
+    default:                                                                   \
+      panic("unsupported sew for floating point vector");                      \
+    }                                                                          \
+  }
+
+FUNC_VFMACC(vfmacc_vv, ((float *)VREG(inst->rs1))[i],
+            ((double *)VREG(inst->rs1))[i]);
+FUNC_VFMACC(vfmacc_vf, state->fp_regs[inst->rs1].d,
+            state->fp_regs[inst->rs1].f);
+
+// vd[0] = vs1[0] + sum(vs2[0 .. vl - 1]), in element order
+#define VEC_REDSUM(T)                                                          \
+  do {                                                                         \
+    T *s2 = (T *)VREG(inst->rs2);                                              \
+    T acc = ((T *)VREG(inst->rs1))[0];                                         \
+    for (uint64_t i = 0; i < state->vl; i++)                                   \
+      acc += s2[i];                                                            \
+    ((T *)VREG(inst->rd))[0] = acc;                                            \
+  } while (0)
+
+static void func_vredsum_vs(state_t *state, inst_t *inst) {
+  if (state->vl == 0)
+    return;
+  switch (VTYPE_SEW(state->vtype)) {
+  case 8:
+    VEC_REDSUM(uint8_t);
+    break;
+  case 16:
+    VEC_REDSUM(uint16_t);
+    break;
+  case 32:
+    VEC_REDSUM(uint32_t);
+    break;
+  case 64:
+    VEC_REDSUM(uint64_t);
+    break;
+  default:
+    unreachable();
+  }
+}
+
+static void func_vfredosum_vs(state_t *state, inst_t *inst) {
+  if (state->vl == 0)
+    return;
+  switch (VTYPE_SEW(state->vtype)) {
+  case 32:
+    VEC_REDSUM(float);
+    break;
+  case 64:
+    VEC_REDSUM(double);
+    break;
+  default:
+    panic("unsupported sew for floating point vector");
+  }
+}
+
+// the unordered sum may use any order, the ordered one is a valid choice
+#define func_vfredusum_vs func_vfredosum_vs
+
+static void func_vmv_x_s(state_t *state, inst_t *inst) {
+  uint8_t *vs2 = VREG(inst->rs2);
+  switch (VTYPE_SEW(state->vtype)) {
+  case 8:
+    state->gp_regs[inst->rd] = *(int8_t *)vs2;
+    break;
+  case 16:
+    state->gp_regs[inst->rd] = *(int16_t *)vs2;
+    break;
+  case 32:
+    state->gp_regs[inst->rd] = *(int32_t *)vs2;
+    break;
+  case 64:
+    state->gp_regs[inst->rd] = *(int64_t *)vs2;
+    break;
+  default:
+    unreachable();
+  }
+}
+
+static void func_vmv_s_x(state_t *state, inst_t *inst) {
+  if (state->vl == 0)
+    return;
+  uint64_t x = state->gp_regs[inst->rs1];
+  memcpy(VREG(inst->rd), &x, VTYPE_SEW(state->vtype) / 8);
+}
+
+static void func_vfmv_f_s(state_t *state, inst_t *inst) {
+  uint8_t *vs2 = VREG(inst->rs2);
+  if (VTYPE_SEW(state->vtype) == 32)
+    state->fp_regs[inst->rd].v = *(uint32_t *)vs2 | ((uint64_t)-1 << 32);
+  else
+    state->fp_regs[inst->rd].v = *(uint64_t *)vs2;
+}
+
+static void func_vfmv_s_f(state_t *state, inst_t *inst) {
+  if (state->vl == 0)
+    return;
+  memcpy(VREG(inst->rd), &state->fp_regs[inst->rs1].v,
+         VTYPE_SEW(state->vtype) / 8);
+}
+
+#define FUNC_VLOAD(name, eew)                                                  \
+  static void func_##name(state_t *state, inst_t *inst) {                      \
+    uint64_t addr = state->gp_regs[inst->rs1];                                 \
+    memcpy(VREG(inst->rd), (void *)GUEST_TO_HOST(addr), state->vl *(eew) / 8); \
+  }
+
+FUNC_VLOAD(vle8_v, 8);
+FUNC_VLOAD(vle16_v, 16);
+FUNC_VLOAD(vle32_v, 32);
+FUNC_VLOAD(vle64_v, 64);
+
+#define FUNC_VSTORE(name, eew)                                                 \
+  static void func_##name(state_t *state, inst_t *inst) {                      \
+    uint64_t addr = state->gp_regs[inst->rs1];                                 \
+    memcpy((void *)GUEST_TO_HOST(addr), VREG(inst->rs2), state->vl *(eew) / 8); \
+  }
+
+FUNC_VSTORE(vse8_v, 8);
+FUNC_VSTORE(vse16_v, 16);
+FUNC_VSTORE(vse32_v, 32);
+FUNC_VSTORE(vse64_v, 64);
+
+static void vec_setvl(state_t *state, inst_t *inst, uint64_t avl,
+                      uint64_t vtype) {
+  uint64_t vlmax = vtype_vlmax(vtype);
+  if (vlmax == 0) {
+    state->vtype = VTYPE_VILL;
+    state->vl = 0;
+  } else {
+    state->vtype = vtype;
+    state->vl = MIN(avl, vlmax);
+  }
+  state->gp_regs[inst->rd] = state->vl;
+}
+
+// rs1 = x0 asks for vlmax, or keeps vl when rd is x0 too
+static uint64_t vec_avl(state_t *state, inst_t *inst) {
+  if (inst->rs1 != zero)
+    return state->gp_regs[inst->rs1];
+  return inst->rd != zero ? UINT64_MAX : state->vl;
+}
+
+static void func_vsetvli(state_t *state, inst_t *inst) {
+  vec_setvl(state, inst, vec_avl(state, inst), inst->imm);
+}
+
+static void func_vsetivli(state_t *state, inst_t *inst) {
+  vec_setvl(state, inst, inst->rs1, inst->imm);
+}
+
+static void func_vsetvl(state_t *state, inst_t *inst) {
+  vec_setvl(state, inst, vec_avl(state, inst), state->gp_regs[inst->rs2]);
+}
+
 typedef void(func_t)(state_t *, inst_t *);
 
 static func_t *funcs[] = {
     func_lb,      func_lh,       func_lw,       func_ld,    func_lbu,
     func_lhu,     func_lwu,
 
-    func_empty,   func_empty,
+    func_fence,   func_empty,
 
     func_addi,    func_slli,     func_slti,     func_sltiu, func_xori,
     func_srli,    func_srai,     func_ori,      func_andi,  func_auipc,
@@ -328,7 +803,7 @@ static func_t *funcs[] = {
 
     func_jalr,    func_jal,      func_ecall,    func_empty,
 
-    func_empty,   func_empty,    func_empty,    func_empty, func_empty,
+    func_csrrc,   func_csrrci,   func_csrrs,    func_csrrsi, func_empty,
     func_empty,
 
     func_flw,     func_fsw,
@@ -367,6 +842,44 @@ static func_t *funcs[] = {
     func_empty,   func_empty,
 
     func_empty,   func_empty,    func_empty,    func_empty,
+
+    func_lr_w,    func_sc_w,     func_amoswap_w, func_amoadd_w, func_amoxor_w,
+    func_amoand_w, func_amoor_w, func_amomin_w, func_amomax_w, func_amominu_w,
+    func_amomaxu_w,
+
+    func_lr_d,    func_sc_d,     func_amoswap_d, func_amoadd_d, func_amoxor_d,
+    func_amoand_d, func_amoor_d, func_amomin_d, func_amomax_d, func_amominu_d,
+    func_amomaxu_d,
+
+    func_vsetvli, func_vsetivli, func_vsetvl, func_vle8_v,
+    func_vle16_v, func_vle32_v, func_vle64_v, func_vse8_v,
+    func_vse16_v, func_vse32_v, func_vse64_v,
+
+    func_vadd_vv, func_vadd_vx, func_vadd_vi, func_vsub_vv,
+    func_vsub_vx, func_vrsub_vx, func_vrsub_vi, func_vand_vv,
+    func_vand_vx, func_vand_vi, func_vor_vv, func_vor_vx,
+    func_vor_vi, func_vxor_vv, func_vxor_vx, func_vxor_vi,
+    func_vminu_vv, func_vminu_vx, func_vmin_vv, func_vmin_vx,
+    func_vmaxu_vv, func_vmaxu_vx, func_vmax_vv, func_vmax_vx,
+    func_vmul_vv, func_vmul_vx, func_vmv_v_v, func_vmv_v_x,
+    func_vmv_v_i, func_vredsum_vs, func_vmv_x_s, func_vmv_s_x,
+
+    func_vfadd_vv, func_vfadd_vf, func_vfsub_vv, func_vfsub_vf,
+    func_vfmul_vv, func_vfmul_vf, func_vfdiv_vv, func_vfdiv_vf,
+    func_vfmacc_vv, func_vfmacc_vf, func_vfmv_v_f, func_vfredusum_vs,
+    func_vfredosum_vs, func_vfmv_f_s, func_vfmv_s_f,
+
+    func_add_uw,  func_sh1add,   func_sh2add,   func_sh3add,   func_sh1add_uw,
+    func_sh2add_uw, func_sh3add_uw, func_slli_uw,
+
+    func_andn,    func_orn,      func_xnor,     func_clz,      func_clzw,
+    func_ctz,     func_ctzw,     func_cpop,     func_cpopw,    func_max,
+    func_maxu,    func_min,      func_minu,     func_sext_b,   func_sext_h,
+    func_zext_h,  func_rol,      func_rolw,     func_ror,      func_rori,
+    func_roriw,   func_rorw,     func_orc_b,    func_rev8,
+
+    func_bclr,    func_bclri,    func_bext,     func_bexti,    func_binv,
+    func_binvi,   func_bset,     func_bseti,
 };
 
 /**
@@ -375,7 +888,7 @@ static func_t *funcs[] = {
  * @param state
  */
 void exec_block_interp(state_t *state) {
-  static inst_t inst = {0};
+  inst_t inst = {0};
 
   while (true) {
     IFDEF(CONFIG_DEBUG, printf("pc: %lx\n", state->pc));
@@ -385,6 +898,9 @@ void exec_block_interp(state_t *state) {
     IFDEF(CONFIG_DEBUG, fprintf(stderr, "inst: %s\n", inst_name[inst.type]));
 
     IFDEF(CONFIG_DEBUG, printf("%s\n", inst_name[inst.type]));
+    // counted before it runs, a counter csr read sees the same instret as
+    // in JIT code
+    state->icount++;
     funcs[inst.type](state, &inst);
     state->gp_regs[zero] = 0;
 
@@ -0,0 +1,674 @@
+/**
+ * @file ir.c
+ * @brief build and optimize the IR of a JIT block, see ir.h
+ */
+
+#include "ir.h"
+
+#define IR_MEM_MAX 32
+
+void ir_reset(ir_t *ir) {
+  ir->len = 0;
+  ir->insts = 0;
+}
+
+static int32_t ir_node(ir_t *ir, ir_op_t op, int32_t a, int32_t b,
+                       uint64_t imm) {
+  if (ir->len == ir->cap) {
+    ir->cap = ir->cap ? ir->cap * 2 : 256;
+    ir->nodes = (ir_node_t *)realloc(ir->nodes, ir->cap * sizeof(ir_node_t));
+    Assert(ir->nodes != NULL, "ir nodes: %s", strerror(errno));
+  }
+  ir->nodes[ir->len] = (ir_node_t){
+      .op = op, .a = a, .b = b, .imm = imm, .insts = ir->insts};
+  return ir->len++;
+}
+
+static int32_t ir_const(ir_t *ir, uint64_t val) {
+  return ir_node(ir, IR_CONST, -1, -1, val);
+}
+
+static int32_t ir_get(ir_t *ir, int reg) {
+  if (reg == zero)
+    return ir_const(ir, 0);
+  return ir_node(ir, IR_GETREG, -1, -1, reg);
+}
+
+static void ir_set(ir_t *ir, int reg, int32_t val) {
+  if (reg != zero)
+    ir_node(ir, IR_SETREG, val, -1, reg);
+}
+
+static int32_t ir_ext(ir_t *ir, ir_op_t op, int32_t val, uint8_t size) {
+  int32_t v = ir_node(ir, op, val, -1, 0);
+  ir->nodes[v].size = size;
+  return v;
+}
+
+static int32_t ir_op(ir_t *ir, ir_op_t op, int32_t a, int32_t b) {
+  return ir_node(ir, op, a, b, 0);
+}
+
+static int32_t ir_load(ir_t *ir, inst_t *inst, uint8_t size, bool sign) {
+  int32_t addr =
+      ir_op(ir, IR_ADD, ir_get(ir, inst->rs1), ir_const(ir, inst->imm));
+  int32_t v = ir_node(ir, IR_LOAD, addr, -1, 0);
+  ir->nodes[v].size = size;
+  ir->nodes[v].sign = sign;
+  return v;
+}
+
+static void ir_store(ir_t *ir, inst_t *inst, uint8_t size) {
+  int32_t addr =
+      ir_op(ir, IR_ADD, ir_get(ir, inst->rs1), ir_const(ir, inst->imm));
+  int32_t v = ir_node(ir, IR_STORE, addr, ir_get(ir, inst->rs2), 0);
+  ir->nodes[v].size = size;
+}
+
+static void ir_branch(ir_t *ir, inst_t *inst, uint64_t pc, ir_cond_t cond) {
+  int32_t v = ir_node(ir, IR_BRANCH, ir_get(ir, inst->rs1),
+                      ir_get(ir, inst->rs2), pc + (int64_t)inst->imm);
+  ir->nodes[v].cond = cond;
+}
+
+// a op imm, a op b with b masked to the shift width, and their w forms
+#define ALUI(op) ir_op(ir, op, rs1, ir_const(ir, imm))
+#define SHIFTI(op, mask) ir_op(ir, op, rs1, ir_const(ir, imm & (mask)))
+#define ALU(op) ir_op(ir, op, rs1, rs2)
+#define SHIFT(op, mask)                                                        \
+  ir_op(ir, op, rs1, ir_op(ir, IR_AND, rs2, ir_const(ir, mask)))
+#define SEXTW(v) ir_ext(ir, IR_SEXT, (v), 4)
+#define ZEXTW(v) ir_ext(ir, IR_ZEXT, (v), 4)
+
+/**
+ * @brief append the nodes of inst
+ *
+ * @param ir
+ * @param inst
+ * @param pc
+ * @return false if the IR does not model inst, nothing was appended
+ */
+bool ir_add_inst(ir_t *ir, inst_t *inst, uint64_t pc) {
+  uint64_t imm = (int64_t)inst->imm;
+  uint64_t next = pc + (inst->rvc ? 2 : 4);
+  int32_t rs1 = -1, rs2 = -1, rd = -1;
+
+  ir->insts++;
+  switch (inst->type) {
+  case inst_lb:
+    rd = ir_load(ir, inst, 1, true);
+    break;
+  case inst_lh:
+    rd = ir_load(ir, inst, 2, true);
+    break;
+  case inst_lw:
+    rd = ir_load(ir, inst, 4, true);
+    break;
+  case inst_ld:
+    rd = ir_load(ir, inst, 8, true);
+    break;
+  case inst_lbu:
+    rd = ir_load(ir, inst, 1, false);
+    break;
+  case inst_lhu:
+    rd = ir_load(ir, inst, 2, false);
+    break;
+  case inst_lwu:
+    rd = ir_load(ir, inst, 4, false);
+    break;
+  case inst_sb:
+    ir_store(ir, inst, 1);
+    return true;
+  case inst_sh:
+    ir_store(ir, inst, 2);
+    return true;
+  case inst_sw:
+    ir_store(ir, inst, 4);
+    return true;
+  case inst_sd:
+    ir_store(ir, inst, 8);
+    return true;
+  case inst_lui:
+    rd = ir_const(ir, imm);
+    break;
+  case inst_auipc:
+    rd = ir_const(ir, pc + imm);
+    break;
+
+  case inst_addi:
+  case inst_slli:
+  case inst_slti:
+  case inst_sltiu:
+  case inst_xori:
+  case inst_srli:
+  case inst_srai:
+  case inst_ori:
+  case inst_andi:
+  case inst_addiw:
+  case inst_slliw:
+  case inst_srliw:
+  case inst_sraiw:
+    rs1 = ir_get(ir, inst->rs1);
+    switch (inst->type) {
+    case inst_addi:
+      rd = ALUI(IR_ADD);
+      break;
+    case inst_slli:
+      rd = SHIFTI(IR_SHL, 0x3f);
+      break;
+    case inst_slti:
+      rd = ALUI(IR_SLT);
+      break;
+    case inst_sltiu:
+      rd = ALUI(IR_SLTU);
+      break;
+    case inst_xori:
+      rd = ALUI(IR_XOR);
+      break;
+    case inst_srli:
+      rd = SHIFTI(IR_SHR, 0x3f);
+      break;
+    case inst_srai:
+      rd = SHIFTI(IR_SAR, 0x3f);
+      break;
+    case inst_ori:
+      rd = ALUI(IR_OR);
+      break;
+    case inst_andi:
+      rd = ALUI(IR_AND);
+      break;
+    case inst_addiw:
+      rd = SEXTW(ALUI(IR_ADD));
+      break;
+    case inst_slliw:
+      rd = SEXTW(SHIFTI(IR_SHL, 0x1f));
+      break;
+    case inst_srliw:
+      rs1 = ZEXTW(rs1);
+      rd = SEXTW(SHIFTI(IR_SHR, 0x1f));
+      break;
+    case inst_sraiw:
+      rs1 = SEXTW(rs1);
+      rd = SEXTW(SHIFTI(IR_SAR, 0x1f));
+      break;
+    default:
+      unreachable();
+    }
+    break;
+
+  case inst_add:
+  case inst_sub:
+  case inst_sll:
+  case inst_slt:
+  case inst_sltu:
+  case inst_xor:
+  case inst_srl:
+  case inst_sra:
+  case inst_or:
+  case inst_and:
+  case inst_mul:
+  case inst_addw:
+  case inst_subw:
+  case inst_sllw:
+  case inst_srlw:
+  case inst_sraw:
+  case inst_mulw:
+    rs1 = ir_get(ir, inst->rs1);
+    rs2 = ir_get(ir, inst->rs2);
+    switch (inst->type) {
+    case inst_add:
+      rd = ALU(IR_ADD);
+      break;
+    case inst_sub:
+      rd = ALU(IR_SUB);
+      break;
+    case inst_sll:
+      rd = SHIFT(IR_SHL, 0x3f);
+      break;
+    case inst_slt:
+      rd = ALU(IR_SLT);
+      break;
+    case inst_sltu:
+      rd = ALU(IR_SLTU);
+      break;
+    case inst_xor:
+      rd = ALU(IR_XOR);
+      break;
+    case inst_srl:
+      rd = SHIFT(IR_SHR, 0x3f);
+      break;
+    case inst_sra:
+      rd = SHIFT(IR_SAR, 0x3f);
+      break;
+    case inst_or:
+      rd = ALU(IR_OR);
+      break;
+    case inst_and:
+      rd = ALU(IR_AND);
+      break;
+    case inst_mul:
+      rd = ALU(IR_MUL);
+      break;
+    case inst_addw:
+      rd = SEXTW(ALU(IR_ADD));
+      break;
+    case inst_subw:
+      rd = SEXTW(ALU(IR_SUB));
+      break;
+    case inst_sllw:
+      rd = SEXTW(SHIFT(IR_SHL, 0x1f));
+      break;
+    case inst_srlw:
+      rs1 = ZEXTW(rs1);
+      rd = SEXTW(SHIFT(IR_SHR, 0x1f));
+      break;
+    case inst_sraw:
+      rs1 = SEXTW(rs1);
+      rd = SEXTW(SHIFT(IR_SAR, 0x1f));
+      break;
+    case inst_mulw:
+      rd = SEXTW(ALU(IR_MUL));
+      break;
+    default:
+      unreachable();
+    }
+    break;
+
+  case inst_beq:
+    ir_branch(ir, inst, pc, IR_EQ);
+    return true;
+  case inst_bne:
+    ir_branch(ir, inst, pc, IR_NE);
+    return true;
+  case inst_blt:
+    ir_branch(ir, inst, pc, IR_LT);
+    return true;
+  case inst_bge:
+    ir_branch(ir, inst, pc, IR_GE);
+    return true;
+  case inst_bltu:
+    ir_branch(ir, inst, pc, IR_LTU);
+    return true;
+  case inst_bgeu:
+    ir_branch(ir, inst, pc, IR_GEU);
+    return true;
+
+  case inst_jal:
+    ir_set(ir, inst->rd, ir_const(ir, next));
+    ir_node(ir, IR_GOTO, -1, -1, pc + imm);
+    return true;
+  case inst_jalr:
+    // the target is read before rd is written, rd may be rs1
+    rs1 = ir_op(ir, IR_ADD, ir_get(ir, inst->rs1), ir_const(ir, imm));
+    rs1 = ir_op(ir, IR_AND, rs1, ir_const(ir, ~(uint64_t)1));
+    ir_set(ir, inst->rd, ir_const(ir, next));
+    ir_node(ir, IR_EXIT, rs1, -1, 0);
+    return true;
+
+  default:
+    ir->insts--;
+    return false;
+  }
+
+  ir_set(ir, inst->rd, rd);
+  return true;
+}
+
+void ir_add_legacy(ir_t *ir, inst_t *inst, uint64_t pc) {
+  ir->insts++;
+  int32_t v = ir_node(ir, IR_LEGACY, -1, -1, pc);
+  ir->nodes[v].inst = *inst;
+}
+
+void ir_add_goto(ir_t *ir, uint64_t pc) { ir_node(ir, IR_GOTO, -1, -1, pc); }
+
+static int32_t ir_root(ir_t *ir, int32_t v) {
+  while (v >= 0 && ir->nodes[v].op == IR_COPY)
+    v = ir->nodes[v].a;
+  return v;
+}
+
+static bool ir_is_const(ir_t *ir, int32_t v, uint64_t *val) {
+  if (v < 0 || ir->nodes[v].op != IR_CONST)
+    return false;
+  *val = ir->nodes[v].imm;
+  return true;
+}
+
+static uint64_t ir_extend(uint64_t val, uint8_t size, bool sign) {
+  if (size == 8)
+    return val;
+  int shift = 64 - size * 8;
+  return sign ? (uint64_t)((int64_t)(val << shift) >> shift)
+              : val << shift >> shift;
+}
+
+static uint64_t ir_eval(ir_node_t *n, uint64_t a, uint64_t b) {
+  switch (n->op) {
+  case IR_ADD:
+    return a + b;
+  case IR_SUB:
+    return a - b;
+  case IR_AND:
+    return a & b;
+  case IR_OR:
+    return a | b;
+  case IR_XOR:
+    return a ^ b;
+  case IR_SHL:
+    return a << (b & 0x3f);
+  case IR_SHR:
+    return a >> (b & 0x3f);
+  case IR_SAR:
+    return (int64_t)a >> (b & 0x3f);
+  case IR_MUL:
+    return a * b;
+  case IR_SLT:
+    return (int64_t)a < (int64_t)b;
+  case IR_SLTU:
+    return a < b;
+  case IR_SEXT:
+    return ir_extend(a, n->size, true);
+  case IR_ZEXT:
+    return ir_extend(a, n->size, false);
+  default:
+    unreachable();
+  }
+}
+
+static bool ir_taken(ir_cond_t cond, uint64_t a, uint64_t b) {
+  switch (cond) {
+  case IR_EQ:
+    return a == b;
+  case IR_NE:
+    return a != b;
+  case IR_LT:
+    return (int64_t)a < (int64_t)b;
+  case IR_GE:
+    return (int64_t)a >= (int64_t)b;
+  case IR_LTU:
+    return a < b;
+  case IR_GEU:
+    return a >= b;
+  }
+  unreachable();
+}
+
+static void ir_copy(ir_node_t *n, int32_t v) {
+  n->op = IR_COPY;
+  n->a = v;
+  n->b = -1;
+}
+
+/**
+ * @brief constant propagation and copy propagation
+ *
+ * operands skip copies, nodes of constants become constants, x + 0 and
+ * friends become copies, and a branch with a known outcome becomes a goto
+ * or goes away.
+ *
+ * @param ir
+ */
+static void ir_fold(ir_t *ir) {
+  for (uint32_t i = 0; i < ir->len; i++) {
+    ir_node_t *n = &ir->nodes[i];
+    n->a = ir_root(ir, n->a);
+    n->b = ir_root(ir, n->b);
+
+    uint64_t a = 0, b = 0;
+    bool ca = ir_is_const(ir, n->a, &a);
+    bool cb = ir_is_const(ir, n->b, &b);
+    switch (n->op) {
+    case IR_SEXT:
+    case IR_ZEXT:
+      if (ca) {
+        n->imm = ir_eval(n, a, 0);
+        n->op = IR_CONST;
+        n->a = -1;
+      } else if (n->size == 8) {
+        ir_copy(n, n->a);
+      }
+      break;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_AND:
+    case IR_OR:
+    case IR_XOR:
+    case IR_SHL:
+    case IR_SHR:
+    case IR_SAR:
+    case IR_MUL:
+    case IR_SLT:
+    case IR_SLTU:
+      if (ca && cb) {
+        n->imm = ir_eval(n, a, b);
+        n->op = IR_CONST;
+        n->a = n->b = -1;
+      } else if (cb && b == 0 && n->op != IR_AND && n->op != IR_MUL &&
+                 n->op != IR_SLT && n->op != IR_SLTU) {
+        ir_copy(n, n->a);
+      } else if (ca && a == 0 && (n->op == IR_ADD || n->op == IR_OR ||
+                                  n->op == IR_XOR)) {
+        ir_copy(n, n->b);
+      } else if (cb && b == ~0ULL && n->op == IR_AND) {
+        ir_copy(n, n->a);
+      } else if (cb && b == 1 && n->op == IR_MUL) {
+        ir_copy(n, n->a);
+      }
+      break;
+    case IR_BRANCH:
+      if (!ca || !cb)
+        break;
+      if (!ir_taken(n->cond, a, b)) {
+        n->op = IR_NOP;
+        break;
+      }
+      n->op = IR_GOTO;
+      n->a = n->b = -1;
+      for (uint32_t j = i + 1; j < ir->len; j++)
+        ir->nodes[j].op = IR_NOP;
+      return;
+    default:
+      break;
+    }
+  }
+}
+
+/**
+ * @brief forward the guest registers through the segment
+ *
+ * a GETREG of a register set or read before becomes a copy of that value.
+ * LEGACY code may touch any register, it forgets them all.
+ *
+ * @param ir
+ */
+static void ir_forward_regs(ir_t *ir) {
+  int32_t known[num_gp_regs];
+  memset(known, -1, sizeof(known));
+
+  for (uint32_t i = 0; i < ir->len; i++) {
+    ir_node_t *n = &ir->nodes[i];
+    switch (n->op) {
+    case IR_GETREG:
+      if (known[n->imm] >= 0)
+        ir_copy(n, known[n->imm]);
+      else
+        known[n->imm] = i;
+      break;
+    case IR_SETREG:
+      known[n->imm] = n->a;
+      break;
+    case IR_LEGACY:
+      memset(known, -1, sizeof(known));
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+typedef struct {
+  int32_t base; // -1 for an absolute address
+  uint64_t off;
+  uint8_t size;
+  bool sign;
+  bool store;
+  int32_t val; // the stored value or the load
+} ir_mem_t;
+
+// an address as base + constant offset
+static void ir_addr(ir_t *ir, int32_t v, int32_t *base, uint64_t *off) {
+  ir_node_t *n = &ir->nodes[v];
+  uint64_t c;
+  if (n->op == IR_CONST) {
+    *base = -1;
+    *off = n->imm;
+  } else if (n->op == IR_ADD && ir_is_const(ir, n->b, &c)) {
+    *base = n->a;
+    *off = c;
+  } else {
+    *base = v;
+    *off = 0;
+  }
+}
+
+/**
+ * @brief redundant load elimination on guest memory
+ *
+ * a load of what the segment stored or loaded before, with nothing in
+ * between that may have written it, becomes that value. stores through
+ * another base may alias, so they forget everything but the disjoint
+ * ranges of their own base.
+ *
+ * @param ir
+ */
+static void ir_forward_mem(ir_t *ir) {
+  ir_mem_t mems[IR_MEM_MAX];
+  int nmems = 0;
+
+  for (uint32_t i = 0; i < ir->len; i++) {
+    ir_node_t *n = &ir->nodes[i];
+    if (n->op == IR_LEGACY) {
+      nmems = 0;
+      continue;
+    }
+    if (n->op != IR_LOAD && n->op != IR_STORE)
+      continue;
+
+    int32_t base;
+    uint64_t off;
+    ir_addr(ir, n->a, &base, &off);
+
+    if (n->op == IR_LOAD) {
+      int k;
+      for (k = nmems - 1; k >= 0; k--)
+        if (mems[k].base == base && mems[k].off == off &&
+            mems[k].size == n->size)
+          break;
+      if (k >= 0) {
+        ir_mem_t *m = &mems[k];
+        if (n->size == 8 || (!m->store && m->sign == n->sign)) {
+          ir_copy(n, m->val);
+        } else {
+          n->op = n->sign ? IR_SEXT : IR_ZEXT;
+          n->a = m->val;
+          n->b = -1;
+        }
+        continue;
+      }
+      if (nmems == IR_MEM_MAX)
+        nmems = 0;
+      mems[nmems++] = (ir_mem_t){.base = base,
+                                 .off = off,
+                                 .size = n->size,
+                                 .sign = n->sign,
+                                 .val = i};
+      continue;
+    }
+
+    int kept = 0;
+    for (int k = 0; k < nmems; k++) {
+      ir_mem_t *m = &mems[k];
+      if (m->base == base &&
+          (m->off + m->size <= off || off + n->size <= m->off))
+        mems[kept++] = *m;
+    }
+    nmems = kept;
+    if (nmems == IR_MEM_MAX)
+      nmems = 0;
+    mems[nmems++] = (ir_mem_t){
+        .base = base, .off = off, .size = n->size, .store = true, .val = n->b};
+  }
+}
+
+static bool ir_has_effect(ir_op_t op) {
+  return op == IR_SETREG || op == IR_STORE || op == IR_BRANCH ||
+         op == IR_GOTO || op == IR_EXIT || op == IR_LEGACY;
+}
+
+/**
+ * @brief dead store elimination on the registers and dead code elimination
+ *
+ * a SETREG is dead when the register is set again before anything can see
+ * it: a GETREG, a side exit or LEGACY code. nodes whose value nobody uses
+ * go away, loads included.
+ *
+ * @param ir
+ */
+static void ir_dce(ir_t *ir) {
+  static bool *live;
+  static uint32_t live_cap;
+  if (live_cap < ir->len) {
+    live_cap = ir->cap;
+    live = (bool *)realloc(live, live_cap);
+  }
+  memset(live, 0, ir->len);
+
+  bool overwritten[num_gp_regs] = {0};
+  for (int64_t i = (int64_t)ir->len - 1; i >= 0; i--) {
+    ir_node_t *n = &ir->nodes[i];
+    switch (n->op) {
+    case IR_SETREG:
+      if (overwritten[n->imm])
+        n->op = IR_NOP;
+      overwritten[n->imm] = true;
+      break;
+    case IR_GETREG:
+      if (live[i])
+        overwritten[n->imm] = false;
+      break;
+    case IR_BRANCH:
+    case IR_GOTO:
+    case IR_EXIT:
+    case IR_LEGACY:
+      memset(overwritten, 0, sizeof(overwritten));
+      break;
+    default:
+      break;
+    }
+
+    if (n->op == IR_NOP)
+      continue;
+    if (!live[i] && !ir_has_effect(n->op)) {
+      n->op = IR_NOP;
+      continue;
+    }
+    if (n->a >= 0)
+      live[n->a] = true;
+    if (n->b >= 0)
+      live[n->b] = true;
+  }
+}
+
+/**
+ * @brief run the passes, cheap enough to always run
+ *
+ * @param ir
+ */
+void ir_optimize(ir_t *ir) {
+  ir_forward_regs(ir);
+  ir_fold(ir);
+  ir_forward_mem(ir);
+  ir_fold(ir);
+  ir_dce(ir);
+}
@@ -0,0 +1,177 @@
+/**
+ * @file librvemu.c
+ * @brief the embedding API of include/librvemu.h
+ */
+
+#include "librvemu.h"
+#include "mmu.h"
+#include "rvemu.h"
+
+struct rvemu {
+  machine_t machine;
+  mmu_t mmu;
+  rvemu_syscall_t syscall;
+  void *syscall_data;
+};
+
+// guest memory sits at GUEST_MEMORY_OFFSET, there is room for one guest
+static rvemu_t *current;
+
+rvemu_t *rvemu_create(void) {
+  if (__atomic_exchange_n(&current, (rvemu_t *)1, __ATOMIC_ACQ_REL) != NULL)
+    return NULL;
+
+  rvemu_t *emu = (rvemu_t *)calloc(1, sizeof(rvemu_t));
+  emu->machine.mmu = &emu->mmu;
+  emu->machine.cache = new_cache();
+  emu->machine.single_hart = true;
+  __atomic_store_n(&current, emu, __ATOMIC_RELEASE);
+  return emu;
+}
+
+void rvemu_destroy(rvemu_t *emu) {
+  mmu_t *mmu = &emu->mmu;
+  for (size_t i = 0; i < mmu->nregions; i++)
+    munmap((void *)GUEST_TO_HOST(mmu->regions[i].addr), mmu->regions[i].len);
+  if (mmu->host_alloc < mmu->heap_end)
+    munmap((void *)mmu->host_alloc, mmu->heap_end - mmu->host_alloc);
+  free(mmu->regions);
+  if (mmu->symtab)
+    symtab_free(mmu->symtab);
+  cache_free(emu->machine.cache);
+  free(emu);
+  __atomic_store_n(&current, NULL, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief whether fd is a riscv64 ELF that mmu_load_elf takes, it asserts
+ * on anything else and would abort the embedding process
+ *
+ * @param fd
+ * @return
+ */
+static bool rvemu_elf_ok(int fd) {
+  struct stat st;
+  elf64_ehdr_t ehdr;
+  if (fstat(fd, &st) != 0 ||
+      pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr))
+    return false;
+  if (memcmp(ehdr.e_ident, ELFMAG, 4) != 0 ||
+      ehdr.e_ident[EI_CLASS] != ELFCLASS64 || ehdr.e_machine != EM_RISCV ||
+      ehdr.e_phentsize != sizeof(elf64_phdr_t) ||
+      ehdr.e_phoff + (uint64_t)ehdr.e_phnum * sizeof(elf64_phdr_t) >
+          (uint64_t)st.st_size)
+    return false;
+
+  for (size_t i = 0; i < ehdr.e_phnum; i++) {
+    elf64_phdr_t phdr;
+    if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr)) !=
+        sizeof(phdr))
+      return false;
+    if (phdr.p_type == PT_LOAD &&
+        (phdr.p_filesz > phdr.p_memsz ||
+         phdr.p_offset + phdr.p_filesz > (uint64_t)st.st_size))
+      return false;
+  }
+  return true;
+}
+
+int rvemu_load(rvemu_t *emu, const char *path, int argc, char *argv[]) {
+  if (emu->mmu.entry != 0)
+    return -EBUSY;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -errno;
+  bool ok = rvemu_elf_ok(fd);
+  close(fd);
+  if (!ok)
+    return -ENOEXEC;
+
+  // machine_setup skips argv[0], the rvemu binary in the command line
+  char **args = (char **)calloc(argc + 2, sizeof(char *));
+  args[0] = "librvemu";
+  memcpy(args + 1, argv, argc * sizeof(char *));
+
+  machine_load_program(&emu->machine, path);
+  machine_setup(&emu->machine, argc + 1, args);
+  free(args);
+  return 0;
+}
+
+enum rvemu_status rvemu_run(rvemu_t *emu, uint64_t insts) {
+  return machine_run_for(&emu->machine, insts) ? RVEMU_EXITED : RVEMU_LIMIT;
+}
+
+int rvemu_exit_code(rvemu_t *emu) { return emu->machine.exit_code; }
+
+uint64_t rvemu_insts(rvemu_t *emu) { return emu->machine.state.icount; }
+
+uint64_t rvemu_get_reg(rvemu_t *emu, int reg) {
+  return machine_get_gp_reg(&emu->machine, reg);
+}
+
+void rvemu_set_reg(rvemu_t *emu, int reg, uint64_t val) {
+  if (reg != zero)
+    machine_set_gp_reg(&emu->machine, reg, val);
+}
+
+uint64_t rvemu_get_pc(rvemu_t *emu) { return emu->machine.state.pc; }
+
+void rvemu_set_pc(rvemu_t *emu, uint64_t pc) { emu->machine.state.pc = pc; }
+
+/**
+ * @brief whether [addr, addr + len) is covered by regions allowing prot
+ *
+ * @param mmu
+ * @param addr
+ * @param len
+ * @param prot
+ * @return
+ */
+static bool rvemu_mapped(mmu_t *mmu, uint64_t addr, size_t len, int prot) {
+  uint64_t end = addr + len;
+  if (end < addr)
+    return false;
+
+  while (addr < end) {
+    size_t i;
+    for (i = 0; i < mmu->nregions; i++) {
+      mmu_region_t *r = &mmu->regions[i];
+      if (addr >= r->addr && addr < r->addr + r->len &&
+          (r->prot & prot) == prot)
+        break;
+    }
+    if (i == mmu->nregions)
+      return false;
+    addr = mmu->regions[i].addr + mmu->regions[i].len;
+  }
+  return true;
+}
+
+int rvemu_read_mem(rvemu_t *emu, uint64_t addr, void *buf, size_t len) {
+  if (!rvemu_mapped(&emu->mmu, addr, len, PROT_READ))
+    return -EFAULT;
+  memcpy(buf, (void *)GUEST_TO_HOST(addr), len);
+  return 0;
+}
+
+int rvemu_write_mem(rvemu_t *emu, uint64_t addr, const void *buf,
+                    size_t len) {
+  if (!rvemu_mapped(&emu->mmu, addr, len, PROT_WRITE))
+    return -EFAULT;
+  mmu_write(addr, (uint8_t *)buf, len);
+  return 0;
+}
+
+static bool rvemu_syscall_hook(machine_t *m, uint64_t nr, uint64_t *ret,
+                               void *data) {
+  rvemu_t *emu = (rvemu_t *)data;
+  return emu->syscall(emu, nr, ret, emu->syscall_data);
+}
+
+void rvemu_set_syscall(rvemu_t *emu, rvemu_syscall_t f, void *data) {
+  emu->syscall = f;
+  emu->syscall_data = data;
+  emu->machine.syscall_hook = f ? rvemu_syscall_hook : NULL;
+  emu->machine.syscall_hook_data = emu;
+}
@@ -6,12 +6,40 @@
 #include "interp.h"
 #include "mmu.h"
 #include "rvemu.h"
+#include <pthread.h>
+
+// codegen and the compiler pipe keep static state, harts compile one by one
+static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief run one block, accounting it to the interpreter or the JIT
+ *
+ * @param m
+ * @param code
+ */
+static void exec_block_stats(machine_t *m, uint8_t *code) {
+  uint64_t icount = m->state.icount;
+  uint64_t start = stats_now();
+  ((exec_block_func_t)code)(&m->state);
+  uint64_t ns = stats_now() - start;
+  icount = m->state.icount - icount;
+
+  if (code == (uint8_t *)exec_block_interp) {
+    STATS_ADD(m->stats, interp_insts, icount);
+    STATS_ADD(m->stats, interp_blocks, 1);
+    STATS_ADD(m->stats, interp_ns, ns);
+  } else {
+    STATS_ADD(m->stats, jit_insts, icount);
+    STATS_ADD(m->stats, jit_blocks, 1);
+    STATS_ADD(m->stats, jit_ns, ns);
+  }
+}
 
 /**
  * @brief exec a program block every step
  *
  * @param m
- * @return
+ * @return ecall, or none once m->insts_limit instructions have retired
  */
 enum exit_reason_t machine_step(machine_t *m) {
   while (true) {
@@ -22,8 +50,25 @@ enum exit_reason_t machine_step(machine_t *m) {
     if (code == NULL) {
       hot = cache_hot(m->cache, m->state.pc);
       if (hot) {
-        str_t source = machine_genblock(m);
-        code = machine_compile(m, source);
+        pthread_mutex_lock(&compile_lock);
+        // another hart may have compiled the block while we waited
+        code = cache_lookup(m->cache, m->state.pc);
+        if (code == NULL) {
+          uint64_t start = m->stats ? stats_now() : 0;
+          // warm blocks ride along, one compiler run for the batch
+          uint64_t pcs[1 + CACHE_BATCH] = {m->state.pc};
+          int n = 1 + cache_take_pending(m->cache, pcs + 1, CACHE_BATCH);
+          for (int i = 1; i < n; i++)
+            if (pcs[i] == m->state.pc)
+              pcs[i--] = pcs[--n];
+          str_t source = machine_genblock(m, pcs, n);
+          code = machine_compile(m, source);
+          if (m->stats) {
+            STATS_ADD(m->stats, compile_ns, stats_now() - start);
+            STATS_ADD(m->stats, compiles, 1);
+          }
+        }
+        pthread_mutex_unlock(&compile_lock);
       }
     }
 
@@ -33,16 +78,33 @@ enum exit_reason_t machine_step(machine_t *m) {
 
     while (true) {
       m->state.exit_reason = none;
-      ((exec_block_func_t)code)(&m->state);
+      uint64_t pc = m->state.pc;
+      uint64_t icount = m->state.icount;
+      if (m->stats)
+        exec_block_stats(m, code);
+      else
+        ((exec_block_func_t)code)(&m->state);
+      if (m->trace)
+        trace_block(m->trace, pc, m->state.icount - icount);
       Assert(m->state.exit_reason != none,
              "exec block interp exit reason is None");
 
+      // the budget is checked between blocks, it may be overshot by one
+      if (m->insts_limit != 0 && m->state.icount >= m->insts_limit &&
+          m->state.exit_reason != ecall) {
+        m->state.pc = m->state.reenter_pc;
+        return none;
+      }
+
       if (m->state.exit_reason == indirect_branch ||
           m->state.exit_reason == direct_branch) {
         // 发现退出的基本块要到达的基本块在cache中, 直接进入 cache 块执行
         code = cache_lookup(m->cache, m->state.reenter_pc);
-        if (code != NULL)
+        if (code != NULL) {
+          // keep pc at the running block for the profiler
+          m->state.pc = m->state.reenter_pc;
           continue;
+        }
       }
 
       if (m->state.exit_reason == interp) {
@@ -69,6 +131,53 @@ enum exit_reason_t machine_step(machine_t *m) {
   }
 }
 
+/**
+ * @brief run the hart, serving its syscalls, until the guest exits or
+ * retires insts more instructions
+ *
+ * @param m
+ * @param insts 0 runs until the guest exits
+ * @return true once the guest exited, m->exit_code holds its status
+ */
+bool machine_run_for(machine_t *m, uint64_t insts) {
+  m->insts_limit = insts ? m->state.icount + insts : 0;
+  // replay and the hook see every syscall. set on each run, a restored
+  // snapshot carries the addresses of another process
+  m->state.fast_ecall =
+      m->replay == NULL && m->syscall_hook == NULL ? syscall_fast : NULL;
+  m->state.csr_read = csr_read;
+
+  while (!m->exited) {
+    enum exit_reason_t reason = machine_step(m);
+    if (reason == none)
+      return false;
+    Assert(reason == ecall, "exit reason is not ecall");
+
+    uint64_t syscall = machine_get_gp_reg(m, a7);
+    uint64_t start = m->stats ? stats_now() : 0;
+    uint64_t ret;
+    if (m->syscall_hook == NULL ||
+        !m->syscall_hook(m, syscall, &ret, m->syscall_hook_data))
+      ret = do_syscall(m, syscall);
+    if (m->stats) {
+      STATS_ADD(m->stats, syscall_ns, stats_now() - start);
+      STATS_ADD(m->stats, syscalls, 1);
+    }
+    machine_set_gp_reg(m, a0, ret);
+  }
+  return true;
+}
+
+/**
+ * @brief run the hart until the guest exits
+ *
+ * @param m
+ */
+void machine_run(machine_t *m) {
+  prof_enter(&m->state);
+  machine_run_for(m, 0);
+}
+
 /**
  * @brief Load prog into machine
  *
@@ -79,15 +188,46 @@ void machine_load_program(machine_t *m, const char *prog) {
   int fd = open(prog, O_RDONLY);
   Assert(fd != -1, "%s", strerror(errno));
 
-  mmu_load_elf(&m->mmu, fd);
+  mmu_load_elf(m->mmu, fd);
   close(fd);
 
-  m->state.pc = (uint64_t)m->mmu.entry;
+  m->state.pc = (uint64_t)m->mmu->entry;
+  m->tid = getpid();
+  m->mmu->nharts = 1;
+  m->mmu->next_tid = 0;
+}
+
+/**
+ * @brief fork the process, the guest memory lives in our address space
+ * and is copied with it
+ *
+ * in the child only the calling hart exists. the io_uring rings would be
+ * shared with the parent and the coalescing timer thread stayed behind,
+ * so the child drops the rings and gets a timer of its own.
+ *
+ * @param m
+ * @return the result of fork
+ */
+pid_t machine_fork(machine_t *m) {
+  if (m->trace)
+    trace_flush(m->trace);
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+
+  m->tid = getpid();
+  m->mmu->nharts = 1;
+  m->uring = NULL;
+  if (m->coalesce)
+    m->coalesce = new_coalesce();
+  if (m->trace)
+    trace_forked(m->trace, m->tid);
+  return 0;
 }
 
 void machine_setup(machine_t *m, int argc, char *argv[]) {
   size_t stack_size = 32 * 1024 * 1024;
-  uint64_t stack = mmu_alloc(&m->mmu, stack_size);
+  uint64_t stack = mmu_alloc(m->mmu, stack_size);
   m->state.gp_regs[sp] = stack + stack_size;
 
   m->state.gp_regs[sp] -= 8; // auxv
@@ -99,7 +239,7 @@ void machine_setup(machine_t *m, int argc, char *argv[]) {
   for (int i = args; i > 0; i--) {
     size_t len = strlen(argv[i]);
 
-    uint64_t addr = mmu_alloc(&m->mmu, len + 1);
+    uint64_t addr = mmu_alloc(m->mmu, len + 1);
     mmu_write(addr, (uint8_t *)argv[i], len);
     m->state.gp_regs[sp] -= 8; // argv[i]
     mmu_write(m->state.gp_regs[sp], (uint8_t *)&addr, sizeof(uint64_t));
@@ -3,7 +3,76 @@
  * @brief
  */
 
+#include "mmu.h"
 #include "rvemu.h"
+#include <pthread.h>
+#include <sys/stat.h>
+
+// brk and mmap may be called by several harts at once
+static pthread_mutex_t mmu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void mmu_region_add(mmu_t *mmu, uint64_t addr, uint64_t len,
+                           int prot) {
+  if (len == 0)
+    return;
+  mmu_region_t *last = mmu->nregions ? &mmu->regions[mmu->nregions - 1] : NULL;
+  if (last && last->addr + last->len == addr && last->prot == prot) {
+    last->len += len; // brk grows the heap a little at a time
+    return;
+  }
+  if (mmu->nregions == mmu->region_cap) {
+    mmu->region_cap = mmu->region_cap ? mmu->region_cap * 2 : 16;
+    mmu->regions = (mmu_region_t *)realloc(
+        mmu->regions, mmu->region_cap * sizeof(mmu_region_t));
+  }
+  mmu->regions[mmu->nregions++] = (mmu_region_t){addr, len, prot};
+}
+
+/**
+ * @brief give the tracked ranges inside [addr, addr + len) a new prot
+ *
+ * @param mmu
+ * @param addr
+ * @param len
+ * @param prot -1 drops the ranges
+ */
+static void mmu_region_split(mmu_t *mmu, uint64_t addr, uint64_t len,
+                             int prot) {
+  mmu_region_t *old = mmu->regions;
+  size_t n = mmu->nregions;
+  uint64_t end = addr + len;
+
+  mmu->regions = NULL;
+  mmu->nregions = mmu->region_cap = 0;
+  for (size_t i = 0; i < n; i++) {
+    mmu_region_t r = old[i];
+    uint64_t r_end = r.addr + r.len;
+    if (r_end <= addr || r.addr >= end) {
+      mmu_region_add(mmu, r.addr, r.len, r.prot);
+      continue;
+    }
+
+    uint64_t lo = MAX(r.addr, addr), hi = MIN(r_end, end);
+    mmu_region_add(mmu, r.addr, lo - r.addr, r.prot);
+    if (prot != -1)
+      mmu_region_add(mmu, lo, hi - lo, prot);
+    mmu_region_add(mmu, hi, r_end - hi, r.prot);
+  }
+  free(old);
+}
+
+/**
+ * @brief track a new mapping, it replaces whatever was mapped there
+ *
+ * @param mmu
+ * @param addr
+ * @param len
+ * @param prot
+ */
+void mmu_region_map(mmu_t *mmu, uint64_t addr, uint64_t len, int prot) {
+  mmu_region_split(mmu, addr, len, -1);
+  mmu_region_add(mmu, addr, len, prot);
+}
 
 /**
  * @brief load program header
@@ -49,6 +118,9 @@ static void mmu_load_segment(mmu_t *mmu, elf64_phdr_t *phdr, int fd) {
                      MAP_PRIVATE | MAP_FIXED, fd, ROUNDDOWN(offset, page_size));
   Assert(addr == aligned_vaddr, "aligned_vaddr is not equal to addr");
 
+  mmu_region_map(mmu, HOST_TO_GUEST(aligned_vaddr), ROUNDUP(memsz, page_size),
+                 prot);
+
   uint64_t remaining_bss =
       ROUNDUP(memsz, page_size) - ROUNDUP(filesz, page_size);
   if (remaining_bss > 0) {
@@ -69,6 +141,27 @@ static void mmu_load_segment(mmu_t *mmu, elf64_phdr_t *phdr, int fd) {
   mmu->base = mmu->alloc = HOST_TO_GUEST(mmu->host_alloc);
 }
 
+/**
+ * @brief reserve the address space of the brk heap, right after the ELF
+ *
+ * PROT_NONE and MAP_NORESERVE, it costs nothing until mmu_alloc commits
+ * it. without the reservation, e.g. when something already lives there,
+ * the heap is mapped piece by piece as before.
+ *
+ * @param mmu
+ */
+static void mmu_heap_reserve(mmu_t *mmu) {
+  mmu->heap_end = mmu->host_alloc;
+  void *p = mmap((void *)mmu->host_alloc, MMU_HEAP_RESERVE, PROT_NONE,
+                 MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE |
+                     MAP_FIXED_NOREPLACE,
+                 -1, 0);
+  if (p == (void *)mmu->host_alloc)
+    mmu->heap_end = mmu->host_alloc + MMU_HEAP_RESERVE;
+  else if (p != MAP_FAILED)
+    munmap(p, MMU_HEAP_RESERVE); // an old kernel took it as a hint
+}
+
 /**
  * @brief mmu load elf
  *
@@ -87,11 +180,17 @@ void mmu_load_elf(mmu_t *mmu, int fd) {
   Assert(*(uint32_t *)(ehdr->e_ident) == *(uint32_t *)ELFMAG,
          "Magic number check failed");
 
-  Assert(ehdr->e_machine == EM_RISCV || ehdr->e_ident[EI_CLASS] == ELFCLASS64,
+  Assert(ehdr->e_machine == EM_RISCV && ehdr->e_ident[EI_CLASS] == ELFCLASS64,
          "only riscv64 elf file is supported");
 
   mmu->entry = (uint64_t)ehdr->e_entry;
 
+  struct stat st;
+  Assert(fstat(fd, &st) == 0, "%s", strerror(errno));
+  mmu->ident = ((uint64_t)st.st_dev << 48) ^ ((uint64_t)st.st_ino << 16) ^
+               (uint64_t)st.st_size ^ ((uint64_t)st.st_mtime << 32);
+  mmu->symtab = symtab_load(fd);
+
   for (size_t i = 0; i < ehdr->e_phnum; i++) {
     elf64_phdr_t phdr;
     load_phdr(&phdr, ehdr, i, file);
@@ -100,16 +199,22 @@ void mmu_load_elf(mmu_t *mmu, int fd) {
       mmu_load_segment(mmu, &phdr, fd);
     }
   }
+  mmu_heap_reserve(mmu);
 }
 
 /**
  * @brief mmu_alloc 申请释放内存
  *
+ * inside the reservation the heap is committed MMU_HEAP_COMMIT at a time
+ * and only given back to the host when more than MMU_HEAP_SLACK is free,
+ * so most brk calls need no host call. memory the guest freed and gets
+ * back is zeroed, as fresh brk memory is.
+ *
  * @param mmu
  * @param size 有符号数, 为负释放内存
  * @return
  */
-uint64_t mmu_alloc(mmu_t *mmu, int64_t size) {
+static uint64_t mmu_alloc_locked(mmu_t *mmu, int64_t size) {
   int page_size = getpagesize();
   uint64_t base = mmu->alloc;
   Assert(base >= mmu->base, "alloc cant be smaller than mmu base");
@@ -117,22 +222,161 @@ uint64_t mmu_alloc(mmu_t *mmu, int64_t size) {
   mmu->alloc += size;
   Assert(mmu->alloc >= mmu->base, "alloc cant be smaller than mmu base");
 
-  if (size > 0 && mmu->alloc > HOST_TO_GUEST(mmu->host_alloc)) {
+  uint64_t committed = HOST_TO_GUEST(mmu->host_alloc);
+  if (size > 0 && mmu->alloc > committed &&
+      GUEST_TO_HOST(mmu->alloc) <= mmu->heap_end) {
+    uint64_t len = MIN(ROUNDUP(mmu->alloc - committed, MMU_HEAP_COMMIT),
+                       mmu->heap_end - mmu->host_alloc);
+    if (mmap((void *)mmu->host_alloc, len, PROT_READ | PROT_WRITE,
+             MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0) == MAP_FAILED)
+      panic("mmap failed");
+    mmu->heap_host_calls++;
+
+    mmu_region_map(mmu, committed, len, PROT_READ | PROT_WRITE);
+    mmu->host_alloc += len;
+  } else if (size > 0 && mmu->alloc > committed) {
     if (mmap((void *)mmu->host_alloc, ROUNDUP(size, page_size),
              PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1,
              0) == MAP_FAILED) {
       panic("mmap failed");
     }
+    mmu->heap_host_calls++;
 
+    mmu_region_map(mmu, committed, ROUNDUP(size, page_size),
+                   PROT_READ | PROT_WRITE);
     mmu->host_alloc += ROUNDUP(size, page_size);
-  } else if (size < 0 &&
-             ROUNDUP(mmu->alloc, page_size) < HOST_TO_GUEST(mmu->host_alloc)) {
-    uint64_t len =
-        HOST_TO_GUEST(mmu->host_alloc) - ROUNDUP(mmu->alloc, page_size);
-    if (munmap((void *)mmu->host_alloc, len) == -1)
+  } else if (size < 0 && mmu->host_alloc <= mmu->heap_end &&
+             committed - ROUNDUP(mmu->alloc, page_size) > MMU_HEAP_SLACK) {
+    // keep one commit chunk, a program that shrinks often grows again
+    uint64_t keep = ROUNDUP(mmu->alloc, page_size) + MMU_HEAP_COMMIT;
+    uint64_t len = committed - keep;
+    mmu->host_alloc -= len;
+    if (mmap((void *)mmu->host_alloc, len, PROT_NONE,
+             MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, -1,
+             0) == MAP_FAILED)
       fatal(strerror(errno));
+    mmu->heap_host_calls++;
+    mmu_region_split(mmu, keep, len, -1);
+  } else if (size < 0 && mmu->host_alloc > mmu->heap_end &&
+             ROUNDUP(mmu->alloc, page_size) < committed) {
+    uint64_t len = committed - ROUNDUP(mmu->alloc, page_size);
     mmu->host_alloc -= len;
+    if (munmap((void *)mmu->host_alloc, len) == -1)
+      fatal(strerror(errno));
+    mmu->heap_host_calls++;
+    mmu_region_split(mmu, HOST_TO_GUEST(mmu->host_alloc), len, -1);
+  } else if (ROUNDUP(mmu->alloc, page_size) != ROUNDUP(base, page_size)) {
+    mmu->heap_calls_saved++; // a page granular heap maps or unmaps here
   }
 
+  // the guest wrote up to heap_dirty before it shrank the heap
+  mmu->heap_dirty = MIN(mmu->heap_dirty, HOST_TO_GUEST(mmu->host_alloc));
+  if (size > 0 && base < mmu->heap_dirty)
+    memset((void *)GUEST_TO_HOST(base), 0,
+           MIN(mmu->alloc, mmu->heap_dirty) - base);
+  mmu->heap_dirty = MAX(mmu->heap_dirty, mmu->alloc);
   return base;
 }
+
+uint64_t mmu_alloc(mmu_t *mmu, int64_t size) {
+  pthread_mutex_lock(&mmu_lock);
+  uint64_t base = mmu_alloc_locked(mmu, size);
+  pthread_mutex_unlock(&mmu_lock);
+  return base;
+}
+
+/**
+ * @brief move the end of the brk heap to addr, the read of the old end
+ * and the move are one step for concurrent harts
+ *
+ * @param mmu
+ * @param addr 0 only queries the end
+ * @return the new end
+ */
+uint64_t mmu_brk(mmu_t *mmu, uint64_t addr) {
+  pthread_mutex_lock(&mmu_lock);
+  if (addr == 0)
+    addr = mmu->alloc;
+  Assert(addr >= mmu->base, "brk cant be smaller than mmu base");
+  mmu_alloc_locked(mmu, (int64_t)addr - mmu->alloc);
+  pthread_mutex_unlock(&mmu_lock);
+  return addr;
+}
+
+/**
+ * @brief print the host calls of the brk heap and the ones it saved
+ *
+ * @param mmu
+ * @param f
+ */
+void mmu_heap_report(mmu_t *mmu, FILE *f) {
+  fprintf(f,
+          "heap: %" PRIu64 " host calls, %" PRIu64 " saved, %" PRIu64
+          " bytes committed\n",
+          mmu->heap_host_calls, mmu->heap_calls_saved,
+          (uint64_t)(mmu->host_alloc - GUEST_TO_HOST(mmu->base)));
+}
+
+/**
+ * @brief guest mmap, the host maps the pages right at GUEST_TO_HOST(addr)
+ *
+ * @param mmu
+ * @param addr guest address, only honoured with MAP_FIXED
+ * @param len
+ * @param prot
+ * @param flags
+ * @param fd host fd, the guest shares the fd table with rvemu
+ * @param offset
+ * @return guest address or -errno
+ */
+int64_t mmu_map(mmu_t *mmu, uint64_t addr, uint64_t len, int prot, int flags,
+                int fd, uint64_t offset) {
+  int page_size = getpagesize();
+  len = ROUNDUP(len, page_size);
+  if (len == 0)
+    return -EINVAL;
+
+  if (!(flags & MAP_FIXED)) {
+    pthread_mutex_lock(&mmu_lock);
+    if (mmu->mmap_alloc == 0)
+      mmu->mmap_alloc = MMU_MMAP_TOP;
+    mmu->mmap_alloc -= len;
+    addr = mmu->mmap_alloc;
+    pthread_mutex_unlock(&mmu_lock);
+    flags |= MAP_FIXED;
+  }
+
+  void *host = mmap((void *)GUEST_TO_HOST(addr), len, prot, flags, fd, offset);
+  if (host == MAP_FAILED)
+    return -errno;
+
+  pthread_mutex_lock(&mmu_lock);
+  mmu_region_map(mmu, addr, len, prot);
+  pthread_mutex_unlock(&mmu_lock);
+  return addr;
+}
+
+int64_t mmu_unmap(mmu_t *mmu, uint64_t addr, uint64_t len) {
+  // keep the guest range reserved, the address space is not handed out again
+  len = ROUNDUP(len, getpagesize());
+  void *host = mmap((void *)GUEST_TO_HOST(addr), len, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  if (host == MAP_FAILED)
+    return -errno;
+
+  pthread_mutex_lock(&mmu_lock);
+  mmu_region_split(mmu, addr, len, -1);
+  pthread_mutex_unlock(&mmu_lock);
+  return 0;
+}
+
+int64_t mmu_protect(mmu_t *mmu, uint64_t addr, uint64_t len, int prot) {
+  len = ROUNDUP(len, getpagesize());
+  if (mprotect((void *)GUEST_TO_HOST(addr), len, prot) == -1)
+    return -errno;
+
+  pthread_mutex_lock(&mmu_lock);
+  mmu_region_split(mmu, addr, len, prot);
+  pthread_mutex_unlock(&mmu_lock);
+  return 0;
+}
@@ -0,0 +1,147 @@
+#include "rvemu.h"
+#include <sys/syscall.h>
+
+/*
+ * jitdump format, see tools/perf/Documentation/jitdump-specification.txt
+ */
+#define JITDUMP_MAGIC 0x4a695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+
+#if defined(__x86_64__)
+#define JITDUMP_ELF_MACH 62 // EM_X86_64
+#elif defined(__aarch64__)
+#define JITDUMP_ELF_MACH 183 // EM_AARCH64
+#else
+#define JITDUMP_ELF_MACH 0
+#endif
+
+// timestamps come from CLOCK_MONOTONIC, record with `perf record -k mono`
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+} jitdump_header_t;
+
+typedef struct {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+} jitdump_code_load_t;
+
+static void perf_write(int fd, const void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    Assert(n > 0, "jitdump write: %s", strerror(errno));
+    buf = (const uint8_t *)buf + n;
+    len -= n;
+  }
+}
+
+static void perf_open_jitdump(perf_t *perf) {
+  char path[64];
+  sprintf(path, "/tmp/jit-%d.dump", getpid());
+  perf->dump_fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+  Assert(perf->dump_fd != -1, "open %s: %s", path, strerror(errno));
+
+  // perf record only picks up the file through an executable mapping of it
+  perf->dump_marker = mmap(NULL, getpagesize(), PROT_READ | PROT_EXEC,
+                           MAP_PRIVATE, perf->dump_fd, 0);
+  Assert(perf->dump_marker != MAP_FAILED, "mmap %s: %s", path,
+         strerror(errno));
+
+  jitdump_header_t header = {
+      .magic = JITDUMP_MAGIC,
+      .version = JITDUMP_VERSION,
+      .total_size = sizeof(header),
+      .elf_mach = JITDUMP_ELF_MACH,
+      .pid = getpid(),
+      .timestamp = stats_now(),
+  };
+  perf_write(perf->dump_fd, &header, sizeof(header));
+}
+
+/**
+ * @brief open the perf map and/or the jitdump of this process
+ *
+ * @param map write /tmp/perf-PID.map
+ * @param jitdump write /tmp/jit-PID.dump
+ * @param symtab guest symbols, may be NULL
+ * @return
+ */
+perf_t *new_perf(bool map, bool jitdump, symtab_t *symtab) {
+  perf_t *perf = (perf_t *)calloc(1, sizeof(perf_t));
+  perf->dump_fd = -1;
+  perf->symtab = symtab;
+
+  if (map) {
+    char path[64];
+    sprintf(path, "/tmp/perf-%d.map", getpid());
+    perf->map = fopen(path, "w");
+    Assert(perf->map != NULL, "open %s: %s", path, strerror(errno));
+    // one line per block, flushed so a crashed run still has its map
+    setvbuf(perf->map, NULL, _IOLBF, 0);
+  }
+
+  if (jitdump)
+    perf_open_jitdump(perf);
+
+  return perf;
+}
+
+// guest function and offset of the block entry, guest_<pc> without symbols
+static void perf_block_name(perf_t *perf, char *buf, size_t len, uint64_t pc) {
+  const symbol_t *sym =
+      perf->symtab != NULL ? symtab_lookup(perf->symtab, pc) : NULL;
+  if (sym == NULL)
+    snprintf(buf, len, "guest_%" PRIx64, pc);
+  else
+    symtab_format(perf->symtab, pc, buf, len);
+}
+
+/**
+ * @brief record a block which was just placed in the code cache
+ *
+ * @param perf
+ * @param pc guest pc of the block
+ * @param code host address of the block
+ * @param sz
+ */
+void perf_code_load(perf_t *perf, uint64_t pc, uint8_t *code, size_t sz) {
+  char name[256];
+  perf_block_name(perf, name, sizeof(name), pc);
+
+  if (perf->map != NULL)
+    fprintf(perf->map, "%" PRIx64 " %zx %s\n", (uint64_t)code, sz, name);
+
+  if (perf->dump_fd != -1) {
+    size_t name_len = strlen(name) + 1;
+    jitdump_code_load_t record = {
+        .id = JIT_CODE_LOAD,
+        .total_size = sizeof(record) + name_len + sz,
+        .timestamp = stats_now(),
+        .pid = getpid(),
+        .tid = syscall(SYS_gettid),
+        .vma = (uint64_t)code,
+        .code_addr = (uint64_t)code,
+        .code_size = sz,
+        .code_index = perf->code_index++,
+    };
+    perf_write(perf->dump_fd, &record, sizeof(record));
+    perf_write(perf->dump_fd, name, name_len);
+    perf_write(perf->dump_fd, code, sz);
+  }
+}
@@ -0,0 +1,157 @@
+/**
+ * @file prof.c
+ * @brief guest sampling profiler
+ */
+
+#include "rvemu.h"
+#include <signal.h>
+#include <sys/time.h>
+
+// the hart running on this thread, read by the signal handler
+static __thread state_t *prof_state;
+// frames above the initial sp of the hart are never walked
+static __thread uint64_t prof_stack_top;
+
+static symtab_t *prof_symtab;
+static prof_sample_t *prof_samples; // reserved, pages are touched on use
+static uint64_t prof_nsamples;
+static uint64_t prof_dropped;
+
+/**
+ * @brief record the guest call stack of the interrupted hart
+ *
+ * in JIT code the pc is the entry of the running block and the registers
+ * are the ones of the block entry, the interpreter keeps them exact.
+ * only reads between sp and the stack top, so a broken chain cannot fault.
+ */
+static void prof_handler(int sig) {
+  state_t *state = prof_state;
+  if (state == NULL)
+    return;
+
+  uint64_t i = __atomic_fetch_add(&prof_nsamples, 1, __ATOMIC_RELAXED);
+  if (i >= PROF_MAX_SAMPLES) {
+    __atomic_fetch_add(&prof_dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  prof_sample_t *sample = &prof_samples[i];
+  uint32_t depth = 0;
+  sample->pcs[depth++] = state->pc;
+
+  // the return address of a leaf function is still in ra, in any other
+  // function ra points back into the function itself after a call
+  uint64_t lr = state->gp_regs[ra];
+  if (lr != 0 && lr != state->pc &&
+      (prof_symtab == NULL || symtab_lookup(prof_symtab, lr) !=
+                                  symtab_lookup(prof_symtab, state->pc)))
+    sample->pcs[depth++] = lr;
+
+  uint64_t lo = state->gp_regs[sp], fp = state->gp_regs[s0];
+  while (depth < PROF_MAX_DEPTH && fp >= lo + 16 && fp <= prof_stack_top &&
+         (fp & 0x7) == 0) {
+    uint64_t ret = *(uint64_t *)GUEST_TO_HOST(fp - 8);
+    uint64_t prev = *(uint64_t *)GUEST_TO_HOST(fp - 16);
+    if (ret == 0)
+      break;
+    // a leaf with a frame saved the same ra, do not count its caller twice
+    if (!(depth == 2 && ret == sample->pcs[1]))
+      sample->pcs[depth++] = ret;
+    if (prev <= fp)
+      break;
+    lo = fp;
+    fp = prev;
+  }
+
+  sample->depth = depth;
+}
+
+/**
+ * @brief start sampling every hart at PROF_HZ of process cpu time
+ *
+ * @param symtab names the frames of the report, may be NULL
+ */
+void prof_start(symtab_t *symtab) {
+  prof_symtab = symtab;
+  prof_samples = (prof_sample_t *)mmap(
+      NULL, PROF_MAX_SAMPLES * sizeof(prof_sample_t), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  Assert(prof_samples != MAP_FAILED, "mmap: %s", strerror(errno));
+
+  struct sigaction sa = {0};
+  sa.sa_handler = prof_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  Assert(sigaction(SIGPROF, &sa, NULL) == 0, "sigaction: %s", strerror(errno));
+
+  struct itimerval timer = {
+      .it_interval = {.tv_usec = 1000000 / PROF_HZ},
+      .it_value = {.tv_usec = 1000000 / PROF_HZ},
+  };
+  Assert(setitimer(ITIMER_PROF, &timer, NULL) == 0, "setitimer: %s",
+         strerror(errno));
+}
+
+/**
+ * @brief make the calling thread's hart visible to the sampler
+ *
+ * @param state
+ */
+void prof_enter(state_t *state) {
+  prof_stack_top = state->gp_regs[sp];
+  __atomic_store_n(&prof_state, state, __ATOMIC_RELEASE);
+}
+
+static void prof_frame_name(uint64_t pc, char *buf, size_t len) {
+  const symbol_t *sym = prof_symtab ? symtab_lookup(prof_symtab, pc) : NULL;
+  if (sym != NULL)
+    snprintf(buf, len, "%s", symtab_name(prof_symtab, sym));
+  else
+    snprintf(buf, len, "0x%" PRIx64, pc);
+}
+
+static int prof_line_cmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief write "root;...;leaf count" lines, one per distinct stack
+ *
+ * @param f
+ */
+void prof_report(FILE *f) {
+  struct itimerval stop = {0};
+  setitimer(ITIMER_PROF, &stop, NULL);
+
+  uint64_t n = MIN(prof_nsamples, PROF_MAX_SAMPLES);
+  char **lines = (char **)malloc(n * sizeof(char *));
+
+  for (uint64_t i = 0; i < n; i++) {
+    prof_sample_t *sample = &prof_samples[i];
+    DECLEAR_STATIC_STR(line);
+    for (int32_t d = sample->depth - 1; d >= 0; d--) {
+      char name[256];
+      prof_frame_name(sample->pcs[d], name, sizeof(name));
+      line = str_append(line, name);
+      if (d > 0)
+        line = str_append(line, ";");
+    }
+    lines[i] = strdup(line);
+  }
+
+  qsort(lines, n, sizeof(char *), prof_line_cmp);
+  for (uint64_t i = 0; i < n;) {
+    uint64_t j = i;
+    while (j < n && strcmp(lines[i], lines[j]) == 0)
+      j++;
+    fprintf(f, "%s %" PRIu64 "\n", lines[i], j - i);
+    i = j;
+  }
+
+  for (uint64_t i = 0; i < n; i++)
+    free(lines[i]);
+  free(lines);
+
+  if (prof_dropped > 0)
+    fprintf(stderr, "prof: %" PRIu64 " samples dropped\n", prof_dropped);
+}
@@ -0,0 +1,103 @@
+#include "rvemu.h"
+
+static void replay_write(replay_t *replay, const void *buf, size_t len) {
+  Assert(fwrite(buf, 1, len, replay->f) == len, "record: %s",
+         strerror(errno));
+}
+
+static void replay_read(replay_t *replay, void *buf, size_t len) {
+  Assert(fread(buf, 1, len, replay->f) == len,
+         "replay: log ends at syscall %" PRIu64, replay->seq);
+}
+
+/**
+ * @brief open the syscall log
+ *
+ * @param path
+ * @param record create the log, otherwise replay it
+ * @param tid written to the log when recording, read back when replaying
+ * so gettid and set_tid_address see the recorded value
+ * @return
+ */
+replay_t *new_replay(const char *path, bool record, uint64_t *tid) {
+  replay_t *replay = (replay_t *)calloc(1, sizeof(replay_t));
+  replay->record = record;
+  replay->f = fopen(path, record ? "w" : "r");
+  Assert(replay->f != NULL, "open %s: %s", path, strerror(errno));
+  // large stdio buffers, a log entry is often a handful of bytes
+  setvbuf(replay->f, NULL, _IOFBF, 1024 * 1024);
+
+  size_t magic_len = strlen(REPLAY_MAGIC);
+  if (record) {
+    replay_write(replay, REPLAY_MAGIC, magic_len);
+    replay_write(replay, tid, sizeof(*tid));
+  } else {
+    char magic[16];
+    replay_read(replay, magic, magic_len);
+    Assert(memcmp(magic, REPLAY_MAGIC, magic_len) == 0,
+           "%s: not a syscall log", path);
+    replay_read(replay, tid, sizeof(*tid));
+  }
+  return replay;
+}
+
+/**
+ * @brief log len bytes of guest memory at addr, written by the syscall
+ * being recorded
+ *
+ * @param replay
+ * @param addr
+ * @param len
+ */
+void replay_effect(replay_t *replay, uint64_t addr, uint64_t len) {
+  if (!replay->record || len == 0)
+    return;
+
+  uint8_t tag = REPLAY_MEM;
+  replay_write(replay, &tag, 1);
+  replay_write(replay, &addr, sizeof(addr));
+  replay_write(replay, &len, sizeof(len));
+  replay_write(replay, (void *)GUEST_TO_HOST(addr), len);
+}
+
+void replay_record(replay_t *replay, uint64_t nr, uint64_t ret) {
+  uint8_t tag = REPLAY_SYSCALL;
+  replay_write(replay, &tag, 1);
+  replay_write(replay, &nr, sizeof(nr));
+  replay_write(replay, &ret, sizeof(ret));
+  replay->seq++;
+}
+
+/**
+ * @brief apply the memory writes of the next logged syscall
+ *
+ * @param replay
+ * @param nr the syscall the guest makes now, it has to be the logged one
+ * @return the logged result
+ */
+uint64_t replay_next(replay_t *replay, uint64_t nr) {
+  while (true) {
+    uint8_t tag;
+    replay_read(replay, &tag, 1);
+
+    if (tag == REPLAY_MEM) {
+      uint64_t addr, len;
+      replay_read(replay, &addr, sizeof(addr));
+      replay_read(replay, &len, sizeof(len));
+      replay_read(replay, (void *)GUEST_TO_HOST(addr), len);
+      continue;
+    }
+
+    Assert(tag == REPLAY_SYSCALL, "replay: bad log entry at syscall %" PRIu64,
+           replay->seq);
+    uint64_t logged_nr, ret;
+    replay_read(replay, &logged_nr, sizeof(logged_nr));
+    replay_read(replay, &ret, sizeof(ret));
+    Assert(logged_nr == nr,
+           "replay: diverged at syscall %" PRIu64 ", logged %" PRIu64
+           " but the guest made %" PRIu64,
+           replay->seq, logged_nr, nr);
+    replay->seq++;
+    return ret;
+  }
+}
@@ -1,22 +1,201 @@
+#include "mmu.h"
 #include "rvemu.h"
+#include <getopt.h>
+
+static machine_t machine;
+static mmu_t mmu;
+static pid_t report_pid; // the process rvemu started
+
+static struct {
+  bool shared_cache;
+  bool stats;
+  bool perf_map;
+  bool jitdump;
+  const char *profile; // folded stacks are written here
+  const char *trace;
+  const char *record;
+  const char *replay;
+  const char *snapshot;
+  const char *restore;
+  const char *fork_server; // "start" or "marker"
+  bool io_uring;
+  bool coalesce_writes;
+  bool virtual_clock;
+} options;
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options] ./playground/a.out [args...]\n"
+          "  --shared-cache  share compiled blocks with other instances\n"
+          "  --stats         print instruction counts and timings at exit\n"
+          "  --perf-map      write /tmp/perf-PID.map for perf report\n"
+          "  --jitdump       write /tmp/jit-PID.dump for perf inject --jit\n"
+          "  --profile FILE  sample the guest and write folded stacks to FILE\n"
+          "  --trace FILE    record every executed block to FILE\n"
+          "  --record FILE   log the host syscall results to FILE\n"
+          "  --replay FILE   feed the guest the syscall results of FILE\n"
+          "  --snapshot FILE save the machine to FILE at the snapshot ecall\n"
+          "  --restore FILE  start from the snapshot FILE of the program\n"
+          "  --fork-server[=marker]\n"
+          "                  fork a run per request on fd 198, from the start\n"
+          "                  or from the snapshot ecall\n"
+          "  --io-uring      do guest file I/O through io_uring\n"
+          "  --coalesce-writes\n"
+          "                  gather small writes to pipes and ttys\n"
+          "  --virtual-clock derive guest time from retired instructions\n",
+          name);
+  exit(1);
+}
+
+static void parse_options(int argc, char *argv[]) {
+  static struct option long_options[] = {
+      {"shared-cache", no_argument, NULL, 's'},
+      {"stats", no_argument, NULL, 't'},
+      {"perf-map", no_argument, NULL, 'p'},
+      {"jitdump", no_argument, NULL, 'j'},
+      {"profile", required_argument, NULL, 'P'},
+      {"trace", required_argument, NULL, 'T'},
+      {"record", required_argument, NULL, 'r'},
+      {"replay", required_argument, NULL, 'R'},
+      {"snapshot", required_argument, NULL, 'S'},
+      {"restore", required_argument, NULL, 'L'},
+      {"fork-server", optional_argument, NULL, 'F'},
+      {"io-uring", no_argument, NULL, 'u'},
+      {"coalesce-writes", no_argument, NULL, 'c'},
+      {"virtual-clock", no_argument, NULL, 'V'},
+      {0, 0, 0, 0},
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "+", long_options, NULL)) != -1) {
+    switch (c) {
+    case 's':
+      options.shared_cache = true;
+      break;
+    case 't':
+      options.stats = true;
+      break;
+    case 'p':
+      options.perf_map = true;
+      break;
+    case 'j':
+      options.jitdump = true;
+      break;
+    case 'P':
+      options.profile = optarg;
+      break;
+    case 'T':
+      options.trace = optarg;
+      break;
+    case 'r':
+      options.record = optarg;
+      break;
+    case 'R':
+      options.replay = optarg;
+      break;
+    case 'S':
+      options.snapshot = optarg;
+      break;
+    case 'L':
+      options.restore = optarg;
+      break;
+    case 'u':
+      options.io_uring = true;
+      break;
+    case 'c':
+      options.coalesce_writes = true;
+      break;
+    case 'V':
+      options.virtual_clock = true;
+      break;
+    case 'F':
+      options.fork_server = optarg ? optarg : "start";
+      if (strcmp(options.fork_server, "start") != 0 &&
+          strcmp(options.fork_server, "marker") != 0)
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc || (options.record && options.replay))
+    usage(argv[0]);
+}
+
+static void report(void) {
+  // fork server children and forks of the guest would each print the
+  // report again and rewrite the profile, without samples of their own
+  if (getpid() != report_pid)
+    return;
+  if (options.shared_cache)
+    cache_report(machine.cache, stderr);
+  if (options.stats) {
+    stats_report(machine.stats, stderr);
+    mmu_heap_report(&mmu, stderr);
+  }
+  if (options.profile) {
+    FILE *f = fopen(options.profile, "w");
+    if (f == NULL) {
+      fprintf(stderr, "%s: %s\n", options.profile, strerror(errno));
+      return;
+    }
+    prof_report(f);
+    fclose(f);
+  }
+}
 
 int main(int argc, char *argv[]) {
+  parse_options(argc, argv);
 
-  Assert(argc > 1, "Usage: ./rvemu ./playground/a.out");
+  // the guest sees the program path as argv[0]
+  argc -= optind - 1;
+  argv += optind - 1;
 
-  machine_t machine;
-  machine.cache = new_cache();
+  machine.mmu = &mmu;
   machine_load_program(&machine, argv[1]);
-  machine_setup(&machine, argc, argv);
+  // a restored guest keeps the arguments it was snapshotted with
+  if (options.restore)
+    machine_restore(&machine, options.restore);
+  else
+    machine_setup(&machine, argc, argv);
+  machine.snapshot = options.snapshot;
+  machine.virtual_clock = options.virtual_clock;
+  if (options.record)
+    machine.replay = new_replay(options.record, true, &machine.tid);
+  if (options.replay)
+    machine.replay = new_replay(options.replay, false, &machine.tid);
+  if (options.shared_cache)
+    machine.cache = new_shared_cache(mmu.ident);
+  else if (options.fork_server)
+    machine.cache = new_fork_cache();
+  else
+    machine.cache = new_cache();
+  if (options.perf_map || options.jitdump)
+    machine.cache->perf =
+        new_perf(options.perf_map, options.jitdump, mmu.symtab);
+  if (options.stats)
+    machine.stats = new_stats();
+  if (options.io_uring) {
+    machine.uring = new_uring();
+    if (machine.uring == NULL)
+      fprintf(stderr, "io_uring is not available, using blocking I/O\n");
+  }
+  if (options.coalesce_writes)
+    machine.coalesce = new_coalesce();
+  if (options.profile)
+    prof_start(mmu.symtab);
+  if (options.trace)
+    machine.trace = new_trace(options.trace, machine.tid);
+  report_pid = getpid();
+  atexit(report);
 
-  while (true) {
-    enum exit_reason_t reason = machine_step(&machine);
-    Assert(reason == ecall, "exit reason is not ecall");
+  if (options.fork_server && strcmp(options.fork_server, "marker") == 0)
+    machine.fork_server = true;
+  else if (options.fork_server)
+    fork_server(&machine);
 
-    uint64_t syscall = machine_get_gp_reg(&machine, a7);
-    uint64_t ret = do_syscall(&machine, syscall);
-    machine_set_gp_reg(&machine, a0, ret);
-  }
+  machine_run(&machine);
 
-  return EXIT_SUCCESS;
+  return machine.exit_code;
 }
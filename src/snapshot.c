@@ -0,0 +1,183 @@
+/**
+ * @file snapshot.c
+ * @brief save the machine after guest initialization, map it back later
+ */
+
+#include "mmu.h"
+#include "rvemu.h"
+
+typedef struct {
+  char magic[8];
+  uint64_t ident; // the snapshot only restores over the same ELF
+  uint64_t tid;
+  uint64_t host_alloc;
+  uint64_t heap_end;
+  uint64_t alloc;
+  uint64_t base;
+  uint64_t mmap_alloc;
+  uint64_t nregions;
+  state_t state;
+} snapshot_header_t;
+
+typedef struct {
+  uint64_t addr;
+  uint64_t len;
+  int64_t prot;
+  uint64_t offset; // of the contents in the file, 0 if not saved
+} snapshot_region_t;
+
+static void snapshot_pwrite(int fd, const void *buf, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    Assert(n > 0, "snapshot write: %s", strerror(errno));
+    buf = (const uint8_t *)buf + n;
+    len -= n;
+    off += n;
+  }
+}
+
+/**
+ * @brief write the pages of a region, leaving holes for the zero ones
+ *
+ * most of the 32MiB stack was never touched, the file stays sparse.
+ *
+ * @param fd
+ * @param data
+ * @param len
+ * @param off
+ */
+static void snapshot_write_pages(int fd, const uint8_t *data, size_t len,
+                                 off_t off) {
+  size_t page_size = getpagesize();
+  for (size_t i = 0; i < len; i += page_size) {
+    const uint8_t *page = data + i;
+    if (page[0] == 0 && memcmp(page, page + 1, page_size - 1) == 0)
+      continue;
+    snapshot_pwrite(fd, page, page_size, off + i);
+  }
+}
+
+/**
+ * @brief write the machine to path, the restored guest sees the snapshot
+ * ecall return 1 where this run sees 0
+ *
+ * @param m
+ * @param path
+ */
+void machine_snapshot(machine_t *m, const char *path) {
+  mmu_t *mmu = m->mmu;
+  uint64_t page_size = getpagesize();
+
+  int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  Assert(fd != -1, "open %s: %s", path, strerror(errno));
+
+  snapshot_header_t header = {
+      .ident = mmu->ident,
+      .tid = m->tid,
+      .host_alloc = mmu->host_alloc,
+      .heap_end = mmu->heap_end,
+      .alloc = mmu->alloc,
+      .base = mmu->base,
+      .mmap_alloc = mmu->mmap_alloc,
+      .nregions = mmu->nregions,
+      .state = m->state,
+  };
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.state.gp_regs[a0] = 1;
+
+  uint64_t table_size = mmu->nregions * sizeof(snapshot_region_t);
+  snapshot_region_t *table = (snapshot_region_t *)calloc(1, table_size + 1);
+  uint64_t offset = ROUNDUP(sizeof(header) + table_size, page_size);
+  for (size_t i = 0; i < mmu->nregions; i++) {
+    mmu_region_t *r = &mmu->regions[i];
+    table[i] = (snapshot_region_t){r->addr, r->len, r->prot, 0};
+    // guard pages and the like come back zero filled
+    if (!(r->prot & PROT_READ))
+      continue;
+    table[i].offset = offset;
+    snapshot_write_pages(fd, (uint8_t *)GUEST_TO_HOST(r->addr), r->len, offset);
+    offset += r->len;
+  }
+  // the skipped zero pages at the end still have to be in the file
+  Assert(ftruncate(fd, offset) == 0, "snapshot truncate: %s", strerror(errno));
+
+  snapshot_pwrite(fd, &header, sizeof(header), 0);
+  snapshot_pwrite(fd, table, table_size, sizeof(header));
+  free(table);
+  close(fd);
+}
+
+/**
+ * @brief replace the freshly loaded program by a snapshot of it
+ *
+ * the guest memory is a private file mapping of the snapshot, pages are
+ * only read in when touched and only copied when written.
+ *
+ * @param m
+ * @param path
+ */
+void machine_restore(machine_t *m, const char *path) {
+  mmu_t *mmu = m->mmu;
+
+  int fd = open(path, O_RDONLY);
+  Assert(fd != -1, "open %s: %s", path, strerror(errno));
+
+  snapshot_header_t header;
+  Assert(pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+             memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0,
+         "%s: not a snapshot", path);
+  Assert(header.ident == mmu->ident, "%s: snapshot of another program", path);
+
+  uint64_t table_size = header.nregions * sizeof(snapshot_region_t);
+  snapshot_region_t *table = (snapshot_region_t *)malloc(table_size + 1);
+  Assert(pread(fd, table, table_size, sizeof(header)) == (ssize_t)table_size,
+         "%s: truncated snapshot", path);
+
+  // drop what mmu_load_elf mapped and reserved, the snapshot has all of it
+  for (size_t i = 0; i < mmu->nregions; i++)
+    munmap((void *)GUEST_TO_HOST(mmu->regions[i].addr), mmu->regions[i].len);
+  mmu->nregions = 0;
+  if (mmu->host_alloc < mmu->heap_end)
+    munmap((void *)mmu->host_alloc, mmu->heap_end - mmu->host_alloc);
+
+  for (size_t i = 0; i < header.nregions; i++) {
+    snapshot_region_t *r = &table[i];
+    void *addr = (void *)GUEST_TO_HOST(r->addr);
+    void *host;
+    if (r->offset != 0)
+      host = mmap(addr, r->len, r->prot, MAP_PRIVATE | MAP_FIXED, fd,
+                  r->offset);
+    else
+      host = mmap(addr, r->len, r->prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+                  -1, 0);
+    Assert(host == addr, "%s: mmap: %s", path, strerror(errno));
+    mmu_region_map(mmu, r->addr, r->len, r->prot);
+  }
+  free(table);
+  close(fd);
+
+  // the rest of the brk reservation, the heap grows into it as it did in
+  // the snapshotted run
+  mmu->heap_end = MIN(header.heap_end, header.host_alloc);
+  if (header.host_alloc < header.heap_end) {
+    uint64_t len = header.heap_end - header.host_alloc;
+    void *p = mmap((void *)header.host_alloc, len, PROT_NONE,
+                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE |
+                       MAP_FIXED_NOREPLACE,
+                   -1, 0);
+    if (p == (void *)header.host_alloc)
+      mmu->heap_end = header.heap_end;
+    else if (p != MAP_FAILED)
+      munmap(p, len); // an old kernel took it as a hint
+  }
+
+  mmu->host_alloc = header.host_alloc;
+  mmu->heap_dirty = HOST_TO_GUEST(header.host_alloc);
+  mmu->alloc = header.alloc;
+  mmu->base = header.base;
+  mmu->mmap_alloc = header.mmap_alloc;
+  m->tid = header.tid;
+  m->state = header.state;
+}
@@ -0,0 +1,31 @@
+#include "rvemu.h"
+
+stats_t *new_stats() {
+  stats_t *stats = (stats_t *)calloc(1, sizeof(stats_t));
+  stats->start_ns = stats_now();
+  return stats;
+}
+
+/**
+ * @brief print the statistics as one key=value line, bench/run.sh parses it
+ *
+ * @param stats
+ * @param f
+ */
+void stats_report(stats_t *stats, FILE *f) {
+  double wall = (stats_now() - stats->start_ns) / 1e9;
+  uint64_t insts = stats->interp_insts + stats->jit_insts;
+
+  fprintf(f,
+          "stats: insts=%" PRIu64 " interp_insts=%" PRIu64
+          " jit_insts=%" PRIu64 " blocks=%" PRIu64 " interp_blocks=%" PRIu64
+          " jit_blocks=%" PRIu64 " syscalls=%" PRIu64 " fast_syscalls=%" PRIu64
+          " compiles=%" PRIu64 " interp_s=%.6f jit_s=%.6f syscall_s=%.6f compile_s=%.6f"
+          " wall_s=%.6f mips=%.2f\n",
+          insts, stats->interp_insts, stats->jit_insts,
+          stats->interp_blocks + stats->jit_blocks, stats->interp_blocks,
+          stats->jit_blocks, stats->syscalls, stats->fast_syscalls,
+          stats->compiles,
+          stats->interp_ns / 1e9, stats->jit_ns / 1e9, stats->syscall_ns / 1e9,
+          stats->compile_ns / 1e9, wall, wall > 0 ? insts / wall / 1e6 : 0.0);
+}
@@ -0,0 +1,136 @@
+#include "rvemu.h"
+#include <sys/stat.h>
+
+static int symbol_cmp(const void *a, const void *b) {
+  const symbol_t *x = a, *y = b;
+  if (x->addr != y->addr)
+    return x->addr < y->addr ? -1 : 1;
+  // aliases keep a stable order, the first one wins in symtab_load
+  return x->name < y->name ? -1 : x->name > y->name;
+}
+
+/**
+ * @brief build the function index of the ELF opened as fd
+ *
+ * a stripped binary gives an empty index, lookups then return NULL.
+ *
+ * @param fd
+ * @return
+ */
+symtab_t *symtab_load(int fd) {
+  symtab_t *symtab = (symtab_t *)calloc(1, sizeof(symtab_t));
+
+  struct stat st;
+  Assert(fstat(fd, &st) == 0, "%s", strerror(errno));
+  symtab->image_size = st.st_size;
+  symtab->image =
+      (uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  Assert(symtab->image != MAP_FAILED, "mmap elf: %s", strerror(errno));
+
+  elf64_ehdr_t *ehdr = (elf64_ehdr_t *)symtab->image;
+  if (ehdr->e_shoff == 0 ||
+      ehdr->e_shoff + ehdr->e_shnum * sizeof(elf64_shdr_t) > st.st_size)
+    return symtab;
+
+  elf64_shdr_t *shdrs = (elf64_shdr_t *)(symtab->image + ehdr->e_shoff);
+  elf64_shdr_t *sym_shdr = NULL;
+  for (size_t i = 0; i < ehdr->e_shnum; i++) {
+    if (shdrs[i].sh_type == SHT_SYMTAB) {
+      sym_shdr = &shdrs[i];
+      break;
+    }
+  }
+  if (sym_shdr == NULL || sym_shdr->sh_link >= ehdr->e_shnum)
+    return symtab;
+
+  elf64_shdr_t *str_shdr = &shdrs[sym_shdr->sh_link];
+  if (sym_shdr->sh_offset + sym_shdr->sh_size > st.st_size ||
+      str_shdr->sh_offset + str_shdr->sh_size > st.st_size)
+    return symtab;
+
+  symtab->strtab = (const char *)symtab->image + str_shdr->sh_offset;
+  elf64_sym_t *elf_syms = (elf64_sym_t *)(symtab->image + sym_shdr->sh_offset);
+  size_t n = sym_shdr->sh_size / sizeof(elf64_sym_t);
+
+  symtab->syms = (symbol_t *)malloc(n * sizeof(symbol_t));
+  for (size_t i = 0; i < n; i++) {
+    elf64_sym_t *sym = &elf_syms[i];
+    uint8_t type = ELF64_ST_TYPE(sym->st_info);
+    if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+        sym->st_shndx == SHN_UNDEF || sym->st_value == 0 ||
+        sym->st_name >= str_shdr->sh_size)
+      continue;
+
+    symtab->syms[symtab->nsyms++] = (symbol_t){
+        .addr = sym->st_value,
+        .size = sym->st_size,
+        .name = sym->st_name,
+    };
+  }
+
+  qsort(symtab->syms, symtab->nsyms, sizeof(symbol_t), symbol_cmp);
+
+  // drop the aliases, one name per address is enough
+  size_t j = 0;
+  for (size_t i = 0; i < symtab->nsyms; i++) {
+    if (j > 0 && symtab->syms[j - 1].addr == symtab->syms[i].addr)
+      continue;
+    symtab->syms[j++] = symtab->syms[i];
+  }
+  symtab->nsyms = j;
+  symtab->syms = (symbol_t *)realloc(symtab->syms, j * sizeof(symbol_t));
+
+  return symtab;
+}
+
+void symtab_free(symtab_t *symtab) {
+  munmap(symtab->image, symtab->image_size);
+  free(symtab->syms);
+  free(symtab);
+}
+
+/**
+ * @brief find the function containing addr
+ *
+ * a symbol without a size covers everything up to the next one.
+ *
+ * @param symtab
+ * @param addr guest address
+ * @return NULL if addr is not in a known function
+ */
+const symbol_t *symtab_lookup(symtab_t *symtab, uint64_t addr) {
+  size_t lo = 0, hi = symtab->nsyms;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (symtab->syms[mid].addr <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return NULL;
+
+  const symbol_t *sym = &symtab->syms[lo - 1];
+  if (sym->size != 0 && addr >= sym->addr + sym->size)
+    return NULL;
+  return sym;
+}
+
+const char *symtab_name(symtab_t *symtab, const symbol_t *sym) {
+  return symtab->strtab + sym->name;
+}
+
+/**
+ * @brief format addr as name+0xoffset, or as a bare hex address
+ *
+ * @return length like snprintf
+ */
+int symtab_format(symtab_t *symtab, uint64_t addr, char *buf, size_t len) {
+  const symbol_t *sym = symtab ? symtab_lookup(symtab, addr) : NULL;
+  if (sym == NULL)
+    return snprintf(buf, len, "0x%" PRIx64, addr);
+  if (addr == sym->addr)
+    return snprintf(buf, len, "%s", symtab_name(symtab, sym));
+  return snprintf(buf, len, "%s+0x%" PRIx64, symtab_name(symtab, sym),
+                  addr - sym->addr);
+}
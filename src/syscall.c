@@ -1,7 +1,17 @@
+#define _GNU_SOURCE
 #include "mmu.h"
 #include "rvemu.h"
+#include <asm/unistd.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <termios.h>
 
 // Copied from https://github.com/riscv-software-src/riscv-pk
 #define SYS_exit 93
@@ -26,6 +36,7 @@
 #define SYS_faccessat 48
 #define SYS_pread 67
 #define SYS_pwrite 68
+#define SYS_fsync 82
 #define SYS_uname 160
 #define SYS_getuid 174
 #define SYS_geteuid 175
@@ -40,12 +51,13 @@
 #define SYS_prlimit64 261
 #define SYS_getmainvars 2011
 #define SYS_rt_sigaction 134
+#define SYS_readv 65
 #define SYS_writev 66
 #define SYS_gettimeofday 169
 #define SYS_times 153
 #define SYS_fcntl 25
 #define SYS_ftruncate 46
-#define SYS_getdents 61
+#define SYS_getdents64 61
 #define SYS_dup 23
 #define SYS_dup3 24
 #define SYS_readlinkat 78
@@ -59,6 +71,9 @@
 #define SYS_set_robust_list 99
 #define SYS_madvise 233
 #define SYS_statx 291
+#define SYS_futex 98
+#define SYS_sched_yield 124
+#define SYS_clone 220
 
 #define OLD_SYSCALL_THRESHOLD 1024
 #define SYS_open 1024
@@ -72,21 +87,244 @@
 
 #define GET(reg, name) uint64_t name = machine_get_gp_reg(m, reg);
 
+// guest memory written by the host, logged when recording
+#define EFFECT(addr, len)                                                      \
+  if (m->replay)                                                               \
+    replay_effect(m->replay, addr, len);
+
 typedef uint64_t (*syscall_t)(machine_t *);
 
 static uint64_t sys_unimplemented(machine_t *m) {
   fatalf("unimplemented syscall: %lu", machine_get_gp_reg(m, a7));
 }
 
+// host syscalls return -1 and set errno, the guest expects -errno
+static uint64_t host_ret(int64_t ret) { return ret == -1 ? -errno : ret; }
+
+static uint64_t host_futex(uint64_t uaddr, int op, uint64_t val, uint64_t arg4,
+                           uint64_t uaddr2, uint64_t val3) {
+  return host_ret(syscall(__NR_futex, GUEST_TO_HOST(uaddr), op, val, arg4,
+                          uaddr2 ? GUEST_TO_HOST(uaddr2) : 0, val3));
+}
+
+/*
+ * harts
+ */
+static void *hart_main(void *arg) {
+  machine_t *m = (machine_t *)arg;
+  machine_run(m);
+  // the hart returns once it was the last one or called exit_group
+  exit(m->exit_code);
+}
+
+/**
+ * @brief leave the calling hart, the last one stops machine_run so the
+ * process can go down
+ *
+ * @param m
+ * @param code
+ */
+static void hart_exit(machine_t *m, uint64_t code) {
+  if (m->trace)
+    trace_flush(m->trace);
+  if (__atomic_sub_fetch(&m->mmu->nharts, 1, __ATOMIC_ACQ_REL) == 0) {
+    m->exited = true;
+    m->exit_code = code;
+    return;
+  }
+
+  if (m->clear_child_tid != 0) {
+    __atomic_store_n((uint32_t *)GUEST_TO_HOST(m->clear_child_tid), 0,
+                     __ATOMIC_SEQ_CST);
+    host_futex(m->clear_child_tid, FUTEX_WAKE, 1, 0, 0, 0);
+  }
+  pthread_exit(NULL);
+}
+
 static uint64_t sys_exit(machine_t *m) {
   GET(a0, code);
-  exit(code);
+  hart_exit(m, code);
+  return code;
+}
+
+static uint64_t sys_exit_group(machine_t *m) {
+  GET(a0, code);
+  m->exited = true;
+  m->exit_code = code;
+  return code;
+}
+
+static uint64_t sys_clone(machine_t *m) {
+  GET(a0, flags);
+  GET(a1, newsp);
+  GET(a2, parent_tid);
+  GET(a3, tls);
+  GET(a4, child_tid);
+
+  Assert(m->replay == NULL, "record/replay needs a single hart and process");
+
+  if (!(flags & CLONE_THREAD)) {
+    // fork. a vfork style clone with CLONE_VM, as in posix_spawn, system
+    // and popen, gets a copy of the memory too, the child only runs on
+    // newsp until it execs
+    pid_t pid = machine_fork(m);
+    if (pid == 0 && newsp != 0)
+      m->state.gp_regs[sp] = newsp;
+    return host_ret(pid);
+  }
+
+  // librvemu hands the memory back at rvemu_destroy and has no way to stop
+  // a hart blocked in the host, nor to keep exit_group from exiting the host
+  if (m->single_hart)
+    return -EAGAIN;
+
+  machine_t *child = (machine_t *)malloc(sizeof(machine_t));
+  *child = *m;
+  child->tid =
+      getpid() + __atomic_add_fetch(&m->mmu->next_tid, 1, __ATOMIC_RELAXED);
+  child->clear_child_tid = flags & CLONE_CHILD_CLEARTID ? child_tid : 0;
+  child->robust_list = 0;
+  child->insts_limit = 0;
+  if (m->trace)
+    child->trace = trace_hart(m->trace, child->tid);
+  child->state.gp_regs[a0] = 0;
+  if (newsp != 0)
+    child->state.gp_regs[sp] = newsp;
+  if (flags & CLONE_SETTLS)
+    child->state.gp_regs[tp] = tls;
+  if (flags & CLONE_PARENT_SETTID)
+    *(uint32_t *)GUEST_TO_HOST(parent_tid) = child->tid;
+  if (flags & CLONE_CHILD_SETTID)
+    *(uint32_t *)GUEST_TO_HOST(child_tid) = child->tid;
+
+  __atomic_add_fetch(&m->mmu->nharts, 1, __ATOMIC_ACQ_REL);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int ret = pthread_create(&thread, &attr, hart_main, child);
+  pthread_attr_destroy(&attr);
+  if (ret != 0) {
+    __atomic_sub_fetch(&m->mmu->nharts, 1, __ATOMIC_ACQ_REL);
+    free(child);
+    return -ret;
+  }
+
+  return child->tid;
+}
+
+static uint64_t sys_futex(machine_t *m) {
+  GET(a0, uaddr);
+  GET(a1, op);
+  GET(a2, val);
+  GET(a3, timeout);
+  GET(a4, uaddr2);
+  GET(a5, val3);
+
+  // the timespec layout is the same on rv64 and the host, but the requeue
+  // family passes a plain integer in place of the timeout pointer
+  int cmd = op & FUTEX_CMD_MASK;
+  if ((cmd == FUTEX_WAIT || cmd == FUTEX_WAIT_BITSET ||
+       cmd == FUTEX_LOCK_PI || cmd == FUTEX_WAIT_REQUEUE_PI) &&
+      timeout != 0)
+    timeout = GUEST_TO_HOST(timeout);
+
+  return host_futex(uaddr, op, val, timeout, uaddr2, val3);
+}
+
+static uint64_t sys_set_tid_address(machine_t *m) {
+  GET(a0, tidptr);
+  m->clear_child_tid = tidptr;
+  return m->tid;
+}
+
+static uint64_t sys_set_robust_list(machine_t *m) {
+  GET(a0, head);
+  m->robust_list = head;
+  return 0;
+}
+
+static uint64_t sys_getpid(machine_t *m) { return getpid(); }
+
+static uint64_t sys_gettid(machine_t *m) { return m->tid; }
+
+static uint64_t sys_sched_yield(machine_t *m) { return host_ret(sched_yield()); }
+
+// signals are never delivered to the guest, there is nothing to mask
+static uint64_t sys_rt_sigprocmask(machine_t *m) { return 0; }
+
+static uint64_t sys_mmap(machine_t *m) {
+  GET(a0, addr);
+  GET(a1, len);
+  GET(a2, prot);
+  GET(a3, flags);
+  GET(a4, fd);
+  GET(a5, offset);
+  if (m->replay == NULL || (flags & MAP_ANONYMOUS))
+    return mmu_map(m->mmu, addr, len, prot, flags, fd, offset);
+
+  // replay opens no files, so a file mapping is logged with its bytes and
+  // replayed as anonymous memory filled with them
+  if (m->replay->record) {
+    int64_t ret = mmu_map(m->mmu, addr, len, prot, flags, fd, offset);
+    struct stat st;
+    if (ret >= 0 && (prot & PROT_READ) && fstat(fd, &st) == 0 &&
+        (uint64_t)st.st_size > offset)
+      replay_effect(m->replay, ret, MIN(len, st.st_size - offset));
+    replay_record(m->replay, SYS_mmap, ret);
+    return ret;
+  }
+
+  int64_t ret = mmu_map(m->mmu, addr, len, prot | PROT_WRITE,
+                        (flags & ~MAP_SHARED) | MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+  uint64_t logged = replay_next(m->replay, SYS_mmap);
+  Assert((int64_t)logged < 0 || ret == (int64_t)logged,
+         "replay: mmap diverged at syscall %" PRIu64, m->replay->seq);
+  if (ret >= 0 && (int64_t)logged < 0)
+    mmu_unmap(m->mmu, ret, len);
+  else if (ret >= 0 && !(prot & PROT_WRITE))
+    mmu_protect(m->mmu, ret, len, prot);
+  return logged;
+}
+
+static uint64_t sys_munmap(machine_t *m) {
+  GET(a0, addr);
+  GET(a1, len);
+  return mmu_unmap(m->mmu, addr, len);
+}
+
+static uint64_t sys_mprotect(machine_t *m) {
+  GET(a0, addr);
+  GET(a1, len);
+  GET(a2, prot);
+  return mmu_protect(m->mmu, addr, len, prot);
+}
+
+static uint64_t sys_madvise(machine_t *m) { return 0; }
+
+/**
+ * @brief drop what uring and write coalescing cached about an fd that was
+ * closed or now names another file
+ *
+ * @param m
+ * @param fd
+ * @return fd
+ */
+static int64_t fd_forget(machine_t *m, int64_t fd) {
+  if (fd >= 0 && m->uring)
+    uring_forget(m->uring, fd);
+  if (fd >= 0 && m->coalesce)
+    coalesce_forget(m->coalesce, fd);
+  return fd;
 }
 
 static uint64_t sys_close(machine_t *m) {
   GET(a0, fd);
+  // the guest shares stdio with rvemu, keep it open for the stats report
   if (fd > 2)
-    return close(fd);
+    return host_ret(close(fd_forget(m, fd)));
   return 0;
 }
 
@@ -94,22 +332,458 @@ static uint64_t sys_write(machine_t *m) {
   GET(a0, fd);
   GET(a1, ptr);
   GET(a2, len);
-  return write(fd, (void *)GUEST_TO_HOST(ptr), (size_t)len);
+  if (m->coalesce) {
+    struct iovec iov = {(void *)GUEST_TO_HOST(ptr), len};
+    int64_t ret = coalesce_writev(m->coalesce, fd, &iov, 1);
+    if (ret >= 0)
+      return ret;
+  }
+  if (m->uring)
+    return uring_write(m->uring, fd, (void *)GUEST_TO_HOST(ptr), len, -1);
+  return host_ret(write(fd, (void *)GUEST_TO_HOST(ptr), (size_t)len));
 }
 
 static uint64_t sys_read(machine_t *m) {
   GET(a0, fd);
   GET(a1, buf);
   GET(a2, count);
-  return read(fd, (void *)GUEST_TO_HOST(buf), (size_t)count);
+  int64_t ret;
+  if (m->uring)
+    ret = uring_read(m->uring, fd, (void *)GUEST_TO_HOST(buf), count, -1);
+  else
+    ret = host_ret(read(fd, (void *)GUEST_TO_HOST(buf), (size_t)count));
+  if (ret > 0)
+    EFFECT(buf, ret);
+  return ret;
+}
+
+static uint64_t sys_pwrite(machine_t *m) {
+  GET(a0, fd);
+  GET(a1, ptr);
+  GET(a2, len);
+  GET(a3, offset);
+  if (m->uring)
+    return uring_write(m->uring, fd, (void *)GUEST_TO_HOST(ptr), len, offset);
+  return host_ret(pwrite(fd, (void *)GUEST_TO_HOST(ptr), len, offset));
+}
+
+static uint64_t sys_pread(machine_t *m) {
+  GET(a0, fd);
+  GET(a1, buf);
+  GET(a2, count);
+  GET(a3, offset);
+  int64_t ret;
+  if (m->uring)
+    ret = uring_read(m->uring, fd, (void *)GUEST_TO_HOST(buf), count, offset);
+  else
+    ret = host_ret(pread(fd, (void *)GUEST_TO_HOST(buf), count, offset));
+  if (ret > 0)
+    EFFECT(buf, ret);
+  return ret;
+}
+
+static uint64_t sys_fsync(machine_t *m) {
+  GET(a0, fd);
+  if (m->uring)
+    return uring_fsync(m->uring, fd);
+  return host_ret(fsync(fd));
+}
+
+/*
+ * files
+ *
+ * paths and buffers are passed to the host in place. the fcntl flags,
+ * AT_* values, statx, dirent64, utsname and termios are the same on rv64
+ * and x86_64, only struct stat needs a translation.
+ */
+
+// struct stat of asm-generic, the layout the rv64 guest sees
+typedef struct {
+  uint64_t st_dev;
+  uint64_t st_ino;
+  uint32_t st_mode;
+  uint32_t st_nlink;
+  uint32_t st_uid;
+  uint32_t st_gid;
+  uint64_t st_rdev;
+  uint64_t pad1;
+  int64_t st_size;
+  int32_t st_blksize;
+  int32_t pad2;
+  int64_t st_blocks;
+  int64_t st_atime_sec;
+  uint64_t st_atime_nsec;
+  int64_t st_mtime_sec;
+  uint64_t st_mtime_nsec;
+  int64_t st_ctime_sec;
+  uint64_t st_ctime_nsec;
+  uint32_t unused[2];
+} rv64_stat_t;
+
+_Static_assert(sizeof(rv64_stat_t) == 128, "rv64 struct stat is 128 bytes");
+
+static uint64_t guest_stat(machine_t *m, int ret, struct stat *st,
+                           uint64_t addr) {
+  if (ret == -1)
+    return -errno;
+
+  rv64_stat_t *g = (rv64_stat_t *)GUEST_TO_HOST(addr);
+  *g = (rv64_stat_t){
+      .st_dev = st->st_dev,
+      .st_ino = st->st_ino,
+      .st_mode = st->st_mode,
+      .st_nlink = st->st_nlink,
+      .st_uid = st->st_uid,
+      .st_gid = st->st_gid,
+      .st_rdev = st->st_rdev,
+      .st_size = st->st_size,
+      .st_blksize = st->st_blksize,
+      .st_blocks = st->st_blocks,
+      .st_atime_sec = st->st_atim.tv_sec,
+      .st_atime_nsec = st->st_atim.tv_nsec,
+      .st_mtime_sec = st->st_mtim.tv_sec,
+      .st_mtime_nsec = st->st_mtim.tv_nsec,
+      .st_ctime_sec = st->st_ctim.tv_sec,
+      .st_ctime_nsec = st->st_ctim.tv_nsec,
+  };
+  EFFECT(addr, sizeof(rv64_stat_t));
+  return 0;
 }
 
 static uint64_t sys_fstat(machine_t *m) {
   GET(a0, fd);
   GET(a1, addr);
-  return fstat(fd, (struct stat *)GUEST_TO_HOST(addr));
+  struct stat st;
+  return guest_stat(m, fstat(fd, &st), &st, addr);
+}
+
+static uint64_t sys_fstatat(machine_t *m) {
+  GET(a0, dirfd);
+  GET(a1, path);
+  GET(a2, addr);
+  GET(a3, flags);
+  struct stat st;
+  return guest_stat(
+      m, fstatat(dirfd, (char *)GUEST_TO_HOST(path), &st, flags), &st, addr);
+}
+
+static uint64_t sys_statx(machine_t *m) {
+  GET(a0, dirfd);
+  GET(a1, path);
+  GET(a2, flags);
+  GET(a3, mask);
+  GET(a4, addr);
+  int64_t ret = host_ret(statx(dirfd, (char *)GUEST_TO_HOST(path), flags, mask,
+                               (struct statx *)GUEST_TO_HOST(addr)));
+  if (ret == 0)
+    EFFECT(addr, sizeof(struct statx));
+  return ret;
+}
+
+static uint64_t sys_openat(machine_t *m) {
+  GET(a0, dirfd);
+  GET(a1, path);
+  GET(a2, flags);
+  GET(a3, mode);
+  return fd_forget(
+      m, host_ret(openat(dirfd, (char *)GUEST_TO_HOST(path), flags, mode)));
+}
+
+static uint64_t sys_lseek(machine_t *m) {
+  GET(a0, fd);
+  GET(a1, offset);
+  GET(a2, whence);
+  return host_ret(lseek(fd, offset, whence));
+}
+
+/**
+ * @brief the host iovec array of a guest one, the buffers are not copied
+ *
+ * @param iov at least cnt entries
+ * @param addr guest struct iovec array, the same layout as the host one
+ * @param cnt
+ */
+static void guest_iovec(struct iovec *iov, uint64_t addr, uint64_t cnt) {
+  struct iovec *g = (struct iovec *)GUEST_TO_HOST(addr);
+  for (uint64_t i = 0; i < cnt; i++) {
+    iov[i].iov_base = (void *)GUEST_TO_HOST((uint64_t)g[i].iov_base);
+    iov[i].iov_len = g[i].iov_len;
+  }
 }
 
+static uint64_t sys_readv(machine_t *m) {
+  GET(a0, fd);
+  GET(a1, addr);
+  GET(a2, cnt);
+  if (cnt > IOV_MAX)
+    return -EINVAL;
+  struct iovec iov[cnt];
+  guest_iovec(iov, addr, cnt);
+  int64_t ret = host_ret(readv(fd, iov, cnt));
+
+  struct iovec *g = (struct iovec *)GUEST_TO_HOST(addr);
+  for (uint64_t i = 0, left = ret > 0 ? ret : 0; i < cnt && left > 0; i++) {
+    uint64_t len = MIN(left, g[i].iov_len);
+    EFFECT((uint64_t)g[i].iov_base, len);
+    left -= len;
+  }
+  return ret;
+}
+
+static uint64_t sys_writev(machine_t *m) {
+  GET(a0, fd);
+  GET(a1, addr);
+  GET(a2, cnt);
+  if (cnt > IOV_MAX)
+    return -EINVAL;
+  struct iovec iov[cnt];
+  guest_iovec(iov, addr, cnt);
+  if (m->coalesce) {
+    int64_t ret = coalesce_writev(m->coalesce, fd, iov, cnt);
+    if (ret >= 0)
+      return ret;
+  }
+  return host_ret(writev(fd, iov, cnt));
+}
+
+static uint64_t sys_getdents64(machine_t *m) {
+  GET(a0, fd);
+  GET(a1, addr);
+  GET(a2, count);
+  int64_t ret =
+      host_ret(syscall(__NR_getdents64, fd, GUEST_TO_HOST(addr), count));
+  if (ret > 0)
+    EFFECT(addr, ret);
+  return ret;
+}
+
+static uint64_t sys_faccessat(machine_t *m) {
+  GET(a0, dirfd);
+  GET(a1, path);
+  GET(a2, mode);
+  return host_ret(faccessat(dirfd, (char *)GUEST_TO_HOST(path), mode, 0));
+}
+
+static uint64_t sys_readlinkat(machine_t *m) {
+  GET(a0, dirfd);
+  GET(a1, path);
+  GET(a2, buf);
+  GET(a3, size);
+  int64_t ret = host_ret(readlinkat(dirfd, (char *)GUEST_TO_HOST(path),
+                                    (char *)GUEST_TO_HOST(buf), size));
+  if (ret > 0)
+    EFFECT(buf, ret);
+  return ret;
+}
+
+static uint64_t sys_unlinkat(machine_t *m) {
+  GET(a0, dirfd);
+  GET(a1, path);
+  GET(a2, flags);
+  return host_ret(unlinkat(dirfd, (char *)GUEST_TO_HOST(path), flags));
+}
+
+static uint64_t sys_mkdirat(machine_t *m) {
+  GET(a0, dirfd);
+  GET(a1, path);
+  GET(a2, mode);
+  return host_ret(mkdirat(dirfd, (char *)GUEST_TO_HOST(path), mode));
+}
+
+static uint64_t sys_linkat(machine_t *m) {
+  GET(a0, olddirfd);
+  GET(a1, oldpath);
+  GET(a2, newdirfd);
+  GET(a3, newpath);
+  GET(a4, flags);
+  return host_ret(linkat(olddirfd, (char *)GUEST_TO_HOST(oldpath), newdirfd,
+                         (char *)GUEST_TO_HOST(newpath), flags));
+}
+
+static uint64_t sys_renameat(machine_t *m) {
+  GET(a0, olddirfd);
+  GET(a1, oldpath);
+  GET(a2, newdirfd);
+  GET(a3, newpath);
+  return host_ret(renameat(olddirfd, (char *)GUEST_TO_HOST(oldpath), newdirfd,
+                           (char *)GUEST_TO_HOST(newpath)));
+}
+
+/*
+ * the pre-*at syscalls of newlib, relative to the working directory. its
+ * open passes the O_* values of newlib, not the linux ones
+ */
+static const struct {
+  uint64_t newlib;
+  int host;
+} newlib_open_flags[] = {
+    {0x0008, O_APPEND},   {0x0200, O_CREAT},     {0x0400, O_TRUNC},
+    {0x0800, O_EXCL},     {0x2000, O_SYNC},      {0x4000, O_NONBLOCK},
+    {0x8000, O_NOCTTY},   {0x40000, O_CLOEXEC},  {0x100000, O_NOFOLLOW},
+    {0x200000, O_DIRECTORY},
+};
+
+static uint64_t sys_open(machine_t *m) {
+  GET(a0, path);
+  GET(a1, flags);
+  GET(a2, mode);
+  int host_flags = flags & O_ACCMODE;
+  for (size_t i = 0; i < ARRAY_SIZE(newlib_open_flags); i++)
+    if (flags & newlib_open_flags[i].newlib)
+      host_flags |= newlib_open_flags[i].host;
+  return fd_forget(m, host_ret(openat(AT_FDCWD, (char *)GUEST_TO_HOST(path),
+                                      host_flags, mode)));
+}
+
+static uint64_t sys_link(machine_t *m) {
+  GET(a0, oldpath);
+  GET(a1, newpath);
+  return host_ret(linkat(AT_FDCWD, (char *)GUEST_TO_HOST(oldpath), AT_FDCWD,
+                         (char *)GUEST_TO_HOST(newpath), 0));
+}
+
+static uint64_t sys_unlink(machine_t *m) {
+  GET(a0, path);
+  return host_ret(unlinkat(AT_FDCWD, (char *)GUEST_TO_HOST(path), 0));
+}
+
+static uint64_t sys_mkdir(machine_t *m) {
+  GET(a0, path);
+  GET(a1, mode);
+  return host_ret(mkdirat(AT_FDCWD, (char *)GUEST_TO_HOST(path), mode));
+}
+
+static uint64_t sys_access(machine_t *m) {
+  GET(a0, path);
+  GET(a1, mode);
+  return host_ret(faccessat(AT_FDCWD, (char *)GUEST_TO_HOST(path), mode, 0));
+}
+
+static uint64_t sys_stat(machine_t *m) {
+  GET(a0, path);
+  GET(a1, addr);
+  struct stat st;
+  return guest_stat(
+      m, fstatat(AT_FDCWD, (char *)GUEST_TO_HOST(path), &st, 0), &st, addr);
+}
+
+static uint64_t sys_lstat(machine_t *m) {
+  GET(a0, path);
+  GET(a1, addr);
+  struct stat st;
+  return guest_stat(m,
+                    fstatat(AT_FDCWD, (char *)GUEST_TO_HOST(path), &st,
+                            AT_SYMLINK_NOFOLLOW),
+                    &st, addr);
+}
+
+static uint64_t sys_getcwd(machine_t *m) {
+  GET(a0, buf);
+  GET(a1, size);
+  // the raw syscall returns the length, the libc wrapper the buffer
+  int64_t ret = host_ret(syscall(__NR_getcwd, GUEST_TO_HOST(buf), size));
+  if (ret > 0)
+    EFFECT(buf, ret);
+  return ret;
+}
+
+static uint64_t sys_chdir(machine_t *m) {
+  GET(a0, path);
+  return host_ret(chdir((char *)GUEST_TO_HOST(path)));
+}
+
+static uint64_t sys_ftruncate(machine_t *m) {
+  GET(a0, fd);
+  GET(a1, length);
+  return host_ret(ftruncate(fd, length));
+}
+
+static uint64_t sys_dup(machine_t *m) {
+  GET(a0, fd);
+  return fd_forget(m, host_ret(dup(fd)));
+}
+
+static uint64_t sys_dup3(machine_t *m) {
+  GET(a0, oldfd);
+  GET(a1, newfd);
+  GET(a2, flags);
+  // keep rvemu's stdio, like close does
+  if (newfd <= 2)
+    return -EBADF;
+  return fd_forget(m, host_ret(dup3(oldfd, newfd, flags)));
+}
+
+static uint64_t sys_fcntl(machine_t *m) {
+  GET(a0, fd);
+  GET(a1, cmd);
+  GET(a2, arg);
+  switch (cmd) {
+  case F_GETLK:
+  case F_SETLK:
+  case F_SETLKW: {
+    int64_t ret =
+        host_ret(fcntl(fd, cmd, (struct flock *)GUEST_TO_HOST(arg)));
+    if (ret == 0 && cmd == F_GETLK)
+      EFFECT(arg, sizeof(struct flock));
+    return ret;
+  }
+  case F_DUPFD:
+  case F_DUPFD_CLOEXEC:
+    return fd_forget(m, host_ret(fcntl(fd, cmd, arg)));
+  case F_GETFD:
+  case F_SETFD:
+  case F_GETFL:
+  case F_SETFL:
+    return host_ret(fcntl(fd, cmd, arg));
+  default:
+    return -EINVAL;
+  }
+}
+
+static uint64_t sys_ioctl(machine_t *m) {
+  GET(a0, fd);
+  GET(a1, req);
+  GET(a2, arg);
+  // only the terminal queries of isatty and friends
+  size_t size;
+  switch (req) {
+  case TCGETS:
+    size = sizeof(struct termios);
+    break;
+  case TIOCGWINSZ:
+    size = sizeof(struct winsize);
+    break;
+  case FIONREAD:
+    size = sizeof(int);
+    break;
+  default:
+    return -ENOTTY;
+  }
+  int64_t ret = host_ret(ioctl(fd, req, GUEST_TO_HOST(arg)));
+  if (ret == 0)
+    EFFECT(arg, size);
+  return ret;
+}
+
+static uint64_t sys_uname(machine_t *m) {
+  GET(a0, addr);
+  struct utsname *u = (struct utsname *)GUEST_TO_HOST(addr);
+  int64_t ret = host_ret(uname(u));
+  if (ret == 0) {
+    strcpy(u->machine, "riscv64");
+    EFFECT(addr, sizeof(struct utsname));
+  }
+  return ret;
+}
+
+static uint64_t sys_getuid(machine_t *m) { return getuid(); }
+
+static uint64_t sys_geteuid(machine_t *m) { return geteuid(); }
+
+static uint64_t sys_getgid(machine_t *m) { return getgid(); }
+
+static uint64_t sys_getegid(machine_t *m) { return getegid(); }
+
 // static uint64_t sys_gettimeofday(machine_t *m) {
 //   GET(a0, tv_addr);
 //   GET(a1, tz_addr);
@@ -122,89 +796,269 @@ static uint64_t sys_fstat(machine_t *m) {
 
 static uint64_t sys_brk(machine_t *m) {
   GET(a0, addr);
-  if (addr == 0)
-    addr = m->mmu.alloc;
-  assert(addr >= m->mmu.base);
-  int64_t incr = (int64_t)addr - m->mmu.alloc;
-  mmu_alloc(&m->mmu, incr);
-  return addr;
+  return mmu_brk(m->mmu, addr);
+}
+
+/**
+ * @brief gettimeofday through the time source, tz is what the host says
+ *
+ * @param m
+ * @param tv_addr guest struct timeval, 0 if none
+ * @param tz_addr guest struct timezone, 0 if none
+ * @return
+ */
+static uint64_t guest_gettimeofday(machine_t *m, uint64_t tv_addr,
+                                   uint64_t tz_addr) {
+  if (tv_addr != 0) {
+    struct timespec ts;
+    if (guest_clock_gettime(m, CLOCK_REALTIME, &ts) != 0)
+      return -errno;
+    struct timeval *tv = (struct timeval *)GUEST_TO_HOST(tv_addr);
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / 1000;
+  }
+  struct timeval host_tv;
+  if (tz_addr != 0 &&
+      gettimeofday(&host_tv, (void *)GUEST_TO_HOST(tz_addr)) != 0)
+    return -errno;
+  return 0;
 }
 
 static uint64_t sys_gettimeofday(machine_t *m) {
   GET(a0, tp_addr);
   GET(a1, tzp_addr);
-  struct timeval *tp = (struct timeval *)GUEST_TO_HOST(tp_addr);
-  void *tzp = NULL;
-  if (tzp_addr != 0)
-    tzp = (void *)GUEST_TO_HOST(tzp_addr);
-  return gettimeofday(tp, tzp);
+  uint64_t ret = guest_gettimeofday(m, tp_addr, tzp_addr);
+  if (ret == 0) {
+    if (tp_addr != 0)
+      EFFECT(tp_addr, sizeof(struct timeval));
+    if (tzp_addr != 0)
+      EFFECT(tzp_addr, sizeof(struct timezone));
+  }
+  return ret;
+}
+
+static uint64_t sys_clock_gettime(machine_t *m) {
+  GET(a0, clockid);
+  GET(a1, tp_addr);
+  // struct timespec has the same layout on rv64 and the 64 bit hosts
+  uint64_t ret = host_ret(guest_clock_gettime(
+      m, clockid, (struct timespec *)GUEST_TO_HOST(tp_addr)));
+  if (ret == 0)
+    EFFECT(tp_addr, sizeof(struct timespec));
+  return ret;
+}
+
+static uint64_t sys_snapshot(machine_t *m) {
+  if (m->snapshot == NULL && !m->fork_server)
+    return 0;
+  Assert(m->mmu->nharts == 1, "snapshot needs a single hart");
+  if (m->snapshot != NULL)
+    machine_snapshot(m, m->snapshot);
+  if (m->fork_server) {
+    m->fork_server = false;
+    fork_server(m);
+  }
+  return 0;
 }
 
 static syscall_t syscall_table[] = {
     [SYS_exit] = sys_exit,
-    [SYS_exit_group] = sys_unimplemented,
+    [SYS_exit_group] = sys_exit_group,
     [SYS_read] = sys_read,
-    [SYS_pread] = sys_unimplemented,
+    [SYS_pread] = sys_pread,
+    [SYS_pwrite] = sys_pwrite,
+    [SYS_fsync] = sys_fsync,
     [SYS_write] = sys_write,
-    [SYS_openat] = sys_unimplemented,
+    [SYS_openat] = sys_openat,
     [SYS_close] = sys_close,
     [SYS_fstat] = sys_fstat,
-    [SYS_statx] = sys_unimplemented,
-    [SYS_lseek] = sys_unimplemented,
-    [SYS_fstatat] = sys_unimplemented,
-    [SYS_linkat] = sys_unimplemented,
-    [SYS_unlinkat] = sys_unimplemented,
-    [SYS_mkdirat] = sys_unimplemented,
-    [SYS_renameat] = sys_unimplemented,
-    [SYS_getcwd] = sys_unimplemented,
+    [SYS_statx] = sys_statx,
+    [SYS_lseek] = sys_lseek,
+    [SYS_fstatat] = sys_fstatat,
+    [SYS_linkat] = sys_linkat,
+    [SYS_unlinkat] = sys_unlinkat,
+    [SYS_mkdirat] = sys_mkdirat,
+    [SYS_renameat] = sys_renameat,
+    [SYS_getcwd] = sys_getcwd,
     [SYS_brk] = sys_brk,
-    [SYS_uname] = sys_unimplemented,
-    [SYS_getpid] = sys_unimplemented,
-    [SYS_getuid] = sys_unimplemented,
-    [SYS_geteuid] = sys_unimplemented,
-    [SYS_getgid] = sys_unimplemented,
-    [SYS_getegid] = sys_unimplemented,
-    [SYS_gettid] = sys_unimplemented,
+    [SYS_uname] = sys_uname,
+    [SYS_getpid] = sys_getpid,
+    [SYS_getuid] = sys_getuid,
+    [SYS_geteuid] = sys_geteuid,
+    [SYS_getgid] = sys_getgid,
+    [SYS_getegid] = sys_getegid,
+    [SYS_gettid] = sys_gettid,
     [SYS_tgkill] = sys_unimplemented,
-    [SYS_mmap] = sys_unimplemented,
-    [SYS_munmap] = sys_unimplemented,
+    [SYS_mmap] = sys_mmap,
+    [SYS_munmap] = sys_munmap,
     [SYS_mremap] = sys_unimplemented,
-    [SYS_mprotect] = sys_unimplemented,
+    [SYS_mprotect] = sys_mprotect,
     [SYS_rt_sigaction] = sys_unimplemented,
     [SYS_gettimeofday] = sys_gettimeofday,
     [SYS_times] = sys_unimplemented,
-    [SYS_writev] = sys_unimplemented,
-    [SYS_faccessat] = sys_unimplemented,
-    [SYS_fcntl] = sys_unimplemented,
-    [SYS_ftruncate] = sys_unimplemented,
-    [SYS_getdents] = sys_unimplemented,
-    [SYS_dup] = sys_unimplemented,
-    [SYS_dup3] = sys_unimplemented,
-    [SYS_rt_sigprocmask] = sys_unimplemented,
-    [SYS_clock_gettime] = sys_unimplemented,
-    [SYS_chdir] = sys_unimplemented,
+    [SYS_readv] = sys_readv,
+    [SYS_writev] = sys_writev,
+    [SYS_readlinkat] = sys_readlinkat,
+    [SYS_ioctl] = sys_ioctl,
+    [SYS_faccessat] = sys_faccessat,
+    [SYS_fcntl] = sys_fcntl,
+    [SYS_ftruncate] = sys_ftruncate,
+    [SYS_getdents64] = sys_getdents64,
+    [SYS_dup] = sys_dup,
+    [SYS_dup3] = sys_dup3,
+    [SYS_rt_sigprocmask] = sys_rt_sigprocmask,
+    [SYS_clock_gettime] = sys_clock_gettime,
+    [SYS_chdir] = sys_chdir,
+    [SYS_clone] = sys_clone,
+    [SYS_futex] = sys_futex,
+    [SYS_set_tid_address] = sys_set_tid_address,
+    [SYS_set_robust_list] = sys_set_robust_list,
+    [SYS_sched_yield] = sys_sched_yield,
+    [SYS_madvise] = sys_madvise,
 };
 
 static syscall_t old_syscall_table[] = {
-    [-OLD_SYSCALL_THRESHOLD + SYS_open] = sys_unimplemented,
-    [-OLD_SYSCALL_THRESHOLD + SYS_link] = sys_unimplemented,
-    [-OLD_SYSCALL_THRESHOLD + SYS_unlink] = sys_unimplemented,
-    [-OLD_SYSCALL_THRESHOLD + SYS_mkdir] = sys_unimplemented,
-    [-OLD_SYSCALL_THRESHOLD + SYS_access] = sys_unimplemented,
-    [-OLD_SYSCALL_THRESHOLD + SYS_stat] = sys_unimplemented,
-    [-OLD_SYSCALL_THRESHOLD + SYS_lstat] = sys_unimplemented,
+    [-OLD_SYSCALL_THRESHOLD + SYS_open] = sys_open,
+    [-OLD_SYSCALL_THRESHOLD + SYS_link] = sys_link,
+    [-OLD_SYSCALL_THRESHOLD + SYS_unlink] = sys_unlink,
+    [-OLD_SYSCALL_THRESHOLD + SYS_mkdir] = sys_mkdir,
+    [-OLD_SYSCALL_THRESHOLD + SYS_access] = sys_access,
+    [-OLD_SYSCALL_THRESHOLD + SYS_stat] = sys_stat,
+    [-OLD_SYSCALL_THRESHOLD + SYS_lstat] = sys_lstat,
     [-OLD_SYSCALL_THRESHOLD + SYS_time] = sys_unimplemented,
 };
 
+/*
+ * syscalls whose result depends on the host, the only ones logged by
+ * --record and skipped by --replay. the others only change emulator state
+ * and run in both modes.
+ */
+static bool replayed[] = {
+    [SYS_read] = true,
+    [SYS_write] = true,
+    [SYS_pread] = true,
+    [SYS_pwrite] = true,
+    [SYS_fsync] = true,
+    [SYS_openat] = true,
+    [SYS_lseek] = true,
+    [SYS_readv] = true,
+    [SYS_writev] = true,
+    [SYS_fstatat] = true,
+    [SYS_statx] = true,
+    [SYS_getdents64] = true,
+    [SYS_faccessat] = true,
+    [SYS_readlinkat] = true,
+    [SYS_unlinkat] = true,
+    [SYS_mkdirat] = true,
+    [SYS_linkat] = true,
+    [SYS_renameat] = true,
+    [SYS_getcwd] = true,
+    [SYS_chdir] = true,
+    [SYS_ftruncate] = true,
+    [SYS_dup] = true,
+    [SYS_dup3] = true,
+    [SYS_fcntl] = true,
+    [SYS_ioctl] = true,
+    [SYS_uname] = true,
+    [SYS_getuid] = true,
+    [SYS_geteuid] = true,
+    [SYS_getgid] = true,
+    [SYS_getegid] = true,
+    [SYS_close] = true,
+    [SYS_fstat] = true,
+    [SYS_getpid] = true,
+    [SYS_gettimeofday] = true,
+    [SYS_clock_gettime] = true,
+    [SYS_sched_yield] = true,
+    [SYS_open] = true,
+    [SYS_link] = true,
+    [SYS_unlink] = true,
+    [SYS_mkdir] = true,
+    [SYS_access] = true,
+    [SYS_stat] = true,
+    [SYS_lstat] = true,
+};
+
 uint64_t do_syscall(machine_t *m, uint64_t n) {
   syscall_t f = NULL;
   if (n < ARRAY_SIZE(syscall_table))
     f = syscall_table[n];
   else if (n - OLD_SYSCALL_THRESHOLD < ARRAY_SIZE(old_syscall_table))
     f = old_syscall_table[n - OLD_SYSCALL_THRESHOLD];
+  else if (n == SYS_snapshot)
+    f = sys_snapshot;
 
   if (!f)
     panic("unknown syscall");
 
-  return f(m);
+  // deferred writes land before anything else the guest can observe
+  if (m->uring && n != SYS_write && n != SYS_pwrite)
+    uring_flush(m->uring);
+  if (m->coalesce && n != SYS_write && n != SYS_writev)
+    coalesce_flush(m->coalesce);
+
+  if (m->replay == NULL || n >= ARRAY_SIZE(replayed) || !replayed[n])
+    return f(m);
+
+  if (m->replay->record) {
+    uint64_t ret = f(m);
+    replay_record(m->replay, n, ret);
+    return ret;
+  }
+  return replay_next(m->replay, n);
+}
+
+/**
+ * @brief whether syscall_fast may serve nr, codegen only inlines these
+ *
+ * @param nr
+ * @return
+ */
+bool syscall_fast_nr(uint64_t nr) {
+  return nr == SYS_getpid || nr == SYS_gettid || nr == SYS_gettimeofday ||
+         nr == SYS_clock_gettime || nr == SYS_brk;
+}
+
+/**
+ * @brief serve a syscall without leaving the JIT block
+ *
+ * only syscalls that touch neither files nor the memory map, so nothing
+ * deferred by uring or coalesce has to land first. machine_run_for leaves
+ * the pointer NULL when every syscall must be seen by replay or the hook.
+ *
+ * @param state state of the hart, the first member of its machine_t
+ * @param nr
+ * @param a0
+ * @param a1
+ * @param ret a0 of the guest when served
+ * @return false to take the ecall exit
+ */
+bool syscall_fast(void *state, uint64_t nr, uint64_t a0, uint64_t a1,
+                  uint64_t *ret) {
+  machine_t *m = (machine_t *)state;
+  if (!syscall_fast_nr(nr) || (nr == SYS_brk && a0 != 0) ||
+      (nr == SYS_gettimeofday && (a0 == 0 || a1 != 0)))
+    return false;
+  if (m->stats)
+    STATS_ADD(m->stats, fast_syscalls, 1);
+
+  switch (nr) {
+  case SYS_getpid:
+    *ret = getpid();
+    return true;
+  case SYS_gettid:
+    *ret = m->tid;
+    return true;
+  case SYS_gettimeofday:
+    *ret = guest_gettimeofday(m, a0, 0);
+    return true;
+  case SYS_clock_gettime:
+    *ret = host_ret(
+        guest_clock_gettime(m, a0, (struct timespec *)GUEST_TO_HOST(a1)));
+    return true;
+  case SYS_brk: // only the query, growing changes the memory map
+    *ret = m->mmu->alloc;
+    return true;
+  }
+  return false;
 }
@@ -0,0 +1,79 @@
+/**
+ * @file timesrc.c
+ * @brief guest clocks and counter csrs, real or following instret
+ */
+
+#include "rvemu.h"
+#include <x86intrin.h>
+
+#define NS_PER_SEC 1000000000ULL
+
+bool csr_is_counter(uint64_t csr) {
+  return csr == CSR_CYCLE || csr == CSR_TIME || csr == CSR_INSTRET;
+}
+
+static uint64_t host_monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * @brief read a counter csr, the interpreter and JIT code both come here
+ *
+ * @param state state of the hart, the first member of its machine_t
+ * @param csr one of the csr_is_counter csrs
+ * @param instret retired instructions of the hart so far
+ * @return
+ */
+uint64_t csr_read(void *state, uint64_t csr, uint64_t instret) {
+  machine_t *m = (machine_t *)state;
+  switch (csr) {
+  case CSR_CYCLE:
+    return m->virtual_clock ? instret : __rdtsc();
+  case CSR_TIME:
+    if (m->virtual_clock)
+      return instret * VCLOCK_NS_PER_INST / (NS_PER_SEC / TIMEBASE_FREQ);
+    return host_monotonic_ns() / (NS_PER_SEC / TIMEBASE_FREQ);
+  case CSR_INSTRET:
+    return instret;
+  }
+  fatalf("unimplemented csr %#lx", csr);
+}
+
+/**
+ * @brief clock_gettime of the guest
+ *
+ * @param m
+ * @param clk
+ * @param ts
+ * @return 0, or -1 with errno set
+ */
+int guest_clock_gettime(machine_t *m, clockid_t clk, struct timespec *ts) {
+  if (!m->virtual_clock)
+    return clock_gettime(clk, ts);
+
+  uint64_t ns = m->state.icount * VCLOCK_NS_PER_INST;
+  switch (clk) {
+  case CLOCK_REALTIME:
+  case CLOCK_REALTIME_COARSE:
+  case CLOCK_REALTIME_ALARM:
+  case CLOCK_TAI:
+    ns += VCLOCK_EPOCH * NS_PER_SEC;
+    break;
+  case CLOCK_MONOTONIC:
+  case CLOCK_MONOTONIC_RAW:
+  case CLOCK_MONOTONIC_COARSE:
+  case CLOCK_BOOTTIME:
+  case CLOCK_BOOTTIME_ALARM:
+  case CLOCK_PROCESS_CPUTIME_ID:
+  case CLOCK_THREAD_CPUTIME_ID:
+    break;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+  ts->tv_sec = ns / NS_PER_SEC;
+  ts->tv_nsec = ns % NS_PER_SEC;
+  return 0;
+}
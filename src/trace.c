@@ -0,0 +1,101 @@
+#include "rvemu.h"
+#include <pthread.h>
+#include <sys/uio.h>
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_t *traces;
+
+static void trace_flush_all(void) {
+  pthread_mutex_lock(&trace_lock);
+  for (trace_t *t = traces; t != NULL; t = t->next)
+    trace_flush(t);
+  pthread_mutex_unlock(&trace_lock);
+}
+
+static trace_t *trace_alloc(int fd, uint32_t tid) {
+  trace_t *trace = (trace_t *)malloc(sizeof(trace_t));
+  Assert(trace != NULL, "trace buffer: %s", strerror(errno));
+  trace->fd = fd;
+  trace->tid = tid;
+  trace->last_pc = 0;
+  trace->len = 0;
+
+  pthread_mutex_lock(&trace_lock);
+  trace->next = traces;
+  traces = trace;
+  pthread_mutex_unlock(&trace_lock);
+  return trace;
+}
+
+/**
+ * @brief create the trace file and the trace of the first hart
+ *
+ * @param path
+ * @param tid
+ * @return
+ */
+trace_t *new_trace(const char *path, uint32_t tid) {
+  int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644);
+  Assert(fd != -1, "open %s: %s", path, strerror(errno));
+  Assert(write(fd, TRACE_MAGIC, strlen(TRACE_MAGIC)) ==
+             (ssize_t)strlen(TRACE_MAGIC),
+         "write %s: %s", path, strerror(errno));
+
+  atexit(trace_flush_all);
+  return trace_alloc(fd, tid);
+}
+
+/**
+ * @brief trace of a new hart, writing into the same file
+ *
+ * @param trace
+ * @param tid
+ * @return
+ */
+trace_t *trace_hart(trace_t *trace, uint32_t tid) {
+  return trace_alloc(trace->fd, tid);
+}
+
+/**
+ * @brief keep only the trace of the forking hart in the child
+ *
+ * the buffers of the other harts were copied by fork, the parent writes
+ * them out. the forking hart flushes before fork so nothing is doubled.
+ *
+ * @param trace
+ * @param tid
+ */
+void trace_forked(trace_t *trace, uint32_t tid) {
+  pthread_mutex_init(&trace_lock, NULL);
+  trace->tid = tid;
+  trace->next = NULL;
+  traces = trace;
+}
+
+/**
+ * @brief write the buffered records as one chunk
+ *
+ * a single writev on an O_APPEND file, chunks of different harts never
+ * interleave.
+ *
+ * @param trace
+ */
+void trace_flush(trace_t *trace) {
+  if (trace->len == 0)
+    return;
+
+  trace_chunk_t chunk = {.tid = trace->tid, .size = trace->len};
+  struct iovec iov[2] = {
+      {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+      {.iov_base = trace->buf, .iov_len = trace->len},
+  };
+  ssize_t n;
+  do {
+    n = writev(trace->fd, iov, 2);
+  } while (n < 0 && errno == EINTR);
+  Assert(n == (ssize_t)(sizeof(chunk) + trace->len), "trace write: %s",
+         n < 0 ? strerror(errno) : "short write");
+
+  trace->len = 0;
+  trace->last_pc = 0;
+}
@@ -0,0 +1,227 @@
+/**
+ * @file uring.c
+ * @brief guest I/O through io_uring, see uring.h
+ */
+
+#include "rvemu.h"
+#include <asm/unistd.h>
+#include <sys/stat.h>
+
+// user_data of a deferred write, the low bits hold its length
+#define URING_DEFERRED (1ULL << 63)
+
+static int uring_enter(uring_t *u, uint32_t submit, uint32_t wait) {
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, u->fd, submit, wait,
+                  wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+/**
+ * @brief set up the rings
+ *
+ * @return NULL when the host has no usable io_uring, the syscalls then
+ * stay synchronous
+ */
+uring_t *new_uring(void) {
+  struct io_uring_params p = {0};
+  int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (fd < 0)
+    return NULL;
+  // reads and writes at the file position need IORING_FEAT_RW_CUR_POS
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_RW_CUR_POS)) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  size_t ring_size = MAX(sq_size, cq_size);
+  uint8_t *ring = (uint8_t *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, fd,
+                                  IORING_OFF_SQ_RING);
+  struct io_uring_sqe *sqes = (struct io_uring_sqe *)mmap(
+      NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+
+  uring_t *u = (uring_t *)calloc(1, sizeof(uring_t));
+  u->fd = fd;
+  u->sq_head = (uint32_t *)(ring + p.sq_off.head);
+  u->sq_tail = (uint32_t *)(ring + p.sq_off.tail);
+  u->sq_mask = *(uint32_t *)(ring + p.sq_off.ring_mask);
+  u->sq_array = (uint32_t *)(ring + p.sq_off.array);
+  u->sqes = sqes;
+  u->cq_head = (uint32_t *)(ring + p.cq_off.head);
+  u->cq_tail = (uint32_t *)(ring + p.cq_off.tail);
+  u->cq_mask = *(uint32_t *)(ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+  u->staging = (uint8_t *)malloc(URING_STAGING_SIZE);
+  pthread_mutex_init(&u->lock, NULL);
+  return u;
+}
+
+static struct io_uring_sqe *uring_sqe(uring_t *u, uint8_t opcode, int fd,
+                                      const void *buf, size_t len,
+                                      int64_t off) {
+  uint32_t tail = *u->sq_tail;
+  uint32_t index = tail & u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)buf;
+  sqe->len = len;
+  sqe->off = off;
+  u->sq_array[index] = index;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+/**
+ * @brief reap every completion, remembering the first failed deferred
+ * write
+ *
+ * @param u
+ * @param deferred counts the deferred writes reaped
+ * @return result of the last non deferred operation
+ */
+static int64_t uring_reap(uring_t *u, uint32_t *deferred) {
+  int64_t res = 0;
+  uint32_t head = *u->cq_head;
+  while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+    if (cqe->user_data & URING_DEFERRED) {
+      uint64_t len = cqe->user_data & ~URING_DEFERRED;
+      if (u->error == 0 && cqe->res < 0)
+        u->error = cqe->res;
+      else if (u->error == 0 && (uint64_t)cqe->res != len)
+        u->error = -EIO;
+      (*deferred)++;
+    } else {
+      res = cqe->res;
+    }
+    head++;
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+  return res;
+}
+
+static void uring_flush_locked(uring_t *u) {
+  if (u->queued == 0)
+    return;
+  // the chain must not end in a link, it would join the next submission
+  u->sqes[(*u->sq_tail - 1) & u->sq_mask].flags &= ~IOSQE_IO_LINK;
+  Assert(uring_enter(u, u->queued, u->queued) >= 0, "io_uring_enter: %s",
+         strerror(errno));
+
+  uint32_t done = 0;
+  uring_reap(u, &done);
+  while (done < u->queued) {
+    uring_enter(u, 0, 1);
+    uring_reap(u, &done);
+  }
+  u->queued = 0;
+  u->staging_used = 0;
+}
+
+/**
+ * @brief submit the deferred writes and wait for them
+ *
+ * @param u
+ */
+void uring_flush(uring_t *u) {
+  pthread_mutex_lock(&u->lock);
+  uring_flush_locked(u);
+  pthread_mutex_unlock(&u->lock);
+}
+
+static int64_t uring_sync(uring_t *u, uint8_t opcode, int fd, const void *buf,
+                          size_t len, int64_t off) {
+  pthread_mutex_lock(&u->lock);
+  uring_flush_locked(u);
+  uring_sqe(u, opcode, fd, buf, len, off);
+  uint32_t done = 0;
+  int ret = uring_enter(u, 1, 1);
+  int64_t res = ret < 0 ? -errno : uring_reap(u, &done);
+  pthread_mutex_unlock(&u->lock);
+  return res;
+}
+
+/**
+ * @brief read into guest memory, waits for the data
+ *
+ * @param off file offset, -1 for the file position
+ */
+int64_t uring_read(uring_t *u, int fd, void *buf, size_t len, int64_t off) {
+  return uring_sync(u, IORING_OP_READ, fd, buf, len, off);
+}
+
+// only writes to regular files are deferred, they do not fail or come
+// short the way pipes and sockets do
+static bool uring_regular(uring_t *u, int fd) {
+  if (fd < 0 || fd >= URING_MAX_FD)
+    return false;
+  if (u->regular[fd] == 0) {
+    struct stat st;
+    u->regular[fd] = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? 1 : -1;
+  }
+  return u->regular[fd] == 1;
+}
+
+/**
+ * @brief the fd was closed or may name another file now
+ *
+ * @param u
+ * @param fd
+ */
+void uring_forget(uring_t *u, int fd) {
+  if (fd >= 0 && fd < URING_MAX_FD)
+    u->regular[fd] = 0;
+}
+
+/**
+ * @brief write guest memory, small writes to regular files return at once
+ * and complete in order with the next flush
+ *
+ * @param off file offset, -1 for the file position
+ * @return len for a deferred write, its errors show up in the next fsync
+ */
+int64_t uring_write(uring_t *u, int fd, const void *buf, size_t len,
+                    int64_t off) {
+  if (len > URING_DEFER_MAX || !uring_regular(u, fd))
+    return uring_sync(u, IORING_OP_WRITE, fd, buf, len, off);
+
+  pthread_mutex_lock(&u->lock);
+  if (u->staging_used + len > URING_STAGING_SIZE || u->queued == URING_ENTRIES)
+    uring_flush_locked(u);
+
+  uint8_t *copy = u->staging + u->staging_used;
+  memcpy(copy, buf, len);
+  u->staging_used += len;
+
+  struct io_uring_sqe *sqe = uring_sqe(u, IORING_OP_WRITE, fd, copy, len, off);
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = URING_DEFERRED | len;
+  u->queued++;
+  pthread_mutex_unlock(&u->lock);
+  return len;
+}
+
+int64_t uring_fsync(uring_t *u, int fd) {
+  int64_t res = uring_sync(u, IORING_OP_FSYNC, fd, NULL, 0, 0);
+
+  pthread_mutex_lock(&u->lock);
+  if (u->error != 0) {
+    res = u->error;
+    u->error = 0;
+  }
+  pthread_mutex_unlock(&u->lock);
+  return res;
+}
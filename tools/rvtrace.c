@@ -0,0 +1,160 @@
+/**
+ * @file rvtrace.c
+ * @brief decode the block trace written by rvemu --trace
+ *
+ * rvtrace FILE       one "tid pc insts" line per executed block
+ * rvtrace -s FILE    blocks by retired instructions, hottest first
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+typedef struct {
+  uint64_t pc;
+  uint64_t blocks;
+  uint64_t insts;
+} block_t;
+
+static block_t *table;
+static uint64_t table_size;
+static uint64_t table_used;
+
+static block_t *table_get(uint64_t pc) {
+  if (table_used * 2 >= table_size) {
+    block_t *old = table;
+    uint64_t old_size = table_size;
+    table_size = table_size ? table_size * 2 : 4096;
+    table = (block_t *)calloc(table_size, sizeof(block_t));
+    table_used = 0;
+    for (uint64_t i = 0; i < old_size; i++) {
+      if (old[i].blocks == 0)
+        continue;
+      block_t *b = table_get(old[i].pc);
+      *b = old[i];
+    }
+    free(old);
+  }
+
+  uint64_t i = (pc * 0x9e3779b97f4a7c15ULL) & (table_size - 1);
+  while (table[i].blocks != 0 && table[i].pc != pc)
+    i = (i + 1) & (table_size - 1);
+  if (table[i].blocks == 0) {
+    table[i].pc = pc;
+    table_used++;
+  }
+  return &table[i];
+}
+
+static int block_cmp(const void *a, const void *b) {
+  const block_t *x = a, *y = b;
+  if (x->insts != y->insts)
+    return x->insts > y->insts ? -1 : 1;
+  return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+static void summary(void) {
+  uint64_t n = 0, total = 0;
+  for (uint64_t i = 0; i < table_size; i++) {
+    if (table[i].blocks == 0)
+      continue;
+    total += table[i].insts;
+    table[n++] = table[i];
+  }
+  qsort(table, n, sizeof(block_t), block_cmp);
+
+  printf("%-18s %12s %14s %7s\n", "pc", "blocks", "insts", "%");
+  for (uint64_t i = 0; i < n; i++)
+    printf("0x%016" PRIx64 " %12" PRIu64 " %14" PRIu64 " %6.2f%%\n",
+           table[i].pc, table[i].blocks, table[i].insts,
+           total ? 100.0 * table[i].insts / total : 0.0);
+  printf("total: %" PRIu64 " distinct blocks, %" PRIu64 " insts\n", n, total);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-s] trace\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  bool sum = false;
+  int c;
+  while ((c = getopt(argc, argv, "s")) != -1) {
+    if (c != 's')
+      usage(argv[0]);
+    sum = true;
+  }
+  if (optind + 1 != argc)
+    usage(argv[0]);
+
+  const char *path = argv[optind];
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  size_t magic_len = strlen(TRACE_MAGIC);
+  if ((size_t)st.st_size < magic_len) {
+    fprintf(stderr, "%s: not a trace\n", path);
+    return 1;
+  }
+  const uint8_t *data =
+      (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED || memcmp(data, TRACE_MAGIC, magic_len) != 0) {
+    fprintf(stderr, "%s: not a trace\n", path);
+    return 1;
+  }
+
+  const uint8_t *p = data + magic_len;
+  const uint8_t *end = data + st.st_size;
+  while (p < end) {
+    trace_chunk_t chunk;
+    if ((size_t)(end - p) < sizeof(chunk)) {
+      fprintf(stderr, "%s: truncated chunk header\n", path);
+      return 1;
+    }
+    memcpy(&chunk, p, sizeof(chunk));
+    p += sizeof(chunk);
+    if ((size_t)(end - p) < chunk.size) {
+      fprintf(stderr, "%s: truncated chunk\n", path);
+      return 1;
+    }
+
+    const uint8_t *chunk_end = p + chunk.size;
+    uint64_t pc = 0;
+    while (p < chunk_end) {
+      uint64_t delta, insts;
+      p = trace_get_varint(p, chunk_end, &delta);
+      if (p != NULL)
+        p = trace_get_varint(p, chunk_end, &insts);
+      if (p == NULL) {
+        fprintf(stderr, "%s: bad record\n", path);
+        return 1;
+      }
+
+      pc += trace_unzigzag(delta);
+      if (sum) {
+        block_t *b = table_get(pc);
+        b->blocks++;
+        b->insts += insts;
+      } else {
+        printf("%" PRIu32 " 0x%" PRIx64 " %" PRIu64 "\n", chunk.tid, pc, insts);
+      }
+    }
+  }
+
+  if (sum)
+    summary();
+  return 0;
+}